@@ -34,75 +34,221 @@ typedef unsigned short uint16_t;
 typedef unsigned int uint32_t;
 #endif
 
+/* deprecated: REF and PLY points are no longer limited, these are only
+   kept so code sizing its own arrays with them still compiles */
 #define BSB_MAX_REFS 200
 #define BSB_MAX_PLYS 20
+/* number of polynomial coefficients kept for WPX/WPY/PWX/PWY */
 #define BSB_MAX_AFTS 20
 
+/* user supplied I/O functions for bsb_open_io() */
+typedef struct BSBIO
+{
+    /* read up to size bytes at the current position, returns bytes read */
+    size_t (*read)(void *handle, void *buf, size_t size);
+    /* only called with SEEK_SET, returns 0 on success like fseek() */
+    int (*seek)(void *handle, long offset, int whence);
+    /* size of the whole chart in bytes */
+    long (*size)(void *handle);
+    /* optional, called by bsb_close() */
+    void (*close)(void *handle);
+} BSBIO;
+
+/* geo reference point */
+struct REF
+{
+    int id;
+    int x;
+    int y;
+    double lon;
+    double lat;
+};
+
+/* chart border point */
+struct PLY
+{
+    int id;
+    double lat;
+    double lon;
+};
+
+/* interpolation lattice of the transforms and prepared PLY border,
+   private to bsb_io.c */
+struct BSBLattice;
+struct BSBBorder;
+
+/*
+ * The fields used for decoding rows come first so they share a cache
+ * line, the georeferencing data is allocated separately (and freed by
+ * bsb_close()) which keeps the handle small.
+ */
 typedef struct BSBImage
 {
+    int     width;
+    int     height;
+    char    depth;
+    char    num_colors;
+
+    /* private: */
+    /* the fields up to and including pFile are what decoding a row of a
+       mapped or FILE* chart reads and fit in the first 64 bytes on LP64
+       (checked in bsb_io.c); rbuf, user I/O and the transforms follow */
+    char obfuscated;    /* .NO1 file, ROT-9 is undone as bytes are read */
+    /* intra-row x checkpoints (see bsb_build_xindex), per row xindex_cols
+       pairs of offset in the compressed row and x of the run there */
+    int xindex_step;
+    int xindex_cols;
+    uint32_t* row_index;
+    /* read-only mapping of the whole file (see bsb_open_header_mmap)
+       or the caller's buffer (see bsb_open_mem) */
+    const uint8_t* map;
+    size_t map_size;
+    uint32_t* xindex;
+    FILE* pFile;
+    unsigned char* rbuf;
+    /* size of the text header and whether the raster (depth byte and row
+       index) has been read yet (see bsb_open_header_only) */
+    int raster_attached;
+    long text_size;
+    /* offset of the first row and whether rebuilding a missing row
+       index failed, so it is not retried (see bsb_build_row_index) */
+    uint32_t raster_offset;
+    int row_index_failed;
+    /* user I/O (see bsb_open_io) and the position in a memory buffer
+       or user I/O chart */
+    const BSBIO* io;
+    void* io_handle;
+    size_t pos;
+    /* second handle of the file for positional reads on Windows, where
+       a ReadFile() at an offset also moves the position of pFile */
+    void* pread_handle;
+    /* index cache the header, row index and x checkpoints were loaded
+       from, mapped or read into memory (see bsb_write_index_cache) */
+    const uint8_t* cache_map;
+    size_t cache_size;
+    /* declared access pattern, number of rows to prefetch and the row
+       up to which rows have been prefetched (see bsb_set_access_pattern) */
+    int access_pattern;
+    int prefetch_rows;
+    int prefetch_next;
+    /* evaluators of the wpx/wpy and pwx/pwy polynomials and their number
+       of terms, chosen when the header is read (see bsb_select_polytrans) */
+    double (*wp_trans)(const double*, double, double);
+    double (*pw_trans)(const double*, double, double);
+    int wp_terms;
+    int pw_terms;
+    /* optional interpolation lattices of the pwx/pwy and wpx/wpy
+       polynomials (see bsb_build_transform_lattice) */
+    struct BSBLattice* pw_lattice;
+    struct BSBLattice* wp_lattice;
+    /* PLY border with bounding box and edge table (see bsb_contains) */
+    struct BSBBorder* border;
+
+    /* public: */
+    uint8_t red[256];
+    uint8_t green[256];
+    uint8_t blue[256];
+
     char    name[200];
     char    projection[50];
     char    datum[50];
-    char    depth;
     float   version;
-    int     width;
-    int     height;
     double  xresolution;
     double  yresolution;
     double  scale;
     /* usually 'scale given at latitude' with mercator projection */
     double  projectionparam;
 
-    uint8_t red[256];
-    uint8_t green[256];
-    uint8_t blue[256];
-    char    num_colors;
-
     /* geo reference points */
-    struct REF
-    {
-        int id;
-        int x;
-        int y;
-        double lon;
-        double lat;
-    } ref[BSB_MAX_REFS];
+    struct REF *ref;
     int num_refs;
 
     /* chart border points */
-    struct PLY
-    {
-        int id;
-        double lat;
-        double lon;
-    } ply[BSB_MAX_PLYS];
+    struct PLY *ply;
     int num_plys;
 
-    /* geotransforms from/to lat/lon & X,Y are polynomials */
+    /* geotransforms from/to lat/lon & X,Y are polynomials,
+       each with room for BSB_MAX_AFTS coefficients */
 
     /* wpx,wpy - world to pixel */
-    double wpx[BSB_MAX_AFTS];
+    double *wpx;
     int num_wpxs;
     int wpx_level;
-    double wpy[BSB_MAX_AFTS];
+    double *wpy;
     int num_wpys;
     int wpy_level;
     /* pwx,pwy - pixel to world */
-    double pwx[BSB_MAX_AFTS];
+    double *pwx;
     int num_pwxs;
     int pwx_level;
-    double pwy[BSB_MAX_AFTS];
+    double *pwy;
     int num_pwys;
     int pwy_level;
     /* phase change for charts crossing 180 longitude */
     double cph; 
 
-    /* private: */
-    FILE* pFile;
-    uint32_t* row_index;
-    unsigned char* rbuf;
+    /* private: allocated sizes of ref and ply */
+    int max_refs;
+    int max_plys;
 } BSBImage;
 
+/* output pixel formats of bsb_read_row_rgb() and friends */
+typedef enum BSBPixelFormat
+{
+    BSB_PIXEL_INDEX,    /* 8 bit palette index, same as bsb_read_row_part() */
+    BSB_PIXEL_RGB24,    /* bytes R,G,B */
+    BSB_PIXEL_RGBA32,   /* bytes R,G,B,A */
+    BSB_PIXEL_BGRA32,   /* bytes B,G,R,A */
+    BSB_PIXEL_ARGB32,   /* native endian 32 bit 0xAARRGGBB (Qt's Format_ARGB32) */
+    BSB_PIXEL_RGB565    /* native endian 16 bit 5-6-5 RGB */
+} BSBPixelFormat;
+
+/* resampling of bsb_read_mercator() */
+typedef enum BSBSampling
+{
+    BSB_SAMPLE_NEAREST,     /* nearest chart pixel */
+    BSB_SAMPLE_BILINEAR     /* colors of the 4 nearest chart pixels blended */
+} BSBSampling;
+
+/* how rows of a chart will be read, see bsb_set_access_pattern() */
+typedef enum BSBAccessPattern
+{
+    BSB_ACCESS_NORMAL,      /* no particular order, the default */
+    BSB_ACCESS_SEQUENTIAL,  /* top to bottom, like the converters */
+    BSB_ACCESS_RANDOM,      /* scattered rows or small tiles, no readahead */
+    BSB_ACCESS_BANDS        /* bands of rows moving up or down, like a viewer panning */
+} BSBAccessPattern;
+
+/* run of equal pixels as returned by bsb_read_row_runs() */
+typedef struct BSBRun
+{
+    uint8_t color;      /* palette index */
+    int     len;        /* number of pixels */
+} BSBRun;
+
+/* caller-owned scratch state for bsb_read_row_part_r(), one per thread */
+typedef struct BSBDecodeContext
+{
+    uint8_t* rbuf;
+    int      rbuf_size;
+    /* io_uring of bsb_read_rows_batch(), set up on first use */
+    void*    uring;
+    /* working memory of bsb_read_overview(), kept between rows */
+    void*    scratch;
+    size_t   scratch_size;
+} BSBDecodeContext;
+
+/* one row to read with bsb_read_rows_batch() */
+typedef struct BSBRowRequest
+{
+    const BSBImage* image;  /* chart to read from, must have a row index */
+    int      row;
+    int      xoffset;       /* X offset in the row to start reading from */
+    int      len;           /* number of pixels to read */
+    uint8_t* buf;           /* output buffer for len pixels */
+    int      ok;            /* set to 1 if the row was read */
+} BSBRowRequest;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -111,12 +257,46 @@ extern "C" {
 
 extern int bsb_get_header_size(FILE *fp);
 extern int bsb_open_header(char *filename, BSBImage *p);
+extern int bsb_open_header_only(char *filename, BSBImage *p);
+extern int bsb_attach_raster(BSBImage *p);
+extern int bsb_open_header_mmap(char *filename, BSBImage *p);
+extern int bsb_open_mem(const void *buf, size_t len, BSBImage *p);
+extern int bsb_open_io(const BSBIO *io, void *handle, BSBImage *p);
 extern int bsb_seek_to_row(BSBImage *p, int row);
 extern int bsb_read_row(BSBImage *p, uint8_t *buf);
 extern int bsb_read_row_at(BSBImage *p, int row, uint8_t *buf);
 extern int bsb_read_row_part(BSBImage *p, int row, uint8_t *buf, int xoffset, int len);
+extern void bsb_context_init(BSBDecodeContext *ctx);
+extern void bsb_context_free(BSBDecodeContext *ctx);
+extern int bsb_read_row_part_r(const BSBImage *p, BSBDecodeContext *ctx, int row, uint8_t *buf, int xoffset, int len);
+extern int bsb_read_row_runs(BSBImage *p, int row, BSBRun *runs, int maxruns, int xoffset, int len);
+extern int bsb_read_row_runs_r(const BSBImage *p, BSBDecodeContext *ctx, int row, BSBRun *runs, int maxruns, int xoffset, int len);
+extern int bsb_read_row_decimated(BSBImage *p, int row, uint8_t *buf, int xoffset, int len, int step);
+extern int bsb_read_row_decimated_r(const BSBImage *p, BSBDecodeContext *ctx, int row, uint8_t *buf, int xoffset, int len, int step);
+extern int bsb_read_window(BSBImage *p, int x, int y, int w, int h, int stride, uint8_t *buf);
+extern int bsb_read_rows_batch(BSBDecodeContext *ctx, BSBRowRequest *reqs, int n);
+extern int bsb_pixel_size(BSBPixelFormat fmt);
+extern int bsb_read_row_rgb(BSBImage *p, int row, uint8_t *buf, int xoffset, int len, BSBPixelFormat fmt);
+extern int bsb_read_row_rgb_r(const BSBImage *p, BSBDecodeContext *ctx, int row, uint8_t *buf, int xoffset, int len, BSBPixelFormat fmt);
+extern int bsb_read_image(BSBImage *p, uint8_t *buf, int stride, int row, int nrows, int nthreads);
+extern int bsb_read_image_rgb(BSBImage *p, uint8_t *buf, int stride, int row, int nrows, int nthreads, BSBPixelFormat fmt);
+extern int bsb_read_overview(BSBImage *p, int x, int y, int w, int h, int k, uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt);
+extern int bsb_read_mercator(BSBImage *p, double mx, double my, double res, int w, int h, uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt, BSBSampling sampling);
+extern int bsb_read_mercator_tile(BSBImage *p, int z, int tx, int ty, int size, uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt, BSBSampling sampling);
+extern int bsb_build_row_index(BSBImage *p);
+extern int bsb_set_access_pattern(BSBImage *p, BSBAccessPattern pattern, int prefetch_rows);
+extern int bsb_build_xindex(BSBImage *p, int step);
+extern int bsb_write_index_cache(BSBImage *p, const char *filename);
 extern int bsb_LLtoXY(BSBImage *p, double lon, double  lat, int* x, int* y);
 extern int bsb_XYtoLL(BSBImage *p, int x, int y, double* lon, double*  lat);
+extern int bsb_LLtoXY_array(const BSBImage *p, int n, const double *lon, const double *lat, double *x, double *y);
+extern int bsb_LLtoXY_array_int(const BSBImage *p, int n, const double *lon, const double *lat, int *x, int *y);
+extern int bsb_XYtoLL_array(const BSBImage *p, int n, const double *x, const double *y, double *lon, double *lat);
+extern int bsb_build_transform_lattice(BSBImage *p, int step, double max_error);
+extern int bsb_LLtoXY_row(const BSBImage *p, double lat, double lon, double dlon, int n, double *x, double *y);
+extern int bsb_XYtoLL_row(const BSBImage *p, double y, double x, double dx, int n, double *lon, double *lat);
+extern int bsb_contains(const BSBImage *p, double lat, double lon);
+extern int bsb_bbox(const BSBImage *p, double *south, double *west, double *north, double *east);
 extern int bsb_compress_row(BSBImage *p, int row, const uint8_t *pixel, uint8_t *buf);
 extern int bsb_write_index(FILE *fp, int height, int index[]);
 extern int bsb_close(BSBImage *p);
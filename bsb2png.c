@@ -29,30 +29,37 @@
 #include <bsb.h>
 #include <png.h>
 
-static void copy_bsb_to_png(BSBImage *image, png_structp png_ptr)
+/* number of rows decoded in parallel at a time */
+#define BAND_ROWS 64
+/* number of rows the system is asked to read ahead of the band */
+#define PREFETCH_ROWS (4 * BAND_ROWS)
+
+static int copy_bsb_to_png(BSBImage *image, png_structp png_ptr)
 {
-	int		row, bp, pp;
-	uint8_t	*bsb_row, *png_row;
+	int		row, r, rows;
+	uint8_t	*png_band;
 
-	bsb_row = (uint8_t *)malloc(image->height * sizeof(uint8_t *));
-	png_row = (uint8_t *)malloc(image->height * sizeof(uint8_t *) * image->depth);
+	png_band = (uint8_t *)malloc(image->width * 3 * BAND_ROWS);
+	if (png_band == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 0;
+	}
 
-	/* Copy row by row */
-	for (row = 0; row < image->height; row++)
+	/* Decode bands of rows in parallel straight to RGB, then write row by row */
+	for (row = 0; row < image->height; row += BAND_ROWS)
 	{
-		bsb_seek_to_row(image, row);
-		bsb_read_row(image, bsb_row);
-		for (bp = 0, pp = 0; bp < image->width; bp++)
-		{
-			png_row[pp++] = image->red[bsb_row[bp]];
-			png_row[pp++] = image->green[bsb_row[bp]];
-			png_row[pp++] = image->blue[bsb_row[bp]];
+		rows = image->height - row < BAND_ROWS ? image->height - row : BAND_ROWS;
+		if (! bsb_read_image_rgb(image, png_band, image->width * 3, row, rows, 0, BSB_PIXEL_RGB24)) {
+			fprintf(stderr, "Error reading rows %d-%d\n", row, row + rows - 1);
+			free(png_band);
+			return 0;
 		}
-		png_write_row(png_ptr, png_row);
+		for (r = 0; r < rows; r++)
+			png_write_row(png_ptr, png_band + r * image->width * 3);
 	}
 
-	free(bsb_row);
-	free(png_row);
+	free(png_band);
+	return 1;
 } /* copy_bsb_to_png */
 
 int main(int argc, char *argv[])
@@ -91,6 +98,8 @@ int main(int argc, char *argv[])
 	if (! bsb_open_header(argv[1], &image)) {
 		exit(1);
 	}
+	/* rows are read top to bottom, keep the next bands coming in */
+	bsb_set_access_pattern(&image, BSB_ACCESS_SEQUENTIAL, PREFETCH_ROWS);
 
 	png_set_IHDR(png_ptr, info_ptr, image.width, image.height, 8,
 				PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, 
@@ -109,7 +118,12 @@ int main(int argc, char *argv[])
 	png_write_info(png_ptr, info_ptr);
 
 	/* Copy the image in itself */
-	copy_bsb_to_png(&image, png_ptr);
+	if (! copy_bsb_to_png(&image, png_ptr)) {
+		fclose(png_fd);
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		bsb_close(&image);
+		exit(1);
+	}
 
 	png_write_end(png_ptr, NULL);
 	fclose(png_fd);
@@ -27,18 +27,16 @@
 #include <stdlib.h>		/* for malloc() */
 #include <bsb.h>
 
-#ifdef DEBUG
-#define DEBUG_TRACE(x) x
-#else
-#define DEBUG_TRACE(x)
-#endif
+/* number of rows decoded in parallel at a time */
+#define BAND_ROWS 64
+/* number of rows the system is asked to read ahead of the band */
+#define PREFETCH_ROWS (4 * BAND_ROWS)
 
 extern int main (int argc, char *argv[])
 {
-	DEBUG_TRACE(FILE *debug_fp;)
 	FILE*			ppm;
 	BSBImage		image;
-	int				x, y;
+	int				y, rows;
 	uint8_t			*buf;
 
 	if (argc != 3)
@@ -49,8 +47,11 @@ extern int main (int argc, char *argv[])
 
 	if (! bsb_open_header(argv[1], &image))
 		exit(1);
+	/* rows are read top to bottom, keep the next bands coming in */
+	bsb_set_access_pattern(&image, BSB_ACCESS_SEQUENTIAL, PREFETCH_ROWS);
 
-	buf = (uint8_t *)malloc(image.width);
+	/* Each pixel is a triplet of Red,Green,Blue samples */
+	buf = (uint8_t *)malloc(image.width * 3 * BAND_ROWS);
 	if (! buf)
 		exit(1);
 
@@ -61,24 +62,20 @@ extern int main (int argc, char *argv[])
 		perror(argv[2]);
 		exit(1);
 	}
-	DEBUG_TRACE(debug_fp = fopen("debug.out", "wb"));
 
 	/* Write PPM header (for "raw" format) */
 	fprintf(ppm, "P6\n%d %d\n255\n", image.width, image.height);
 
-	/* Read rows from bsb file and write rows to PPM */
-	for (y = 0; y < image.height; y++)
+	/* Read bands of rows from bsb file and write rows to PPM */
+	for (y = 0; y < image.height; y += BAND_ROWS)
 	{
-		bsb_read_row_at(&image, y, buf);
-
-		/* Each pixel is a triplet of Red,Green,Blue samples */
-		for (x = 0; x < image.width; x++)
+		rows = image.height - y < BAND_ROWS ? image.height - y : BAND_ROWS;
+		if (! bsb_read_image_rgb(&image, buf, image.width * 3, y, rows, 0, BSB_PIXEL_RGB24))
 		{
-			fputc(image.red[(int)buf[x]], ppm);
-			fputc(image.green[(int)buf[x]], ppm);
-			fputc(image.blue[(int)buf[x]], ppm);
-			DEBUG_TRACE(fputc(buf[x], debug_fp));
+			fprintf(stderr, "Error reading rows %d-%d of %s\n", y, y + rows - 1, argv[1]);
+			exit(1);
 		}
+		fwrite(buf, image.width * 3, rows, ppm);
 	}
 	fclose(ppm);
 	bsb_close(&image);
@@ -29,11 +29,15 @@
 #include <tiffio.h>		/* libtiff - TIFF file I/O */
 #include <bsb.h>
 
+/* number of rows decoded in parallel at a time */
+#define BAND_ROWS 64
+/* number of rows the system is asked to read ahead of the band */
+#define PREFETCH_ROWS (4 * BAND_ROWS)
 
 extern int main (int argc, char *argv[])
 {
 	BSBImage	image;
-	int			i;
+	int			i, r, rows;
 	uint16_t	red[256], green[256], blue[256];
 	TIFF*		tif;
 	uint8_t		*buf;
@@ -43,7 +47,10 @@ extern int main (int argc, char *argv[])
 		fprintf(stderr, "Usage:\n\tbsb2tif input.kap output.tif\n");
 		exit(1);
 	}
-	bsb_open_header(argv[1], &image);
+	if (! bsb_open_header(argv[1], &image))
+		exit(1);
+	/* rows are read top to bottom, keep the next bands coming in */
+	bsb_set_access_pattern(&image, BSB_ACCESS_SEQUENTIAL, PREFETCH_ROWS);
 
 	/* Initialise colormap entries */
 	memset(red, 0, sizeof(red));
@@ -58,7 +65,7 @@ extern int main (int argc, char *argv[])
 		blue[i] = image.blue[i] * 65536 / 256;
 	}
 
-	buf = (uint8_t *)malloc(image.width);
+	buf = (uint8_t *)malloc(image.width * BAND_ROWS);
 	if (! buf)
 		exit(1);
 
@@ -83,12 +90,18 @@ extern int main (int argc, char *argv[])
 	TIFFSetField(tif,TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
 	TIFFSetField(tif,TIFFTAG_COLORMAP, red, green, blue);
 
-	/* Read rows from bsb file, write to tif file */
-	for (i = 0; i < image.height; i++)
+	/* Read bands of rows from bsb file, write to tif file */
+	for (i = 0; i < image.height; i += BAND_ROWS)
 	{
-		bsb_seek_to_row(&image, i);
-		bsb_read_row(&image, buf);
-		TIFFWriteScanline(tif, buf, i, 0);
+		rows = image.height - i < BAND_ROWS ? image.height - i : BAND_ROWS;
+		if (! bsb_read_image(&image, buf, image.width, i, rows, 0))
+		{
+			fprintf(stderr, "Error reading rows %d-%d of %s\n", i, i + rows - 1, argv[1]);
+			TIFFClose(tif);
+			exit(1);
+		}
+		for (r = 0; r < rows; r++)
+			TIFFWriteScanline(tif, buf + r * image.width, i + r, 0);
 	}
 
 	TIFFClose(tif);
@@ -24,12 +24,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <locale.h>
+#include <math.h>
 #include <bsb.h>
 
 #ifdef _WIN32
     #define DIR_SEPARATOR '\\'
+    #include <windows.h>
+    #include <io.h>
 #else
     #define DIR_SEPARATOR '/'
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <fcntl.h>
+#endif
+
+/* SSE2 is always there on x86-64 */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define BSB_HAVE_SSE2
+    #include <emmintrin.h>
+#endif
+
+/* io_uring for bsb_read_rows_batch(), used through the raw system calls
+   so that no liburing is needed */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+    #include <linux/io_uring.h>
+    #include <errno.h>
+    #include <sys/syscall.h>
+    #include <sys/uio.h>
+    #if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+        #define BSB_HAVE_IO_URING
+    #endif
+#endif
 #endif
 
 /* MSVC doesn't supply a strcasecmp(), so use the MSVC workalike */
@@ -37,6 +68,12 @@
     #define strcasecmp(s1, s2) stricmp(s1, s2)
 #endif
 
+/* BSBImage keeps what decoding a row reads in its first 64 bytes (see
+   bsb.h); this array gets a negative size and breaks the build if a new
+   field pushes pFile out of them on a 64-bit target */
+typedef char bsb_decode_fields_fit[
+    sizeof(void*) != 8 || offsetof(BSBImage, pFile) + sizeof(FILE*) <= 64 ? 1 : -1];
+
 /**
  *  bsb_ntohl - portable ntohl
  */
@@ -55,6 +92,146 @@ static uint32_t bsb_ntohl(uint32_t netlong)
             | (netlong & 0x000000ff) << 24 );
 }
 
+/**
+ * internal function - undoes the ROT-9 obfuscation of .NO1 files
+ *
+ * @param dst output buffer (may be the same as src)
+ * @param src obfuscated bytes
+ * @param n number of bytes
+ */
+static void bsb_unrotate(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t i = 0;
+#ifdef BSB_HAVE_SSE2
+    const __m128i nine = _mm_set1_epi8( 9 );
+    for ( ; i + 16 <= n; i += 16 )
+        _mm_storeu_si128( (__m128i*)(dst+i),
+                          _mm_sub_epi8( _mm_loadu_si128( (const __m128i*)(src+i) ), nine ) );
+#endif
+    for ( ; i < n; i++ )
+        dst[i] = (uint8_t)(src[i] - 9);
+}
+
+/*
+ * Sequential access to the chart, which is either a FILE* (bsb_open_header),
+ * a memory buffer (bsb_open_mem) or user callbacks (bsb_open_io).  The
+ * latter two keep their position in p->pos.
+ */
+
+/* User I/O callbacks have a single position, the seek and read of one
+   positional read must not interleave with those of another thread
+   using the reentrant functions.  One lock for all charts, as charts
+   inside one container may share the handle behind their callbacks. */
+#ifdef _WIN32
+/* a spin lock, which needs no initialisation and works with old compilers */
+static LONG bsb_io_lock = 0;
+    #define BSB_IO_LOCK() while ( InterlockedExchange(&bsb_io_lock, 1) ) Sleep(0)
+    #define BSB_IO_UNLOCK() InterlockedExchange(&bsb_io_lock, 0)
+#else
+static pthread_mutex_t bsb_io_lock = PTHREAD_MUTEX_INITIALIZER;
+    #define BSB_IO_LOCK() pthread_mutex_lock(&bsb_io_lock)
+    #define BSB_IO_UNLOCK() pthread_mutex_unlock(&bsb_io_lock)
+#endif
+
+/**
+ * internal function - reads up to size bytes at offset from a memory
+ * buffer or the user callbacks
+ *
+ * @returns number of bytes read
+ */
+static size_t bsb_read_at(const BSBImage *p, void *buf, size_t size, size_t offset)
+{
+    size_t got = 0, n;
+
+    if ( !p->io )
+    {
+        if ( offset < p->map_size )
+        {
+            got = p->map_size - offset < size ? p->map_size - offset : size;
+            memcpy( buf, p->map + offset, got );
+        }
+        return got;
+    }
+    BSB_IO_LOCK();
+    if ( p->io->seek( p->io_handle, (long)offset, SEEK_SET ) == 0 )
+    {
+        while ( got < size && (n = p->io->read( p->io_handle, (uint8_t *)buf + got, size - got )) > 0 )
+            got += n;
+    }
+    BSB_IO_UNLOCK();
+    return got;
+}
+
+/**
+ * internal function - size of a memory or callback chart in bytes
+ * or -1 if unknown
+ */
+static long bsb_io_size(const BSBImage *p)
+{
+    return p->io ? p->io->size( p->io_handle ) : (long)p->map_size;
+}
+
+/**
+ * internal function - fseek() in the chart
+ */
+static int bsb_io_seek(BSBImage *p, long offset, int whence)
+{
+    if ( p->pFile )
+        return fseek(p->pFile, offset, whence);
+    if ( whence == SEEK_CUR )
+        offset += (long)p->pos;
+    else if ( whence == SEEK_END )
+        offset += bsb_io_size(p);
+    if ( offset < 0 )
+        return -1;
+    p->pos = offset;
+    return 0;
+}
+
+/**
+ * internal function - ftell() in the chart
+ */
+static long bsb_io_tell(BSBImage *p)
+{
+    return p->pFile ? ftell(p->pFile) : (long)p->pos;
+}
+
+/**
+ * internal function - fread() from the chart, de-obfuscating .NO1
+ */
+static size_t bsb_fread(BSBImage *p, void *buf, size_t size, size_t n)
+{
+    size_t got;
+
+    if ( p->pFile )
+        got = fread(buf, size, n, p->pFile) * size;
+    else
+    {
+        got = bsb_read_at(p, buf, size * n, p->pos);
+        p->pos += got;
+    }
+    if ( p->obfuscated )
+        bsb_unrotate( (uint8_t *)buf, (const uint8_t *)buf, got );
+    return size ? got / size : 0;
+}
+
+/**
+ * internal function - fgetc() from the chart, de-obfuscating .NO1
+ */
+static int bsb_fgetc(BSBImage *p)
+{
+    uint8_t b;
+
+    if ( p->pFile )
+    {
+        int c = fgetc(p->pFile);
+        if ( c != EOF && p->obfuscated )
+            c = (c - 9) & 0xFF;
+        return c;
+    }
+    return bsb_fread(p, &b, 1, 1) == 1 ? b : EOF;
+}
+
 /**
  * Copies the next newline-delimited line from *pp into line as a NUL
  * terminated string and increments	the pp pointer to point to the start
@@ -123,6 +300,128 @@ static void readStrUntilComma( const char* from, char* to, const unsigned max )
     to[i] = 0;
 }
 
+/**
+ * reads a decimal integer like sscanf("%d") does (leading blanks and a
+ * sign are allowed)
+ *
+ * @param s string to read from
+ * @param v output value
+ *
+ * @return pointer past the number or 0 if there is no number
+ */
+static const char* bsb_parse_int( const char* s, int* v )
+{
+    int neg = 0;
+    long n = 0;
+
+    while ( *s == ' ' || *s == '\t' ) s++;
+    if ( *s == '+' || *s == '-' )
+        neg = *s++ == '-';
+    if ( *s < '0' || *s > '9' )
+        return 0;
+    while ( *s >= '0' && *s <= '9' )
+    {
+        if ( n < 0x7fffffffL )
+            n = n*10 + (*s - '0');
+        s++;
+    }
+    *v = (int)(neg ? -n : n);
+    return s;
+}
+
+/**
+ * reads a decimal floating point number like sscanf("%lf") does but
+ * always with '.' as decimal point whatever the locale.  Numbers with up
+ * to 19 significant digits and a power of ten within 1e22 (which covers
+ * everything found in BSB headers) are converted exactly with a single
+ * multiplication or division, the rest goes through strtod().
+ *
+ * @param s string to read from
+ * @param v output value
+ *
+ * @return pointer past the number or 0 if there is no number
+ */
+static const char* bsb_parse_double( const char* s, double* v )
+{
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *start, *q;
+    uint64_t m = 0;
+    int neg = 0, ndigits = 0, exp10 = 0, exact = 1;
+
+    while ( *s == ' ' || *s == '\t' ) s++;
+    start = s;
+    if ( *s == '+' || *s == '-' )
+        neg = *s++ == '-';
+    for ( q = s; *q >= '0' && *q <= '9'; q++ )
+    {
+        if ( ndigits < 19 )
+        {
+            m = m*10 + (*q - '0');
+            ndigits += m != 0;
+        }
+        else
+        {
+            exp10++;
+            exact &= *q == '0';
+        }
+    }
+    int have_digits = q != s;
+    if ( *q == '.' )
+    {
+        for ( s = ++q; *q >= '0' && *q <= '9'; q++ )
+        {
+            if ( ndigits < 19 )
+            {
+                m = m*10 + (*q - '0');
+                ndigits += m != 0;
+                exp10--;
+            }
+            else
+                exact &= *q == '0';
+        }
+        have_digits |= q != s;
+    }
+    if ( !have_digits )
+        return 0;
+    if ( *q == 'e' || *q == 'E' )
+    {
+        int e;
+        const char *t = q + 1;
+        /* only an exponent if digits follow, like strtod() */
+        if ( (*t == '+' || *t == '-') ? (t[1] >= '0' && t[1] <= '9') : (*t >= '0' && *t <= '9') )
+        {
+            q = bsb_parse_int( t, &e );
+            exp10 = e < -1000 ? -1000 : e > 1000 ? 1000 : exp10 + e;
+        }
+    }
+
+    if ( exact && m <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22 )
+    {
+        double d = (double)m;
+        d = exp10 < 0 ? d / pow10[-exp10] : d * pow10[exp10];
+        *v = neg ? -d : d;
+        return q;
+    }
+
+    /* slow path: strtod() wants the decimal point of the current locale */
+    char buf[128];
+    if ( q - start < (int)sizeof(buf) )
+    {
+        char *dot;
+        memcpy( buf, start, q - start );
+        buf[q - start] = '\0';
+        if ( (dot = strchr(buf, '.')) )
+            *dot = localeconv()->decimal_point[0];
+        *v = strtod( buf, 0 );
+    }
+    else
+        *v = strtod( start, 0 );
+    return q;
+}
+
 /**
  * reads the comma-separated list of numbers from string
  *
@@ -142,14 +441,16 @@ int readNumberList( char* pc, double list[], int count )
         if ( *pc )
         {
             pc++;
-            if ( *pc ) sscanf( pc, "%lf", &list[i++] );
+            if ( *pc ) bsb_parse_double( pc, &list[i++] );
         }
     }
     return i;
 }
 
 /**
- * internal function - reads the raster row index
+ * internal function - reads the raster row index.  An index that points
+ * outside the raster or not in row order is rejected, so that
+ * bsb_build_row_index() rebuilds it from the rows.
  *
  * @param p pointer to BSBImage to update
  */
@@ -157,38 +458,51 @@ static
 int bsb_read_row_index( BSBImage* p )
 {
     /* Read start-of-index offset */
-    if (fseek(p->pFile, -4, SEEK_END) == -1)
+    if (bsb_io_seek(p, -4, SEEK_END) == -1)
         return 0;
+    long end_of_index = bsb_io_tell(p);
     uint32_t st;
-    if (fread(&st, 4, 1, p->pFile) != 1)
+    if (bsb_fread(p, &st, 4, 1) != 1)
         return 0;
     uint32_t start_of_index = bsb_ntohl(st);
+    if (start_of_index < p->raster_offset || (long)start_of_index + p->height*4 > end_of_index)
+        return 0;
     /* Read start-of-rows offset */
-    if (fseek(p->pFile, start_of_index, SEEK_SET) == -1)
+    if (bsb_io_seek(p, start_of_index, SEEK_SET) == -1)
         return 0;
     /* allocate one more for last row ending */
     p->row_index = (uint32_t*)malloc( (p->height+1)*4 );
     if ( !p->row_index )
         return 0;
-    if (fread(p->row_index, p->height*4, 1, p->pFile) != 1)
-        return 0;
+    int i, valid = bsb_fread(p, p->row_index, p->height*4, 1) == 1;
     /* remember end of last row, which is start of the index */
     p->row_index[p->height] = start_of_index;
     /* convert endiannes */
-    int i;
-    for ( i = 0; i < p->height; i++ )
+    for ( i = 0; valid && i < p->height; i++ )
         p->row_index[i] = bsb_ntohl(p->row_index[i]);
-    /* convert endiannes */
+    /* check the rows follow each other and find the largest one */
     int max_row_size = 0;
-    for ( i = 0; i < p->height; i++ )
+    valid = valid && p->row_index[0] >= p->raster_offset;
+    for ( i = 0; valid && i < p->height; i++ )
     {
         int row_size = p->row_index[i+1]-p->row_index[i];
+        valid = p->row_index[i+1] > p->row_index[i];
         max_row_size = max_row_size < row_size ? row_size : max_row_size;
     }
+    if ( !valid )
+    {
+        /* don't leave a half read or damaged index behind */
+        free(p->row_index);
+        p->row_index = 0;
+        return 0;
+    }
     p->rbuf = (unsigned char*)malloc( max_row_size );
     return p->rbuf != 0;
 }
 
+/* size of the blocks the text header is scanned in */
+#define BSB_HEADER_BLOCK 16384
+
 /**
  * computes the BSB header size of the BSB (KAP) file (text part preceding the image)
  *
@@ -197,260 +511,596 @@ int bsb_read_row_index( BSBImage* p )
  */
 extern int bsb_get_header_size(FILE *fp)
 {
-    int text_size = 0, c;
+    int text_size = 0;
+    char block[BSB_HEADER_BLOCK];
+    size_t n;
 
-    /* scan for end-of-text marker and record size of text section */
-    while ( (c = fgetc(fp)) != -1 )
+    /* scan for end-of-text marker (Control-Z) a block at a time and
+       record size of text section, leaving fp just past the marker */
+    while ( (n = fread(block, 1, sizeof(block), fp)) > 0 )
     {
-        if (c == 0x1a)      /* Control-Z */
+        const char *end = (const char *)memchr(block, 0x1a, n);
+        if ( end )
+        {
+            text_size += end - block;
+            fseek(fp, (long)(end - block + 1) - (long)n, SEEK_CUR);
             break;
-        text_size++;
+        }
+        text_size += n;
     }
     return text_size;
 }
 
 /**
- *  opens the BSB (KAP or NO1) file and and populated the BSBImage structure
- *  also reads the row index
+ * internal function - reads the text header (up to the end-of-text marker)
+ * from the current position in one pass, a block at a time
  *
- * @param filename full path to the file to open
- * @param p pointer to the BSBImage structure
+ * @param p pointer to a BSBImage with the file positioned at the header
+ * @param text_size output size of the text section
  *
- * @return 0 on failure
+ * @return malloc'ed '\0' terminated text or 0 on failure
  */
-extern int bsb_open_header(char *filename, BSBImage *p)
+static char* bsb_read_text_header(BSBImage *p, int *text_size)
 {
-    int text_size = 0, c, depth;
-    char *p_ext, *pt, *text_buf, line[1024];
-
-    /* zerofill entire BSB structure - not very strict
-       as we would want some 0.0l and 0.0f but this works just the same */
-    memset( p, 0, sizeof(*p) );
-
-    /* Look for an extension (if any) to test for '.NO1' files
-       which must be treated specially since they are obfuscated */
-    if (    (p_ext = strrchr(filename, '.')) != NULL &&
-            (p_ext > strrchr(filename, DIR_SEPARATOR)) &&
-            (strcasecmp(p_ext, ".NO1") == 0) )
-    {
-        FILE *inputFile;
-
-        if (! (inputFile = fopen(filename, "rb")))
-        {
-            perror(filename);
-            return 0;
-        }
-
-        /* Open temporary file to store unobfuscated file */
-        if (! (p->pFile = tmpfile()))
-        {
-            perror("tmpfile()");
-            return 0;
-        }
+    size_t size = 0, alloc = BSB_HEADER_BLOCK, n;
+    char *text = (char *)malloc(alloc + 1), *end = 0;
 
-        /* .NO1 files are obfuscated using ROT-9 */
-        while ((c = fgetc(inputFile)) != EOF)
-        {
-            int r = (c - 9) & 0xFF;
-            fputc(r, p->pFile);
-        }
-        fflush(p->pFile);
-        fseek(p->pFile, 0, SEEK_SET);
-    }
-    else
+    while ( text && (n = bsb_fread(p, text + size, 1, alloc - size)) > 0 )
     {
-        /* Normal unobfuscated BSB/NOS files can be opened straight away */
-        if (! (p->pFile = fopen(filename, "rb")))
+        end = (char *)memchr(text + size, 0x1a, n);
+        size += n;
+        if ( end )
+            break;
+        if ( size == alloc )
         {
-            perror(filename);
-            return 0;
+            char *grown = (char *)realloc(text, alloc*2 + 1);
+            if ( !grown )
+            {
+                free(text);
+                text = 0;
+                break;
+            }
+            text = grown;
+            alloc *= 2;
         }
     }
-
-    if ((text_size = bsb_get_header_size(p->pFile)) == 0)
-        return 0;
-
-    /* allocate space & read in the entire text header */
-    text_buf = (char *)malloc(text_size + 1);
-    if (text_buf == NULL)
+    if ( !text )
     {
-        fprintf(stderr,
-                "malloc(%d) failed for text header - BSB file possibly corrupt",
-                text_size + 1);
+        fprintf(stderr, "malloc(%d) failed for text header - BSB file possibly corrupt",
+                (int)alloc + 1);
         return 0;
     }
+    if ( end )
+        size = end - text;
+    text[size] = '\0';
+    *text_size = (int)size;
+    return text;
+}
 
-    fseek(p->pFile, 0, SEEK_SET);
-    if (fread(text_buf, text_size, 1, p->pFile) != 1)
-        return 0;
-    text_buf[text_size] = '\0';
+/**
+ * internal function - makes room for one more element in a growable array
+ *
+ * @param array the array (may be 0)
+ * @param max allocated number of elements, updated when the array grows
+ * @param count number of elements in use
+ * @param size size of an element
+ *
+ * @return the array with room for count+1 elements or 0 if out of memory
+ *         (the original array stays valid then)
+ */
+static void* bsb_grow(void *array, int *max, int count, size_t size)
+{
+    if ( count < *max )
+        return array;
+    int n = *max ? *max * 2 : 16;
+    void *grown = realloc( array, n * size );
+    if ( grown )
+        *max = n;
+    return grown;
+}
 
-    pt = text_buf;
-    p->num_colors = 0;
-    p->num_refs = 0;
-    p->num_plys = 0;
-    p->num_wpxs = 0;
-    p->num_wpys = 0;
-    p->num_pwxs = 0;
-    p->num_pwys = 0;
-    p->version = -1.0;
-    p->width = -1;
-    p->height = -1;
-    while ( next_line(&pt, sizeof(line), line) )
-    {
-        char *s;
-        int  idx, r, g, b, ifm_depth;
+/* packs a three letter header tag into an int for switch() */
+#define BSB_TAG(a, b, c) ((uint32_t)(uint8_t)(a) << 16 | (uint32_t)(uint8_t)(b) << 8 | (uint8_t)(c))
 
-        if (sscanf(line, "RGB/%d,%d,%d,%d", &idx, &r, &g, &b) == 4)
-        {
-            if ((unsigned)idx < sizeof(p->red)/sizeof(p->red[0]))
-            {
-                if (idx > 0)
-                {
-                    p->red[idx-1] = r;
-                    p->green[idx-1] = g;
-                    p->blue[idx-1] = b;
-                    p->num_colors++;
-                }
-            }
-        }
-        if (sscanf(line, "REF/%d,%d,%d,%lf,%lf",
-                   &p->ref[p->num_refs].id,
-                   &p->ref[p->num_refs].x,
-                   &p->ref[p->num_refs].y,
-                   &p->ref[p->num_refs].lat,
-                   &p->ref[p->num_refs].lon) == 5)
-        {
-            if ( p->num_refs < BSB_MAX_REFS -1 )
-            {
-                p->num_refs++;
-            }
-            else
-            {
-                printf("too many reference points (REF)\n");
-            }
-        }
-        if (sscanf(line, "PLY/%d,%lf,%lf",
-                   &p->ply[p->num_plys].id,
-                   &p->ply[p->num_plys].lat,
-                   &p->ply[p->num_plys].lon) == 3)
-        {
-            if ( p->num_plys < BSB_MAX_PLYS -1 )
-            {
-                p->num_plys++;
-            }
-            else
-            {
-                printf("too many border points (PLY)\n");
-            }
+/**
+ * internal function - reads the KEY=value fields of a header line
+ * (everything after the "TAG/") into the BSBImage.  Only the first
+ * occurrence of a key on a line is used.
+ *
+ * @param p pointer to the BSBImage to update
+ * @param tag tag of the line (see BSB_TAG)
+ * @param s first field of the line
+ *
+ * @return 0 if a field required to decode the image is broken
+ */
+static int bsb_parse_fields(BSBImage *p, uint32_t tag, const char *s)
+{
+    unsigned seen = 0;
 
-        }
-        if (sscanf(line, "WPX/%d,", &p->wpx_level )==1)
-        {
-            p->num_wpxs = readNumberList( line, p->wpx, sizeof(p->wpx)/sizeof(p->wpx[0]) );
-        }
-        if (sscanf(line, "WPY/%d,", &p->wpy_level )==1)
-        {
-            p->num_wpys = readNumberList( line, p->wpy, sizeof(p->wpy)/sizeof(p->wpy[0]) );
-        }
-        if (sscanf(line, "PWX/%d,", &p->pwx_level )==1)
-        {
-            p->num_pwxs = readNumberList( line, p->pwx, sizeof(p->pwx)/sizeof(p->pwx[0]) );
-        }
-        if (sscanf(line, "PWY/%d,", &p->pwy_level )==1)
-        {
-            p->num_pwys = readNumberList( line, p->pwy, sizeof(p->pwy)/sizeof(p->pwy[0]) );
-        }
-        if ( (s = strstr(line, "NA=")) )
-        {
-            readStrUntilComma( s+3, p->name, sizeof(p->name) );
-        }
-        if ( strstr(line,"KNP/") == line )
+    while ( *s )
+    {
+        while ( *s == ' ' ) s++;
+        if ( s[0] && s[1] && s[2] == '=' )
         {
-            if ( (s = strstr(line, "PR=")) )
-            {
-                readStrUntilComma( s+3, p->projection, sizeof(p->projection) );
-            }
-            if ( (s = strstr(line, "GD=")) )
-            {
-                readStrUntilComma( s+3, p->datum, sizeof(p->datum) );
-            }
-            if ( (s = strstr(line, "SC=")) )
-            {
-                sscanf( s+3, "%lf", &p->scale );
-            }
-            if ( (s = strstr(line, "PP=")) )
-            {
-                sscanf( s+3, "%lf", &p->projectionparam );
-            }
+            const char *v = s + 3;
+            unsigned key = 0;
+            int n[4], count = 0;
 
-        }
-        if ( (s = strstr(line, "RA=")) )
-        {
-            int x0, y0;
-            /* Attempt to read old-style NOS (4 parameter) version of RA= */
-            /* then fall back to newer 2-argument version */
-            if ((sscanf(s,"RA=%d,%d,%d,%d",&x0,&y0,&p->width,&p->height)!=4) &&
-                (sscanf(s,"RA=%d,%d", &p->width, &p->height) != 2))
-            {
-                fprintf(stderr, "failed to read width,height from RA=\n");
-                return 0;
-            }
-        }
-        if ( (s = strstr(line, "DX=")) )
-        {
-            if ( sscanf(s, "DX=%lf", &p->xresolution) != 1 )
+            switch ( BSB_TAG(s[0], s[1], 0) )
             {
-                fprintf(stderr, "failed to read xresolution\n");
-                return 0;
+            case BSB_TAG('N','A',0): key = 1; break;
+            case BSB_TAG('R','A',0): key = 2; break;
+            case BSB_TAG('D','X',0): key = 4; break;
+            case BSB_TAG('D','Y',0): key = 8; break;
+            case BSB_TAG('P','R',0): key = 16; break;
+            case BSB_TAG('G','D',0): key = 32; break;
+            case BSB_TAG('S','C',0): key = 64; break;
+            case BSB_TAG('P','P',0): key = 128; break;
             }
-        }
-        if ( (s = strstr(line, "DY=")) )
-        {
-            if ( sscanf(s, "DY=%lf", &p->yresolution) != 1 )
+            /* projection keys only count on the KNP/ line */
+            if ( key >= 16 && tag != BSB_TAG('K','N','P') )
+                key = 0;
+            if ( key & ~seen )
             {
-                fprintf(stderr, "failed to read xresolution\n");
-                return 0;
+                seen |= key;
+                switch ( key )
+                {
+                case 1:
+                    readStrUntilComma( v, p->name, sizeof(p->name) );
+                    break;
+                case 2:
+                    /* Old-style NOS (4 parameter) version of RA= has the
+                       size last, newer 2-argument version has it first */
+                    while ( count < 4 && (v = bsb_parse_int(v, &n[count])) )
+                    {
+                        count++;
+                        if ( *v++ != ',' )
+                            break;
+                    }
+                    if ( count == 4 )
+                    {
+                        p->width = n[2];
+                        p->height = n[3];
+                    }
+                    else if ( count >= 2 )
+                    {
+                        p->width = n[0];
+                        p->height = n[1];
+                    }
+                    else
+                    {
+                        fprintf(stderr, "failed to read width,height from RA=\n");
+                        return 0;
+                    }
+                    break;
+                case 4:
+                    if ( !bsb_parse_double(v, &p->xresolution) )
+                    {
+                        fprintf(stderr, "failed to read xresolution\n");
+                        return 0;
+                    }
+                    break;
+                case 8:
+                    if ( !bsb_parse_double(v, &p->yresolution) )
+                    {
+                        fprintf(stderr, "failed to read yresolution\n");
+                        return 0;
+                    }
+                    break;
+                case 16:
+                    readStrUntilComma( v, p->projection, sizeof(p->projection) );
+                    break;
+                case 32:
+                    readStrUntilComma( v, p->datum, sizeof(p->datum) );
+                    break;
+                case 64:
+                    bsb_parse_double( v, &p->scale );
+                    break;
+                case 128:
+                    bsb_parse_double( v, &p->projectionparam );
+                    break;
+                }
             }
         }
-        if (sscanf(line, "IFM/%d", &ifm_depth) == 1)
-        {
-            p->depth = ifm_depth;
-        }
-        if (sscanf(line, "VER/%f", &p->version) == 1)
-        {
-        }
-        if (sscanf(line, "CPH/%lf", &p->cph) == 1)
-        {
-        }
-
-    }
-    if (p->width == -1 || p->height == -1)
-    {
-        fprintf(stderr, "Error: Could not read RA=<width>,<height>\n");
-        return 0;
+        /* on to the next field */
+        while ( *s && *s != ',' ) s++;
+        if ( *s ) s++;
     }
-    /* done with the header */
-    free(text_buf);
+    return 1;
+}
 
-    /* Attempt to read depth from binary section, but first skip until NULL */
-    while( fgetc(p->pFile) > 0 );
+/**
+ *  opens the BSB (KAP or NO1) file and and populated the BSBImage structure
+ *  also reads the row index.  If an up to date index cache written by
+ *  bsb_write_index_cache() is found next to the file, the header and row
+ *  index are taken from it instead.
+ *
+ * @param filename full path to the file to open
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+static int bsb_open_cached(const char *filename, BSBImage *p);
 
-    /* Test depth from bitstream */
-    depth = fgetc(p->pFile);
-    if (depth != p->depth)
+extern int bsb_open_header(char *filename, BSBImage *p)
+{
+    if ( bsb_open_cached(filename, p) )
+        return 1;
+    if ( !bsb_open_header_only(filename, p) )
+        return 0;
+    return bsb_attach_raster(p);
+}
+
+/**
+ * internal function - whether the file is an obfuscated .NO1 chart
+ */
+static int bsb_is_no1(const char *filename)
+{
+    const char *p_ext = strrchr(filename, '.');
+    return p_ext != NULL && p_ext > strrchr(filename, DIR_SEPARATOR) &&
+           strcasecmp(p_ext, ".NO1") == 0;
+}
+
+/**
+ * internal function - opens the second handle bsb_pread_some() reads
+ * through on Windows, where ReadFile() at an offset also moves the file
+ * position bsb_read_row() relies on
+ */
+static void bsb_open_pread_handle(const char *filename, BSBImage *p)
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+    p->pread_handle = h != INVALID_HANDLE_VALUE ? (void*)h : 0;
+#else
+    (void)filename;
+    (void)p;
+#endif
+}
+
+/**
+ *  opens the BSB (KAP or NO1) file and populates the BSBImage structure from
+ *  the text header only.  Neither the row index nor the raster is touched,
+ *  which makes this much cheaper than bsb_open_header() when only the
+ *  metadata (name, scale, REF/PLY points etc.) is needed.  Call
+ *  bsb_attach_raster() before reading any rows.  The file stays open until
+ *  bsb_close().
+ *
+ * @param filename full path to the file to open
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+static int bsb_parse_header(BSBImage *p);
+static void bsb_select_polytrans(BSBImage *p);
+static void bsb_build_border(BSBImage *p);
+
+extern int bsb_open_header_only(char *filename, BSBImage *p)
+{
+    /* zerofill entire BSB structure - not very strict
+       as we would want some 0.0l and 0.0f but this works just the same */
+    memset( p, 0, sizeof(*p) );
+
+    /* .NO1 files are obfuscated using ROT-9, which is undone
+       on the fly as the header and rows are read */
+    p->obfuscated = bsb_is_no1(filename);
+
+    if (! (p->pFile = fopen(filename, "rb")))
+    {
+        perror(filename);
+        return 0;
+    }
+    if ( !bsb_parse_header(p) )
+    {
+        fclose(p->pFile);
+        p->pFile = 0;
+        return 0;
+    }
+    bsb_open_pread_handle(filename, p);
+    return 1;
+}
+
+/**
+ *  opens a BSB (KAP) chart held in memory, like bsb_open_header() does for
+ *  a file.  Rows are decoded straight from the buffer, which must stay
+ *  valid and unchanged until bsb_close().  The buffer is not copied and
+ *  not freed by the library.
+ *
+ * @param buf the whole chart file
+ * @param len size of buf in bytes
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+extern int bsb_open_mem(const void *buf, size_t len, BSBImage *p)
+{
+    memset( p, 0, sizeof(*p) );
+    if ( !buf || !len )
+        return 0;
+    p->map = (const uint8_t *)buf;
+    p->map_size = len;
+    if ( !bsb_parse_header(p) )
+        return 0;
+    return bsb_attach_raster(p);
+}
+
+/**
+ *  opens a BSB (KAP) chart through user supplied I/O functions, e.g. for
+ *  charts inside container files.  The functions are only called from
+ *  the thread that called into the library: bsb_read_image(), overviews
+ *  and the other bulk reads use no worker threads for such charts, and
+ *  bsb_read_rows_batch() reads on the calling thread.  When several
+ *  threads use the reentrant functions on such charts, the library makes
+ *  sure only one of them is inside the functions at a time, so they need
+ *  not be thread-safe.  If io->close is set it is called by bsb_close().
+ *
+ * @param io table of I/O functions, must stay valid until bsb_close()
+ * @param handle passed to the I/O functions
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+extern int bsb_open_io(const BSBIO *io, void *handle, BSBImage *p)
+{
+    memset( p, 0, sizeof(*p) );
+    if ( !io || !io->read || !io->seek || !io->size )
+        return 0;
+    p->io = io;
+    p->io_handle = handle;
+    if ( !bsb_parse_header(p) )
+        return 0;
+    return bsb_attach_raster(p);
+}
+
+/**
+ * internal function - frees the georeferencing data allocated while
+ * parsing the header (the polynomials share one block)
+ */
+static void bsb_free_header(BSBImage *p)
+{
+    free(p->ref);
+    free(p->ply);
+    free(p->wpx);
+    free(p->pw_lattice);
+    free(p->wp_lattice);
+    free(p->border);
+    p->ref = 0;
+    p->ply = 0;
+    p->wpx = p->wpy = p->pwx = p->pwy = 0;
+    p->pw_lattice = p->wp_lattice = 0;
+    p->border = 0;
+    p->num_refs = p->max_refs = 0;
+    p->num_plys = p->max_plys = 0;
+}
+
+/**
+ * internal function - reads and parses the text header of a chart which
+ * is positioned at its start
+ *
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+static int bsb_parse_header(BSBImage *p)
+{
+    int text_size = 0, ok = 1;
+    char *pt, *text_buf, line[1024];
+
+    /* read in the entire text header */
+    if ((text_buf = bsb_read_text_header(p, &text_size)) == NULL)
+        return 0;
+    if (text_size == 0)
+    {
+        free(text_buf);
+        return 0;
+    }
+
+    /* room for all four polynomials in one block */
+    p->wpx = (double *)calloc( 4 * BSB_MAX_AFTS, sizeof(double) );
+    if ( !p->wpx )
+    {
+        free(text_buf);
+        return 0;
+    }
+    p->wpy = p->wpx + BSB_MAX_AFTS;
+    p->pwx = p->wpy + BSB_MAX_AFTS;
+    p->pwy = p->pwx + BSB_MAX_AFTS;
+
+    pt = text_buf;
+    p->num_colors = 0;
+    p->num_refs = 0;
+    p->num_plys = 0;
+    p->num_wpxs = 0;
+    p->num_wpys = 0;
+    p->num_pwxs = 0;
+    p->num_pwys = 0;
+    p->version = -1.0;
+    p->width = -1;
+    p->height = -1;
+    while ( ok && next_line(&pt, sizeof(line), line) )
+    {
+        const char *s = line + 4;
+        int  idx, r, g, b, id, x, y;
+        double lat, lon;
+
+        /* every header line starts with a three letter tag and a '/' */
+        if ( line[0] == '\0' || line[1] == '\0' || line[2] == '\0' || line[3] != '/' )
+            continue;
+        uint32_t tag = BSB_TAG( line[0], line[1], line[2] );
+
+        switch ( tag )
+        {
+        case BSB_TAG('R','G','B'):
+            if ( (s = bsb_parse_int(s, &idx)) && *s++ == ',' &&
+                 (s = bsb_parse_int(s, &r)) && *s++ == ',' &&
+                 (s = bsb_parse_int(s, &g)) && *s++ == ',' &&
+                 bsb_parse_int(s, &b) )
+            {
+                if ((unsigned)idx < sizeof(p->red)/sizeof(p->red[0]))
+                {
+                    if (idx > 0)
+                    {
+                        p->red[idx-1] = r;
+                        p->green[idx-1] = g;
+                        p->blue[idx-1] = b;
+                        p->num_colors++;
+                    }
+                }
+            }
+            break;
+
+        case BSB_TAG('R','E','F'):
+            if ( (s = bsb_parse_int(s, &id)) && *s++ == ',' &&
+                 (s = bsb_parse_int(s, &x)) && *s++ == ',' &&
+                 (s = bsb_parse_int(s, &y)) && *s++ == ',' &&
+                 (s = bsb_parse_double(s, &lat)) && *s++ == ',' &&
+                 bsb_parse_double(s, &lon) )
+            {
+                struct REF *ref = (struct REF *)bsb_grow( p->ref, &p->max_refs, p->num_refs, sizeof(*ref) );
+                if ( ref )
+                {
+                    p->ref = ref;
+                    p->ref[p->num_refs].id = id;
+                    p->ref[p->num_refs].x = x;
+                    p->ref[p->num_refs].y = y;
+                    p->ref[p->num_refs].lat = lat;
+                    p->ref[p->num_refs].lon = lon;
+                    p->num_refs++;
+                }
+                else
+                {
+                    printf("out of memory for reference points (REF)\n");
+                }
+            }
+            break;
+
+        case BSB_TAG('P','L','Y'):
+            if ( (s = bsb_parse_int(s, &id)) && *s++ == ',' &&
+                 (s = bsb_parse_double(s, &lat)) && *s++ == ',' &&
+                 bsb_parse_double(s, &lon) )
+            {
+                struct PLY *ply = (struct PLY *)bsb_grow( p->ply, &p->max_plys, p->num_plys, sizeof(*ply) );
+                if ( ply )
+                {
+                    p->ply = ply;
+                    p->ply[p->num_plys].id = id;
+                    p->ply[p->num_plys].lat = lat;
+                    p->ply[p->num_plys].lon = lon;
+                    p->num_plys++;
+                }
+                else
+                {
+                    printf("out of memory for border points (PLY)\n");
+                }
+            }
+            break;
+
+        case BSB_TAG('W','P','X'):
+            if ( bsb_parse_int(s, &p->wpx_level) )
+                p->num_wpxs = readNumberList( line, p->wpx, BSB_MAX_AFTS );
+            break;
+        case BSB_TAG('W','P','Y'):
+            if ( bsb_parse_int(s, &p->wpy_level) )
+                p->num_wpys = readNumberList( line, p->wpy, BSB_MAX_AFTS );
+            break;
+        case BSB_TAG('P','W','X'):
+            if ( bsb_parse_int(s, &p->pwx_level) )
+                p->num_pwxs = readNumberList( line, p->pwx, BSB_MAX_AFTS );
+            break;
+        case BSB_TAG('P','W','Y'):
+            if ( bsb_parse_int(s, &p->pwy_level) )
+                p->num_pwys = readNumberList( line, p->pwy, BSB_MAX_AFTS );
+            break;
+
+        case BSB_TAG('I','F','M'):
+            if ( bsb_parse_int(s, &idx) )
+                p->depth = idx;
+            break;
+        case BSB_TAG('V','E','R'):
+        {
+            double ver;
+            if ( bsb_parse_double(s, &ver) )
+                p->version = (float)ver;
+            break;
+        }
+        case BSB_TAG('C','P','H'):
+            bsb_parse_double( s, &p->cph );
+            break;
+
+        default:
+            /* the rest are lists of KEY=value fields (BSB/, KNP/, ...) */
+            ok = bsb_parse_fields( p, tag, s );
+            break;
+        }
+    }
+    if (ok && (p->width == -1 || p->height == -1))
+    {
+        fprintf(stderr, "Error: Could not read RA=<width>,<height>\n");
+        ok = 0;
+    }
+    /* done with the header */
+    free(text_buf);
+    if ( !ok )
+    {
+        bsb_free_header(p);
+        return 0;
+    }
+    p->text_size = text_size;
+    bsb_select_polytrans(p);
+    bsb_build_border(p);
+    return 1;
+}
+
+/**
+ *  reads what bsb_open_header_only() left out: the depth of the bitstream
+ *  and the row index.  Does nothing if the raster is already attached.
+ *
+ * @param p pointer to a BSBImage opened with bsb_open_header_only()
+ *
+ * @return 0 on failure
+ */
+extern int bsb_attach_raster(BSBImage *p)
+{
+    int depth;
+
+    if ( !p->pFile && !p->map && !p->io )
+        return 0;
+    if ( p->raster_attached )
+        return 1;
+
+    /* Attempt to read depth from binary section, but first skip the
+       end-of-text marker and anything until NULL */
+    if ( bsb_io_seek(p, p->text_size, SEEK_SET) == -1 )
+        return 0;
+    uint8_t block[64];
+    size_t n = bsb_fread(p, block, 1, sizeof(block));
+    const uint8_t *nul = (const uint8_t *)memchr(block, 0, n);
+    if ( nul && nul+1 < block+n )
+    {
+        /* Test depth from bitstream, leaving the file just past it */
+        depth = nul[1];
+        bsb_io_seek(p, p->text_size + (nul+2 - block), SEEK_SET);
+    }
+    else
+    {
+        /* unusually long padding, fall back to scanning for it */
+        bsb_io_seek(p, p->text_size, SEEK_SET);
+        while( bsb_fgetc(p) > 0 );
+        depth = bsb_fgetc(p);
+    }
+    if (depth != p->depth)
     {
         fprintf(stderr,
                 "Warning: depth from IFM tag (%d) != depth from bitstream (%d)\n",
                 p->depth, depth);
     }
-    long pos = ftell(p->pFile);
+    p->raster_attached = 1;
+    p->raster_offset = bsb_io_tell(p);
     if ( !bsb_read_row_index(p) )
     {
-       /* printf("Could not read row index\n"); */
-       /* restore file position so it starts at the first row again */
-       /* TODO: provide a function to recreate the index */
-       fseek(p->pFile, pos, SEEK_SET);
+       /* restore file position so it starts at the first row again, the
+          index is rebuilt when a row is first read by position */
+       bsb_io_seek(p, p->raster_offset, SEEK_SET);
     }
     else
     {
@@ -460,314 +1110,3627 @@ extern int bsb_open_header(char *filename, BSBImage *p)
     return 1;
 }
 
+/**
+ *  opens the BSB file like bsb_open_header() and additionally maps the whole
+ *  file read-only into memory, so that bsb_read_row_part() decodes rows
+ *  straight from the mapping instead of doing fseek()/fread() for every row.
+ *  If the file cannot be mapped (or on platforms without mmap) the regular
+ *  FILE* based access is used.
+ *
+ * @param filename full path to the file to open
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 on failure
+ */
+extern int bsb_open_header_mmap(char *filename, BSBImage *p)
+{
+    if ( !bsb_open_header(filename, p) )
+        return 0;
+#ifndef _WIN32
+    struct stat st;
+    if ( fstat(fileno(p->pFile), &st) == 0 && st.st_size > 0 )
+    {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(p->pFile), 0);
+        if ( map != MAP_FAILED )
+        {
+            p->map = (const uint8_t*)map;
+            p->map_size = st.st_size;
+        }
+    }
+#endif
+    return 1;
+}
+
+/* file name suffix, magic and layout version of the index cache */
+#define BSB_CACHE_SUFFIX ".bsbidx"
+#define BSB_CACHE_MAGIC "BSBIDX\r\n"
+#define BSB_CACHE_VERSION 3
+/* smaller caches are read in one go, mapping them costs more than that */
+#define BSB_CACHE_MMAP_MIN (1024*1024)
+
+/* Start of an index cache file.  It is followed by the REF points, the
+   PLY points, the 4*BSB_MAX_AFTS polynomial coefficients, the height+1
+   row offsets and the x checkpoints, each at an 8 byte aligned offset.
+   Everything is stored native endian so it can be used straight from
+   a read-only mapping. */
+typedef struct BSBCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       /* sizeof(BSBCacheHeader), rejects caches of other builds */
+    /* the chart the cache was written for (see bsb_cache_key) */
+    uint64_t chart_size;
+    int64_t chart_mtime;
+    int64_t chart_mtime_ns;
+    uint64_t chart_ino;
+    int64_t chart_ctime;
+    int64_t chart_ctime_ns;
+    uint64_t size;              /* size of the whole cache file */
+    uint32_t max_row_size;
+    uint32_t ref_offset;
+    uint32_t ply_offset;
+    uint32_t aft_offset;
+    uint32_t row_index_offset;
+    uint32_t xindex_offset;
+
+    /* header fields of the chart */
+    int32_t width;
+    int32_t height;
+    int32_t depth;
+    int32_t num_colors;
+    uint8_t red[256];
+    uint8_t green[256];
+    uint8_t blue[256];
+    char name[200];
+    char projection[50];
+    char datum[50];
+    float chart_version;
+    double xresolution;
+    double yresolution;
+    double scale;
+    double projectionparam;
+    double cph;
+    int32_t num_refs;
+    int32_t num_plys;
+    int32_t num_wpxs, wpx_level;
+    int32_t num_wpys, wpy_level;
+    int32_t num_pwxs, pwx_level;
+    int32_t num_pwys, pwy_level;
+    int64_t text_size;
+    uint32_t raster_offset;
+    int32_t xindex_step;
+    int32_t xindex_cols;
+} BSBCacheHeader;
+
+/**
+ * internal function - fills in the section offsets of an index cache for
+ * the chart described by h
+ *
+ * @returns size of the whole cache file
+ */
+static uint64_t bsb_cache_layout(BSBCacheHeader *h)
+{
+    uint64_t off = sizeof(BSBCacheHeader);
+
+#define BSB_CACHE_SECTION(field, bytes) \
+    h->field = (uint32_t)off; \
+    off = (off + (uint64_t)(bytes) + 7) & ~(uint64_t)7;
+
+    BSB_CACHE_SECTION( ref_offset, (uint64_t)h->num_refs * sizeof(struct REF) );
+    BSB_CACHE_SECTION( ply_offset, (uint64_t)h->num_plys * sizeof(struct PLY) );
+    BSB_CACHE_SECTION( aft_offset, 4 * BSB_MAX_AFTS * sizeof(double) );
+    BSB_CACHE_SECTION( row_index_offset, ((uint64_t)h->height + 1) * sizeof(uint32_t) );
+    BSB_CACHE_SECTION( xindex_offset, (uint64_t)h->height * h->xindex_cols * 2 * sizeof(uint32_t) );
+#undef BSB_CACHE_SECTION
+    return off;
+}
+
+/**
+ * internal function - checks that a row index and x checkpoints can be
+ * used with the header fields of a cache: the rows follow each other
+ * within the chart and none is larger than max_row_size, and every
+ * checkpoint lies inside its row.  Caches are never written for charts
+ * with unreadable rows, so a failed check means a damaged cache.
+ *
+ * @param h cache header
+ * @param row_index height+1 row offsets
+ * @param xindex x checkpoints, only looked at when h->xindex_cols is set
+ *
+ * @returns 0 if the cache must not be used
+ */
+static int bsb_cache_check(const BSBCacheHeader *h, const uint32_t *row_index, const uint32_t *xindex)
+{
+    int i, k;
+
+    if ( h->width <= 0 || h->height <= 0 || h->depth < 1 || h->depth > 7 ||
+         h->max_row_size == 0 || row_index[0] < h->raster_offset ||
+         h->raster_offset <= (uint64_t)h->text_size || row_index[h->height] > h->chart_size )
+        return 0;
+    for ( i = 0; i < h->height; i++ )
+    {
+        if ( row_index[i+1] <= row_index[i] || row_index[i+1] - row_index[i] > h->max_row_size )
+            return 0;
+    }
+    if ( !h->xindex_cols )
+        return 1;
+    if ( h->xindex_step <= 0 || h->xindex_cols != (h->width + h->xindex_step - 1) / h->xindex_step )
+        return 0;
+    for ( i = 0; i < h->height; i++ )
+    {
+        /* a checkpoint is at an offset within the row (0 for none), and
+           the run there starts at or before the checkpoint's x */
+        for ( k = 0; k < h->xindex_cols; k++, xindex += 2 )
+        {
+            if ( xindex[0] >= row_index[i+1] - row_index[i] ||
+                 xindex[1] > (uint32_t)k * h->xindex_step )
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * internal function - whether ptr points into the loaded index cache,
+ * in which case it must not be freed
+ */
+static int bsb_in_cache(const BSBImage *p, const void *ptr)
+{
+    return p->cache_map && (const uint8_t*)ptr >= p->cache_map &&
+           (const uint8_t*)ptr < p->cache_map + p->cache_size;
+}
+
+/**
+ * internal function - name of the index cache of a chart, to be freed
+ */
+static char* bsb_cache_name(const char *filename)
+{
+    char *name = (char*)malloc( strlen(filename) + sizeof(BSB_CACHE_SUFFIX) );
+    if ( name )
+    {
+        strcpy( name, filename );
+        strcat( name, BSB_CACHE_SUFFIX );
+    }
+    return name;
+}
+
+#ifndef _WIN32
+/* nanoseconds part of the modification and status change times */
+#ifdef __APPLE__
+    #define BSB_MTIME_NS(st) ((st).st_mtimespec.tv_nsec)
+    #define BSB_CTIME_NS(st) ((st).st_ctimespec.tv_nsec)
+#else
+    #define BSB_MTIME_NS(st) ((st).st_mtim.tv_nsec)
+    #define BSB_CTIME_NS(st) ((st).st_ctim.tv_nsec)
+#endif
+
+/**
+ * internal function - identifies the version of a chart file an index
+ * cache is for from its status alone: size, inode and the modification
+ * and status change times to the nanosecond.  A chart replaced by a new
+ * file gets another inode, and one rewritten in place another ctime,
+ * which unlike the mtime cannot be set back by tools like touch.
+ *
+ * @param st status of the chart file
+ * @param h cache header to fill in the chart_ fields of
+ */
+static void bsb_cache_key(const struct stat *st, BSBCacheHeader *h)
+{
+    h->chart_size = st->st_size;
+    h->chart_mtime = st->st_mtime;
+    h->chart_mtime_ns = BSB_MTIME_NS(*st);
+    h->chart_ino = st->st_ino;
+    h->chart_ctime = st->st_ctime;
+    h->chart_ctime_ns = BSB_CTIME_NS(*st);
+}
+#endif
+
+/**
+ * internal function - opens the chart like bsb_open_header() using the
+ * header fields, row index and x checkpoints of its index cache.  The
+ * cache is only used if it belongs to this build of the library, the
+ * chart's size, inode and times match those it was written for (see
+ * bsb_cache_key) and its row index and x checkpoints pass
+ * bsb_cache_check().  Nothing of the chart is read.
+ *
+ * @param filename full path to the chart
+ * @param p pointer to the BSBImage structure
+ *
+ * @return 0 if there is no usable cache
+ */
+static int bsb_open_cached(const char *filename, BSBImage *p)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct stat cst, st;
+    BSBCacheHeader layout, key;
+    char *name;
+    int fd, valid;
+    void *map = 0;
+
+    memset( p, 0, sizeof(*p) );
+    if ( !(name = bsb_cache_name(filename)) )
+        return 0;
+    fd = open( name, O_RDONLY );
+    free(name);
+    if ( fd == -1 )
+        return 0;
+    if ( fstat(fd, &cst) == 0 && cst.st_size >= (off_t)sizeof(BSBCacheHeader) )
+    {
+        if ( cst.st_size >= BSB_CACHE_MMAP_MIN )
+        {
+            map = mmap(NULL, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if ( map == MAP_FAILED )
+                map = 0;
+        }
+        else if ( (map = malloc(cst.st_size)) && read(fd, map, cst.st_size) != cst.st_size )
+        {
+            free(map);
+            map = 0;
+        }
+    }
+    close(fd);
+    if ( !map )
+        return 0;
+
+    const uint8_t *cache = (const uint8_t*)map;
+    const BSBCacheHeader *h = (const BSBCacheHeader*)map;
+    p->cache_map = cache;
+    p->cache_size = cst.st_size;
+
+    /* check the cache is for this chart and its sections are where expected */
+    memcpy( &layout, h, sizeof(layout) );
+    valid = memcmp( h->magic, BSB_CACHE_MAGIC, sizeof(h->magic) ) == 0 &&
+            h->version == BSB_CACHE_VERSION && h->header_size == sizeof(BSBCacheHeader) &&
+            h->height > 0 && h->num_refs >= 0 && h->num_plys >= 0 && h->xindex_cols >= 0 &&
+            h->size == (uint64_t)cst.st_size && bsb_cache_layout(&layout) == h->size &&
+            layout.ref_offset == h->ref_offset && layout.ply_offset == h->ply_offset &&
+            layout.aft_offset == h->aft_offset && layout.row_index_offset == h->row_index_offset &&
+            layout.xindex_offset == h->xindex_offset;
+    valid = valid && bsb_cache_check( h, (const uint32_t*)(cache + h->row_index_offset),
+                                      (const uint32_t*)(cache + h->xindex_offset) );
+    valid = valid && (p->pFile = fopen(filename, "rb")) != 0 &&
+            fstat( fileno(p->pFile), &st ) == 0;
+    if ( valid )
+    {
+        bsb_cache_key( &st, &key );
+        valid = h->chart_size == key.chart_size && h->chart_mtime == key.chart_mtime &&
+                h->chart_mtime_ns == key.chart_mtime_ns && h->chart_ino == key.chart_ino &&
+                h->chart_ctime == key.chart_ctime && h->chart_ctime_ns == key.chart_ctime_ns;
+    }
+
+    /* header fields */
+    if ( valid )
+    {
+        p->width = h->width;
+        p->height = h->height;
+        p->depth = h->depth;
+        p->num_colors = h->num_colors;
+        memcpy( p->red, h->red, sizeof(p->red) );
+        memcpy( p->green, h->green, sizeof(p->green) );
+        memcpy( p->blue, h->blue, sizeof(p->blue) );
+        memcpy( p->name, h->name, sizeof(p->name) );
+        memcpy( p->projection, h->projection, sizeof(p->projection) );
+        memcpy( p->datum, h->datum, sizeof(p->datum) );
+        p->name[sizeof(p->name)-1] = '\0';
+        p->projection[sizeof(p->projection)-1] = '\0';
+        p->datum[sizeof(p->datum)-1] = '\0';
+        p->version = h->chart_version;
+        p->xresolution = h->xresolution;
+        p->yresolution = h->yresolution;
+        p->scale = h->scale;
+        p->projectionparam = h->projectionparam;
+        p->cph = h->cph;
+        p->num_refs = h->num_refs;
+        p->num_plys = h->num_plys;
+        p->num_wpxs = h->num_wpxs;
+        p->wpx_level = h->wpx_level;
+        p->num_wpys = h->num_wpys;
+        p->wpy_level = h->wpy_level;
+        p->num_pwxs = h->num_pwxs;
+        p->pwx_level = h->pwx_level;
+        p->num_pwys = h->num_pwys;
+        p->pwy_level = h->pwy_level;
+        p->obfuscated = bsb_is_no1(filename);
+        p->text_size = (long)h->text_size;
+        p->raster_offset = h->raster_offset;
+        p->raster_attached = 1;
+
+        p->ref = (struct REF*)malloc( h->num_refs * sizeof(struct REF) + 1 );
+        p->ply = (struct PLY*)malloc( h->num_plys * sizeof(struct PLY) + 1 );
+        p->wpx = (double*)malloc( 4 * BSB_MAX_AFTS * sizeof(double) );
+        p->rbuf = (unsigned char*)malloc( h->max_row_size );
+        p->max_refs = p->ref ? h->num_refs : 0;
+        p->max_plys = p->ply ? h->num_plys : 0;
+        valid = p->ref && p->ply && p->wpx && p->rbuf;
+    }
+    if ( !valid )
+    {
+        bsb_close(p);
+        memset( p, 0, sizeof(*p) );
+        return 0;
+    }
+    memcpy( p->ref, cache + h->ref_offset, h->num_refs * sizeof(struct REF) );
+    memcpy( p->ply, cache + h->ply_offset, h->num_plys * sizeof(struct PLY) );
+    memcpy( p->wpx, cache + h->aft_offset, 4 * BSB_MAX_AFTS * sizeof(double) );
+    p->wpy = p->wpx + BSB_MAX_AFTS;
+    p->pwx = p->wpy + BSB_MAX_AFTS;
+    p->pwy = p->pwx + BSB_MAX_AFTS;
+    bsb_select_polytrans(p);
+    bsb_build_border(p);
+
+    /* row index and x checkpoints are used in place */
+    p->row_index = (uint32_t*)(cache + h->row_index_offset);
+    if ( h->xindex_cols )
+    {
+        p->xindex = (uint32_t*)(cache + h->xindex_offset);
+        p->xindex_cols = h->xindex_cols;
+        p->xindex_step = h->xindex_step;
+    }
+
+    /* position at the first row like bsb_attach_raster().  Nothing has
+       been read through pFile yet, so moving its descriptor is enough;
+       glibc's fseek() would read the block there from the chart */
+    lseek( fileno(p->pFile), p->row_index[0], SEEK_SET );
+    return 1;
+#endif
+}
+
+/**
+ * internal function - writes size bytes at offset of the file
+ */
+static int bsb_write_at(FILE *fp, uint64_t offset, const void *data, size_t size)
+{
+    return fseek(fp, (long)offset, SEEK_SET) == 0 && (size == 0 || fwrite(data, size, 1, fp) == 1);
+}
+
+/**
+ *  writes an index cache for the chart next to it (filename with ".bsbidx"
+ *  appended).  It holds the parsed header fields, the row index and the x
+ *  checkpoints (if built with bsb_build_xindex()), so that bsb_open_header()
+ *  can open the chart again without parsing the header or reading the
+ *  row index.  A cache whose chart has since been rewritten or replaced
+ *  (other size, inode, modification or status change time) is ignored.  No cache is written for charts with
+ *  rows that cannot be read.  Caches are native endian and only used by
+ *  the same build of the library.  Not supported on Windows.
+ *
+ * @param p pointer to a BSBImage opened from filename
+ * @param filename full path to the chart p was opened from
+ *
+ * @return 0 on failure
+ */
+extern int bsb_write_index_cache(BSBImage *p, const char *filename)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    BSBCacheHeader h;
+    struct stat st;
+    char *name, *tmp;
+    FILE *fp;
+    int i, ok;
+
+    if ( !bsb_build_row_index(p) || stat(filename, &st) != 0 )
+        return 0;
+
+    memset( &h, 0, sizeof(h) );
+    memcpy( h.magic, BSB_CACHE_MAGIC, sizeof(h.magic) );
+    h.version = BSB_CACHE_VERSION;
+    h.header_size = sizeof(BSBCacheHeader);
+    bsb_cache_key( &st, &h );
+    for ( i = 0; i < p->height; i++ )
+    {
+        if ( p->row_index[i+1] > p->row_index[i] &&
+             p->row_index[i+1] - p->row_index[i] > h.max_row_size )
+            h.max_row_size = p->row_index[i+1] - p->row_index[i];
+    }
+
+    /* header fields */
+    h.width = p->width;
+    h.height = p->height;
+    h.depth = p->depth;
+    h.num_colors = p->num_colors;
+    memcpy( h.red, p->red, sizeof(h.red) );
+    memcpy( h.green, p->green, sizeof(h.green) );
+    memcpy( h.blue, p->blue, sizeof(h.blue) );
+    memcpy( h.name, p->name, sizeof(h.name) );
+    memcpy( h.projection, p->projection, sizeof(h.projection) );
+    memcpy( h.datum, p->datum, sizeof(h.datum) );
+    h.chart_version = p->version;
+    h.xresolution = p->xresolution;
+    h.yresolution = p->yresolution;
+    h.scale = p->scale;
+    h.projectionparam = p->projectionparam;
+    h.cph = p->cph;
+    h.num_refs = p->num_refs;
+    h.num_plys = p->num_plys;
+    h.num_wpxs = p->num_wpxs;
+    h.wpx_level = p->wpx_level;
+    h.num_wpys = p->num_wpys;
+    h.wpy_level = p->wpy_level;
+    h.num_pwxs = p->num_pwxs;
+    h.pwx_level = p->pwx_level;
+    h.num_pwys = p->num_pwys;
+    h.pwy_level = p->pwy_level;
+    h.text_size = p->text_size;
+    h.raster_offset = p->raster_offset;
+    h.xindex_cols = p->xindex ? p->xindex_cols : 0;
+    h.xindex_step = p->xindex ? p->xindex_step : 0;
+    h.size = bsb_cache_layout(&h);
+
+    /* a cache that would be rejected on load is not worth writing */
+    if ( !bsb_cache_check( &h, p->row_index, p->xindex ) )
+        return 0;
+
+    /* write to a temporary file first so readers never see half a cache */
+    name = bsb_cache_name(filename);
+    tmp = name ? (char*)malloc( strlen(name) + 5 ) : 0;
+    if ( !tmp )
+    {
+        free(name);
+        return 0;
+    }
+    strcpy( tmp, name );
+    strcat( tmp, ".tmp" );
+
+    ok = (fp = fopen(tmp, "wb")) != 0;
+    ok = ok && bsb_write_at( fp, 0, &h, sizeof(h) );
+    ok = ok && bsb_write_at( fp, h.ref_offset, p->ref, p->num_refs * sizeof(struct REF) );
+    ok = ok && bsb_write_at( fp, h.ply_offset, p->ply, p->num_plys * sizeof(struct PLY) );
+    ok = ok && bsb_write_at( fp, h.aft_offset, p->wpx, 4 * BSB_MAX_AFTS * sizeof(double) );
+    ok = ok && bsb_write_at( fp, h.row_index_offset, p->row_index, (p->height + 1) * sizeof(uint32_t) );
+    ok = ok && bsb_write_at( fp, h.xindex_offset, p->xindex,
+                             (size_t)p->height * h.xindex_cols * 2 * sizeof(uint32_t) );
+    /* extend the file to the padded end of the last section */
+    ok = ok && fseek( fp, 0, SEEK_END ) == 0;
+    if ( ok && ftell(fp) < (long)h.size )
+        ok = fseek( fp, (long)h.size - 1, SEEK_SET ) == 0 && fputc( 0, fp ) == 0;
+    if ( fp && fclose(fp) != 0 )
+        ok = 0;
+    ok = ok && rename(tmp, name) == 0;
+    if ( !ok )
+        remove(tmp);
+    free(tmp);
+    free(name);
+    return ok;
+#endif
+}
+
+/*
+ * Generic polynomials to convert georeferenced lat/lon to chart's x/y and
+ * back, of the form
+ *
+ *   c0 + c1*lon + c2*lat + c3*lon^2 + c4*lon*lat + c5*lat^2 + c6*lon^3 +
+ *   c7*lon^2*lat + c8*lon*lat^2 + c9*lat^3 + c10*lat^4 + c11*lat^5
+ *
+ * Most charts only use the first order (3 terms) or second order (6 terms)
+ * part, so there is one Horner form evaluator per number of terms and
+ * bsb_select_polytrans() picks the shortest one that covers the
+ * coefficients of a chart.
+ */
+typedef double (*BSBPolyTrans)( const double* coeff, double lon, double lat );
+
+static double polytrans3( const double* c, double lon, double lat )
+{
+    return c[0] + c[1]*lon + c[2]*lat;
+}
+
+static double polytrans6( const double* c, double lon, double lat )
+{
+    return c[0] + lon*(c[1] + c[3]*lon + c[4]*lat) + lat*(c[2] + c[5]*lat);
+}
+
+static double polytrans10( const double* c, double lon, double lat )
+{
+    return c[0] + lon*(c[1] + lon*(c[3] + c[6]*lon + c[7]*lat) + lat*(c[4] + c[8]*lat)) +
+           lat*(c[2] + lat*(c[5] + c[9]*lat));
+}
+
+static double polytrans12( const double* c, double lon, double lat )
+{
+    return c[0] + lon*(c[1] + lon*(c[3] + c[6]*lon + c[7]*lat) + lat*(c[4] + c[8]*lat)) +
+           lat*(c[2] + lat*(c[5] + lat*(c[9] + lat*(c[10] + c[11]*lat))));
+}
+
+/**
+ * internal function - number of terms needed to evaluate the polynomials
+ * a and b: 3, 6, 10 or 12.  Trailing zero coefficients are left out, which
+ * also covers the wpx_level style order and count fields of the header.
+ */
+static int bsb_poly_terms( const double* a, const double* b )
+{
+    int n = 12;
+    while ( n > 3 && a[n-1] == 0 && b[n-1] == 0 )
+        n--;
+    return n <= 3 ? 3 : n <= 6 ? 6 : n <= 10 ? 10 : 12;
+}
+
+/**
+ * internal function - evaluator of the given number of terms
+ */
+static BSBPolyTrans bsb_polytrans_for( int terms )
+{
+    return terms == 3 ? polytrans3 : terms == 6 ? polytrans6 : terms == 10 ? polytrans10 : polytrans12;
+}
+
+/**
+ * internal function - picks the evaluators of the chart's polynomials,
+ * called once the header or index cache has been read.  A handle filled
+ * in by hand without this uses the full 12 term polynomials.
+ *
+ * @param p pointer to the BSBImage structure
+ */
+static void bsb_select_polytrans( BSBImage* p )
+{
+    p->wp_terms = bsb_poly_terms( p->wpx, p->wpy );
+    p->pw_terms = bsb_poly_terms( p->pwx, p->pwy );
+    p->wp_trans = bsb_polytrans_for( p->wp_terms );
+    p->pw_trans = bsb_polytrans_for( p->pw_terms );
+}
+
+/**
+ * converts Lon/Lat to chart's X/Y
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param lon longitude (-180.0 to 180.0)
+ * @param lat latitude (-180.0 to 180.0)
+ * @param x  output chart X coordinate
+ * @param y  output chart Y coordinate
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_LLtoXY(BSBImage *p, double lon, double  lat, int* x, int* y)
+{
+    BSBPolyTrans trans = p->wp_trans ? p->wp_trans : polytrans12;
+
+    /* change longitude phase (CPH) */
+    lon = (lon < 0) ? lon + p->cph : lon - p->cph;
+    double xd = trans( p->wpx, lon, lat );
+    double yd = trans( p->wpy, lon, lat );
+    *x = (int)(xd + 0.5);
+    *y = (int)(yd + 0.5);
+    return 1;
+}
+
+/**
+ * converts chart's X/Y to Lon/Lat
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param x chart X coordinate
+ * @param y chart Y coordinate
+ * @param lon output longitude (-180.0 to 180.0)
+ * @param lat output latitude (-180.0 to 180.0)
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_XYtoLL(BSBImage *p, int x, int y, double* lonout, double*  latout)
+{
+    BSBPolyTrans trans = p->pw_trans ? p->pw_trans : polytrans12;
+
+    double lon = trans( p->pwx, x, y );
+    lon = (lon < 0) ? lon + p->cph : lon - p->cph;
+    *lonout = lon;
+    *latout = trans( p->pwy, x, y );
+    return 1;
+}
+
+/* where bsb_polytrans2() applies the longitude phase change (CPH) */
+#define BSB_CPH_INPUT   1   /* to the first input, as bsb_LLtoXY() */
+#define BSB_CPH_OUTPUT  2   /* to the first output, as bsb_XYtoLL() */
+
+/* points transformed at a time by the int versions of the array transforms */
+#define BSB_TRANSFORM_CHUNK 256
+
+#ifdef BSB_HAVE_SSE2
+/**
+ * internal function - the CPH change of bsb_LLtoXY() for two longitudes
+ */
+static inline __m128d bsb_cph_pd(__m128d lon, double cph)
+{
+    __m128d neg = _mm_cmplt_pd( lon, _mm_setzero_pd() );
+    return _mm_add_pd( lon, _mm_or_pd( _mm_and_pd( neg, _mm_set1_pd( cph ) ),
+                                       _mm_andnot_pd( neg, _mm_set1_pd( -cph ) ) ) );
+}
+
+/* acc += c * m for the terms of the polynomials */
+#define BSB_TERM_PD(acc, c, m) acc = _mm_add_pd( acc, _mm_mul_pd( _mm_set1_pd( c ), m ) )
+
+/* the terms from the second order on, for the number of terms in use */
+#define BSB_POLY_PD(terms)                                                  \
+    if ( (terms) > 3 )                                                      \
+    {                                                                       \
+        __m128d x2 = _mm_mul_pd( x, x ), xy = _mm_mul_pd( x, y ), y2 = _mm_mul_pd( y, y ); \
+        BSB_TERM_PD( ra, ca[3], x2 );  BSB_TERM_PD( rb, cb[3], x2 );        \
+        BSB_TERM_PD( ra, ca[4], xy );  BSB_TERM_PD( rb, cb[4], xy );        \
+        BSB_TERM_PD( ra, ca[5], y2 );  BSB_TERM_PD( rb, cb[5], y2 );        \
+        if ( (terms) > 6 )                                                  \
+        {                                                                   \
+            __m128d x3 = _mm_mul_pd( x2, x ), x2y = _mm_mul_pd( x2, y );    \
+            __m128d xy2 = _mm_mul_pd( x, y2 ), y3 = _mm_mul_pd( y2, y );    \
+            BSB_TERM_PD( ra, ca[6], x3 );  BSB_TERM_PD( rb, cb[6], x3 );    \
+            BSB_TERM_PD( ra, ca[7], x2y ); BSB_TERM_PD( rb, cb[7], x2y );   \
+            BSB_TERM_PD( ra, ca[8], xy2 ); BSB_TERM_PD( rb, cb[8], xy2 );   \
+            BSB_TERM_PD( ra, ca[9], y3 );  BSB_TERM_PD( rb, cb[9], y3 );    \
+        }                                                                   \
+        if ( (terms) > 10 )                                                 \
+        {                                                                   \
+            __m128d y4 = _mm_mul_pd( y2, y2 ), y5 = _mm_mul_pd( y4, y );    \
+            BSB_TERM_PD( ra, ca[10], y4 ); BSB_TERM_PD( rb, cb[10], y4 );   \
+            BSB_TERM_PD( ra, ca[11], y5 ); BSB_TERM_PD( rb, cb[11], y5 );   \
+        }                                                                   \
+    }
+#endif
+
+/*
+ * Evaluates two polynomials over arrays of points, the monomials of each
+ * point being computed once and shared by both polynomials.  There is one
+ * function per number of terms, so the terms not in use compile away.
+ *
+ * ca, cb are the coefficients of the polynomials giving a and b from the
+ * n points of u (lon or x) and v (lat or y).  With cph_mode BSB_CPH_INPUT
+ * the longitude phase change of bsb_LLtoXY() is applied to u, with
+ * BSB_CPH_OUTPUT the one of bsb_XYtoLL() to a.
+ */
+#ifdef BSB_HAVE_SSE2
+#define BSB_POLYTRANS2_SSE2(terms)                                          \
+    for ( ; i + 2 <= n; i += 2 )                                            \
+    {                                                                       \
+        __m128d x = _mm_loadu_pd( u+i ), y = _mm_loadu_pd( v+i );           \
+        if ( cph_mode == BSB_CPH_INPUT )                                    \
+            x = bsb_cph_pd( x, cph );                                       \
+        __m128d ra = _mm_set1_pd( ca[0] ), rb = _mm_set1_pd( cb[0] );       \
+        BSB_TERM_PD( ra, ca[1], x );   BSB_TERM_PD( rb, cb[1], x );         \
+        BSB_TERM_PD( ra, ca[2], y );   BSB_TERM_PD( rb, cb[2], y );         \
+        BSB_POLY_PD( terms )                                                \
+        if ( cph_mode == BSB_CPH_OUTPUT )                                   \
+            ra = bsb_cph_pd( ra, cph );                                     \
+        _mm_storeu_pd( a+i, ra );                                           \
+        _mm_storeu_pd( b+i, rb );                                           \
+    }
+#else
+#define BSB_POLYTRANS2_SSE2(terms)
+#endif
+
+#define BSB_DEFINE_POLYTRANS2(name, terms)                                  \
+static void name(const double *ca, const double *cb, int n, const double *u, \
+                 const double *v, double *a, double *b, double cph, int cph_mode) \
+{                                                                           \
+    int i = 0, k;                                                           \
+    BSB_POLYTRANS2_SSE2( terms )                                            \
+    for ( ; i < n; i++ )                                                    \
+    {                                                                       \
+        double x = u[i], y = v[i];                                          \
+        if ( cph_mode == BSB_CPH_INPUT )                                    \
+            x = (x < 0) ? x + cph : x - cph;                                \
+        double x2 = x*x, y2 = y*y, y4 = y2*y2;                              \
+        double m[12] = { 1, x, y, x2, x*y, y2, x2*x, x2*y, x*y2, y2*y, y4, y4*y }; \
+        double ra = ca[0], rb = cb[0];                                      \
+        for ( k = 1; k < (terms); k++ )                                     \
+        {                                                                   \
+            ra += ca[k]*m[k];                                               \
+            rb += cb[k]*m[k];                                               \
+        }                                                                   \
+        if ( cph_mode == BSB_CPH_OUTPUT )                                   \
+            ra = (ra < 0) ? ra + cph : ra - cph;                            \
+        a[i] = ra;                                                          \
+        b[i] = rb;                                                          \
+    }                                                                       \
+}
+
+BSB_DEFINE_POLYTRANS2(bsb_polytrans2_3, 3)
+BSB_DEFINE_POLYTRANS2(bsb_polytrans2_6, 6)
+BSB_DEFINE_POLYTRANS2(bsb_polytrans2_10, 10)
+BSB_DEFINE_POLYTRANS2(bsb_polytrans2_12, 12)
+
+/**
+ * internal function - evaluates two polynomials of the given number of
+ * terms over arrays of points (see BSB_DEFINE_POLYTRANS2)
+ */
+static void bsb_polytrans2(int terms, const double *ca, const double *cb, int n, const double *u,
+                           const double *v, double *a, double *b, double cph, int cph_mode)
+{
+    switch ( terms )
+    {
+    case 3:  bsb_polytrans2_3( ca, cb, n, u, v, a, b, cph, cph_mode ); break;
+    case 6:  bsb_polytrans2_6( ca, cb, n, u, v, a, b, cph, cph_mode ); break;
+    case 10: bsb_polytrans2_10( ca, cb, n, u, v, a, b, cph, cph_mode ); break;
+    default: bsb_polytrans2_12( ca, cb, n, u, v, a, b, cph, cph_mode ); break;
+    }
+}
+
+/**
+ * internal function - rounds chart coordinates like bsb_LLtoXY()
+ */
+static void bsb_round_xy(int n, const double *xd, const double *yd, int *x, int *y)
+{
+    int i = 0;
+#ifdef BSB_HAVE_SSE2
+    const __m128d half = _mm_set1_pd( 0.5 );
+    for ( ; i + 2 <= n; i += 2 )
+    {
+        _mm_storel_epi64( (__m128i*)(x+i), _mm_cvttpd_epi32( _mm_add_pd( _mm_loadu_pd( xd+i ), half ) ) );
+        _mm_storel_epi64( (__m128i*)(y+i), _mm_cvttpd_epi32( _mm_add_pd( _mm_loadu_pd( yd+i ), half ) ) );
+    }
+#endif
+    for ( ; i < n; i++ )
+    {
+        x[i] = (int)(xd[i] + 0.5);
+        y[i] = (int)(yd[i] + 0.5);
+    }
+}
+
+/**
+ * converts arrays of Lon/Lat to chart's X/Y, like bsb_LLtoXY() but without
+ * rounding.  Meant for tracks and grids with many points: the inputs and
+ * outputs are separate arrays, so the polynomials are evaluated several
+ * points at a time.  The results agree with bsb_LLtoXY() up to floating
+ * point rounding.
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param n number of points
+ * @param lon longitudes (-180.0 to 180.0)
+ * @param lat latitudes (-180.0 to 180.0)
+ * @param x output chart X coordinates
+ * @param y output chart Y coordinates
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_LLtoXY_array(const BSBImage *p, int n, const double *lon, const double *lat,
+                            double *x, double *y)
+{
+    if ( n < 0 || !p->wpx )
+        return 0;
+    bsb_polytrans2( p->wp_terms, p->wpx, p->wpy, n, lon, lat, x, y, p->cph, BSB_CPH_INPUT );
+    return 1;
+}
+
+/**
+ * same as bsb_LLtoXY_array() but rounds the chart coordinates to
+ * integers like bsb_LLtoXY()
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param n number of points
+ * @param lon longitudes (-180.0 to 180.0)
+ * @param lat latitudes (-180.0 to 180.0)
+ * @param x output chart X coordinates
+ * @param y output chart Y coordinates
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_LLtoXY_array_int(const BSBImage *p, int n, const double *lon, const double *lat,
+                                int *x, int *y)
+{
+    double xd[BSB_TRANSFORM_CHUNK], yd[BSB_TRANSFORM_CHUNK];
+    int i;
+
+    if ( n < 0 || !p->wpx )
+        return 0;
+    for ( i = 0; i < n; i += BSB_TRANSFORM_CHUNK )
+    {
+        int k = n - i < BSB_TRANSFORM_CHUNK ? n - i : BSB_TRANSFORM_CHUNK;
+        bsb_polytrans2( p->wp_terms, p->wpx, p->wpy, k, lon+i, lat+i, xd, yd, p->cph, BSB_CPH_INPUT );
+        bsb_round_xy( k, xd, yd, x+i, y+i );
+    }
+    return 1;
+}
+
+/**
+ * converts arrays of chart's X/Y to Lon/Lat, like bsb_XYtoLL() but for
+ * fractional pixel coordinates and many points at a time (see
+ * bsb_LLtoXY_array())
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param n number of points
+ * @param x chart X coordinates
+ * @param y chart Y coordinates
+ * @param lon output longitudes (-180.0 to 180.0)
+ * @param lat output latitudes (-180.0 to 180.0)
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_XYtoLL_array(const BSBImage *p, int n, const double *x, const double *y,
+                            double *lon, double *lat)
+{
+    if ( n < 0 || !p->pwx )
+        return 0;
+    bsb_polytrans2( p->pw_terms, p->pwx, p->pwy, n, x, y, lon, lat, p->cph, BSB_CPH_OUTPUT );
+    return 1;
+}
+
+/*
+ * Bilinear interpolation lattice of one direction of the transforms (see
+ * bsb_build_transform_lattice).  Holds the raw polynomial values at the
+ * nodes, the CPH change is applied after interpolating.
+ */
+struct BSBLattice
+{
+    double u0, v0;          /* input at the first node */
+    double inv_du, inv_dv;  /* 1 / cell size */
+    int cols, rows;         /* number of cells */
+    double *a, *b;          /* outputs at the (cols+1)*(rows+1) nodes */
+    uint8_t *exact;         /* cells that must use the polynomials */
+};
+
+/**
+ * internal function - interpolates the outputs at (fu,fv) of cell i,j
+ */
+static inline void bsb_lattice_interp(const struct BSBLattice *l, int i, int j, double fu, double fv,
+                                      double *a, double *b)
+{
+    int k = j*(l->cols+1) + i, s = l->cols+1;
+    double a0 = l->a[k] + fu*(l->a[k+1] - l->a[k]);
+    double a1 = l->a[k+s] + fu*(l->a[k+s+1] - l->a[k+s]);
+    double b0 = l->b[k] + fu*(l->b[k+1] - l->b[k]);
+    double b1 = l->b[k+s] + fu*(l->b[k+s+1] - l->b[k+s]);
+    *a = a0 + fv*(a1 - a0);
+    *b = b0 + fv*(b1 - b0);
+}
+
+/* defaults of bsb_build_transform_lattice(): distance in pixels between
+   nodes and interpolation error bound in pixels */
+#define BSB_LATTICE_STEP 64
+#define BSB_LATTICE_ERROR 0.05
+
+/**
+ * internal function - evaluates the polynomials ca, cb at the nodes of a
+ * lattice of cols x rows cells from u0,v0 to u1,v1 and marks the cells
+ * where bilinear interpolation is off by more than bound_a or bound_b at
+ * the cell centre or edge midpoints
+ *
+ * @return the lattice, 0 if out of memory
+ */
+static struct BSBLattice* bsb_lattice_new(BSBPolyTrans trans, const double *ca, const double *cb,
+                                          double u0, double v0, double u1, double v1,
+                                          int cols, int rows, double bound_a, double bound_b)
+{
+    static const double check[5][2] = { {0.5,0}, {0,0.5}, {0.5,0.5}, {1,0.5}, {0.5,1} };
+    size_t nodes = (size_t)(cols+1) * (rows+1);
+    struct BSBLattice *l;
+    double du = (u1 - u0) / cols, dv = (v1 - v0) / rows;
+    int i, j, k;
+
+    l = (struct BSBLattice *)malloc( sizeof(*l) + 2 * nodes * sizeof(double) + (size_t)cols * rows );
+    if ( !l )
+        return 0;
+    l->u0 = u0;
+    l->v0 = v0;
+    l->inv_du = 1 / du;
+    l->inv_dv = 1 / dv;
+    l->cols = cols;
+    l->rows = rows;
+    l->a = (double *)(l + 1);
+    l->b = l->a + nodes;
+    l->exact = (uint8_t *)(l->b + nodes);
+
+    for ( j = 0; j <= rows; j++ )
+    {
+        for ( i = 0; i <= cols; i++ )
+        {
+            l->a[j*(cols+1) + i] = trans( ca, u0 + i*du, v0 + j*dv );
+            l->b[j*(cols+1) + i] = trans( cb, u0 + i*du, v0 + j*dv );
+        }
+    }
+    for ( j = 0; j < rows; j++ )
+    {
+        for ( i = 0; i < cols; i++ )
+        {
+            int exact = 0;
+            for ( k = 0; k < 5 && !exact; k++ )
+            {
+                double u = u0 + (i + check[k][0]) * du, v = v0 + (j + check[k][1]) * dv, a, b;
+                bsb_lattice_interp( l, i, j, check[k][0], check[k][1], &a, &b );
+                exact = !(fabs(a - trans( ca, u, v )) <= bound_a && fabs(b - trans( cb, u, v )) <= bound_b);
+            }
+            l->exact[j*cols + i] = exact;
+        }
+    }
+    return l;
+}
+
+/**
+ * Builds bilinear interpolation lattices for bsb_XYtoLL_row() and
+ * bsb_LLtoXY_row(), which then interpolate rows of points instead of
+ * evaluating the polynomials for every point, e.g. when reprojecting a
+ * chart.  Along a row the cell only changes every step pixels, so each
+ * point costs about one multiply-add per output.  The XYtoLL lattice has
+ * a node every step pixels over the chart, the LLtoXY lattice as many
+ * nodes over the bounding box of the PLY border (there is none without a
+ * border).  Cells where interpolation
+ * is off by more than max_error pixels, checked at their centre and edge
+ * midpoints, keep using the polynomials, as do points outside the
+ * lattices.  For XYtoLL the bound in degrees is max_error times the mean
+ * size of a pixel.  Both lattices take 32 bytes per node, about 0.9 MB
+ * for the default step on a 12000x9000 chart.
+ * Must be called before the BSBImage is shared between threads.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param step distance in pixels between nodes, 0 or less for default
+ * @param max_error interpolation error bound in pixels, 0 or less for default
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_build_transform_lattice(BSBImage *p, int step, double max_error)
+{
+    BSBPolyTrans pw = p->pw_trans ? p->pw_trans : polytrans12;
+    BSBPolyTrans wp = p->wp_trans ? p->wp_trans : polytrans12;
+    double lon0 = HUGE_VAL, lon1 = -HUGE_VAL, lat0 = HUGE_VAL, lat1 = -HUGE_VAL;
+    double a0 = HUGE_VAL, a1 = -HUGE_VAL, b0 = HUGE_VAL, b1 = -HUGE_VAL;
+    struct BSBLattice *l;
+    int cols, rows, i;
+
+    if ( p->width <= 0 || p->height <= 0 || !p->wpx )
+        return 0;
+    if ( step <= 0 )
+        step = BSB_LATTICE_STEP;
+    if ( max_error <= 0 )
+        max_error = BSB_LATTICE_ERROR;
+    free(p->pw_lattice);
+    free(p->wp_lattice);
+    p->pw_lattice = p->wp_lattice = 0;
+
+    cols = (p->width + step - 1) / step;
+    rows = (p->height + step - 1) / step;
+
+    /* pixel to world over the chart, the bound from the degrees it spans */
+    for ( i = 0; i < 4; i++ )
+    {
+        double u = (i & 1) ? p->width : 0, v = (i & 2) ? p->height : 0;
+        double a = pw( p->pwx, u, v ), b = pw( p->pwy, u, v );
+        a0 = a < a0 ? a : a0;  a1 = a > a1 ? a : a1;
+        b0 = b < b0 ? b : b0;  b1 = b > b1 ? b : b1;
+    }
+    l = bsb_lattice_new( pw, p->pwx, p->pwy, 0, 0, p->width, p->height, cols, rows,
+                         max_error * (a1 - a0) / p->width, max_error * (b1 - b0) / p->height );
+    if ( !l )
+        return 0;
+    p->pw_lattice = l;
+
+    /* world to pixel over the border, in CPH changed longitudes */
+    for ( i = 0; i < p->num_plys; i++ )
+    {
+        double lon = p->ply[i].lon, lat = p->ply[i].lat;
+        lon = (lon < 0) ? lon + p->cph : lon - p->cph;
+        lon0 = lon < lon0 ? lon : lon0;  lon1 = lon > lon1 ? lon : lon1;
+        lat0 = lat < lat0 ? lat : lat0;  lat1 = lat > lat1 ? lat : lat1;
+    }
+    if ( lon1 > lon0 && lat1 > lat0 )
+    {
+        l = bsb_lattice_new( wp, p->wpx, p->wpy, lon0, lat0, lon1, lat1, cols, rows,
+                             max_error, max_error );
+        if ( !l )
+            return 0;
+        p->wp_lattice = l;
+    }
+    return 1;
+}
+
+/**
+ * internal function - evaluates the polynomials ca, cb for the n points
+ * u0 + k*du, v, interpolating them from the lattice l where there is one
+ * and the cell allows it.  cph, cph_mode are as for bsb_polytrans2().
+ */
+static void bsb_lattice_row(const struct BSBLattice *l, BSBPolyTrans trans, int terms,
+                            const double *ca, const double *cb, double u0, double du, double v,
+                            int n, double *a, double *b, double cph, int cph_mode)
+{
+    double fv = l ? (v - l->v0) * l->inv_dv : -1;
+    int j = 0, k = 0;
+
+    /* written so NaN is outside too */
+    if ( !(fv >= 0 && fv <= (l ? l->rows : 0)) )
+    {
+        /* not on the lattice, evaluate the row in place with the array kernels */
+        for ( k = 0; k < n; k++ )
+        {
+            a[k] = u0 + k*du;
+            b[k] = v;
+        }
+        bsb_polytrans2( terms, ca, cb, n, a, b, a, b, cph, cph_mode );
+        return;
+    }
+    j = fv < l->rows ? (int)fv : l->rows-1;
+    fv -= j;
+    while ( k < n )
+    {
+        double u = u0 + k*du, fu;
+        int c;
+        if ( cph_mode == BSB_CPH_INPUT )
+            u = (u < 0) ? u + cph : u - cph;
+        fu = (u - l->u0) * l->inv_du;
+        c = fu < l->cols ? (int)fu : l->cols-1;
+        if ( !(fu >= 0 && fu <= l->cols) || l->exact[j*l->cols + c] )
+        {
+            a[k] = trans( ca, u, v );
+            b[k] = trans( cb, u, v );
+            if ( cph_mode == BSB_CPH_OUTPUT )
+                a[k] = (a[k] < 0) ? a[k] + cph : a[k] - cph;
+            k++;
+            continue;
+        }
+
+        /* the cell's values at v on its left and right edge, then the
+           points up to where the row leaves the cell */
+        int s = l->cols+1, e = j*s + c;
+        double a0 = l->a[e] + fv*(l->a[e+s] - l->a[e]);
+        double a1 = l->a[e+1] + fv*(l->a[e+s+1] - l->a[e+1]);
+        double b0 = l->b[e] + fv*(l->b[e+s] - l->b[e]);
+        double b1 = l->b[e+1] + fv*(l->b[e+s+1] - l->b[e+1]);
+        do
+        {
+            double ra = a0 + (fu - c)*(a1 - a0);
+            if ( cph_mode == BSB_CPH_OUTPUT )
+                ra = (ra < 0) ? ra + cph : ra - cph;
+            a[k] = ra;
+            b[k] = b0 + (fu - c)*(b1 - b0);
+            if ( ++k == n )
+                break;
+            u = u0 + k*du;
+            if ( cph_mode == BSB_CPH_INPUT )
+                u = (u < 0) ? u + cph : u - cph;
+            fu = (u - l->u0) * l->inv_du;
+        } while ( fu >= c && fu < c+1 );
+    }
+}
+
+/**
+ * converts a row of evenly spaced Lon/Lat points at the same latitude to
+ * chart's X/Y, like bsb_LLtoXY_array().  Interpolated from the lattice
+ * when bsb_build_transform_lattice() has been called, so within its error
+ * bound of the polynomials.
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param lat latitude of the row
+ * @param lon longitude of the first point
+ * @param dlon longitude step between points
+ * @param n number of points
+ * @param x output chart X coordinates
+ * @param y output chart Y coordinates
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_LLtoXY_row(const BSBImage *p, double lat, double lon, double dlon, int n,
+                          double *x, double *y)
+{
+    if ( n < 0 || !p->wpx )
+        return 0;
+    bsb_lattice_row( p->wp_lattice, p->wp_trans ? p->wp_trans : polytrans12, p->wp_terms,
+                     p->wpx, p->wpy, lon, dlon, lat, n, x, y, p->cph, BSB_CPH_INPUT );
+    return 1;
+}
+
+/**
+ * converts a row of evenly spaced chart's X/Y points to Lon/Lat, like
+ * bsb_XYtoLL_array() (see bsb_LLtoXY_row())
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param y chart Y coordinate of the row
+ * @param x chart X coordinate of the first point
+ * @param dx X step between points
+ * @param n number of points
+ * @param lon output longitudes (-180.0 to 180.0)
+ * @param lat output latitudes (-180.0 to 180.0)
+ *
+ * @return 1 on success and 0 on error
+ */
+extern int bsb_XYtoLL_row(const BSBImage *p, double y, double x, double dx, int n,
+                          double *lon, double *lat)
+{
+    if ( n < 0 || !p->pwx )
+        return 0;
+    bsb_lattice_row( p->pw_lattice, p->pw_trans ? p->pw_trans : polytrans12, p->pw_terms,
+                     p->pwx, p->pwy, x, dx, y, n, lon, lat, p->cph, BSB_CPH_OUTPUT );
+    return 1;
+}
+
+/* edge of the PLY border, crossing latitudes lat0 <= lat < lat1 at
+   longitude lon0 + (lat - lat0) * slope */
+typedef struct BSBEdge
+{
+    double lat0, lat1, lon0, slope;
+} BSBEdge;
+
+/*
+ * PLY border prepared for bsb_contains(): its bounding box and its edges,
+ * listed again for every band of latitudes they cross.  Longitudes are
+ * changed to lon < 0 ? lon + neg_shift : lon - pos_shift, which is the CPH
+ * change for charts that have one, so borders crossing the antimeridian
+ * are continuous.
+ */
+struct BSBBorder
+{
+    double south, north, west, east;
+    double neg_shift, pos_shift;
+    double inv_band;    /* bands per degree of latitude */
+    int nbands;
+    int* band;          /* nbands+1 offsets into edges */
+    BSBEdge* edges;
+};
+
+/* most latitude bands of a border */
+#define BSB_BORDER_BANDS 64
+
+/**
+ * internal function - changes a longitude like the border's longitudes
+ */
+static inline double bsb_border_lon(const struct BSBBorder *b, double lon)
+{
+    return (lon < 0) ? lon + b->neg_shift : lon - b->pos_shift;
+}
+
+/**
+ * internal function - builds the border table of bsb_contains() from the
+ * PLY points, called once the header or index cache has been read.
+ * Leaves none for fewer than 3 points or when out of memory.
+ *
+ * @param p pointer to the BSBImage structure
+ */
+static void bsb_build_border( BSBImage* p )
+{
+    struct BSBBorder hdr, *b;
+    int n = p->num_plys, nedges = 0, total = 0, i, k;
+
+    free(p->border);
+    p->border = 0;
+    if ( n < 3 )
+        return;
+
+    /* borders crossing the antimeridian without a CPH get negative
+       longitudes moved past 180 instead */
+    memset( &hdr, 0, sizeof(hdr) );
+    hdr.neg_shift = hdr.pos_shift = p->cph;
+    for ( k = 0; k < 2; k++ )
+    {
+        hdr.south = hdr.west = HUGE_VAL;
+        hdr.north = hdr.east = -HUGE_VAL;
+        for ( i = 0; i < n; i++ )
+        {
+            double lon = bsb_border_lon( &hdr, p->ply[i].lon ), lat = p->ply[i].lat;
+            hdr.west = lon < hdr.west ? lon : hdr.west;
+            hdr.east = lon > hdr.east ? lon : hdr.east;
+            hdr.south = lat < hdr.south ? lat : hdr.south;
+            hdr.north = lat > hdr.north ? lat : hdr.north;
+        }
+        if ( hdr.east - hdr.west <= 180 || p->cph != 0 )
+            break;
+        hdr.neg_shift = 360;
+        hdr.pos_shift = 0;
+    }
+    if ( !(hdr.north > hdr.south) )
+        return;
+
+    for ( i = 0; i < n; i++ )
+        nedges += p->ply[i].lat != p->ply[(i+1) % n].lat;
+    hdr.nbands = nedges < BSB_BORDER_BANDS ? (nedges > 0 ? nedges : 1) : BSB_BORDER_BANDS;
+    hdr.inv_band = hdr.nbands / (hdr.north - hdr.south);
+
+    /* count the edges of every band, then fill them in */
+    int* count = (int*)calloc( hdr.nbands+1, sizeof(int) );
+    if ( !count )
+        return;
+    for ( k = 0; k < 2; k++ )
+    {
+        for ( i = 0; i < n; i++ )
+        {
+            const struct PLY *a = &p->ply[i], *c = &p->ply[(i+1) % n];
+            if ( a->lat == c->lat )
+                continue;
+            if ( a->lat > c->lat )
+            {
+                const struct PLY *t = a;
+                a = c;
+                c = t;
+            }
+            int b0 = (int)((a->lat - hdr.south) * hdr.inv_band);
+            int b1 = (int)((c->lat - hdr.south) * hdr.inv_band);
+            b0 = b0 < hdr.nbands ? b0 : hdr.nbands-1;
+            b1 = b1 < hdr.nbands ? b1 : hdr.nbands-1;
+            for ( ; b0 <= b1; b0++ )
+            {
+                if ( k == 0 )
+                {
+                    count[b0+1]++;
+                    continue;
+                }
+                BSBEdge* e = &b->edges[b->band[b0] + count[b0]++];
+                e->lat0 = a->lat;
+                e->lat1 = c->lat;
+                e->lon0 = bsb_border_lon( &hdr, a->lon );
+                e->slope = (bsb_border_lon( &hdr, c->lon ) - e->lon0) / (c->lat - a->lat);
+            }
+        }
+        if ( k == 0 )
+        {
+            for ( i = 0; i < hdr.nbands; i++ )
+                count[i+1] += count[i];
+            total = count[hdr.nbands];
+            b = (struct BSBBorder*)malloc( sizeof(*b) + (hdr.nbands+1)*sizeof(int) +
+                                           total*sizeof(BSBEdge) + sizeof(double) );
+            if ( !b )
+                break;
+            *b = hdr;
+            b->band = (int*)(b + 1);
+            memcpy( b->band, count, (hdr.nbands+1)*sizeof(int) );
+            /* edges after the offsets, aligned for doubles */
+            b->edges = (BSBEdge*)(((uintptr_t)(b->band + hdr.nbands+1) + sizeof(double)-1) &
+                                  ~(uintptr_t)(sizeof(double)-1));
+            memset( count, 0, (hdr.nbands+1)*sizeof(int) );
+        }
+        else
+            p->border = b;
+    }
+    free(count);
+}
+
+/**
+ * tests whether a position is on the chart, inside its PLY border.  The
+ * border is prepared when the chart is opened: positions outside its
+ * bounding box are rejected right away, the others only test the edges
+ * of their band of latitudes.  Borders crossing the antimeridian are
+ * handled with the chart's CPH.  Charts without a border are tested
+ * against the chart's rectangle through the WPX/WPY polynomials.
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param lat latitude
+ * @param lon longitude (-180.0 to 180.0)
+ *
+ * @return 1 if the position is on the chart and 0 otherwise
+ */
+extern int bsb_contains(const BSBImage *p, double lat, double lon)
+{
+    const struct BSBBorder* b = p->border;
+
+    if ( !b )
+    {
+        double x, y;
+        if ( !p->wpx || (p->wpx[1] == 0 && p->wpx[2] == 0) )
+            return 0;
+        bsb_LLtoXY_array( p, 1, &lon, &lat, &x, &y );
+        return x >= 0 && x < p->width && y >= 0 && y < p->height;
+    }
+
+    lon = bsb_border_lon( b, lon );
+    /* written so NaN is outside too */
+    if ( !(lat >= b->south && lat <= b->north && lon >= b->west && lon <= b->east) )
+        return 0;
+
+    int band = (int)((lat - b->south) * b->inv_band), inside = 0, i;
+    band = band < b->nbands ? band : b->nbands-1;
+    for ( i = b->band[band]; i < b->band[band+1]; i++ )
+    {
+        const BSBEdge* e = &b->edges[i];
+        if ( lat >= e->lat0 && lat < e->lat1 && lon < e->lon0 + (lat - e->lat0) * e->slope )
+            inside = !inside;
+    }
+    return inside;
+}
+
+/**
+ * returns the bounding box of the chart's PLY border.  For charts crossing
+ * the antimeridian west is greater than east.
+ *
+ * @param p	pointer to a BSBImage structure
+ * @param south output southernmost latitude
+ * @param west output westernmost longitude
+ * @param north output northernmost latitude
+ * @param east output easternmost longitude
+ *
+ * @return 1 on success and 0 if the chart has no border
+ */
+extern int bsb_bbox(const BSBImage *p, double *south, double *west, double *north, double *east)
+{
+    const struct BSBBorder* b = p->border;
+
+    if ( !b )
+        return 0;
+    *south = b->south;
+    *north = b->north;
+    /* undo the longitude change, one of its branches gives -180 to 180 */
+    *west = b->west + b->pos_shift <= 180 ? b->west + b->pos_shift : b->west - b->neg_shift;
+    *east = b->east + b->pos_shift <= 180 ? b->east + b->pos_shift : b->east - b->neg_shift;
+    return 1;
+}
+
+
+/**
+ * Seeks the file to the given row so read_row can start reading.
+ * Uses the index table at the end of the BSB file to quickly jump to a row,
+ * charts without a usable index get one built first (see bsb_build_row_index()).
+ *
+ * @param p	pointer to a BSBImage
+ * @param row row to seek to starting from row 0 (BSB row 1)
+ *
+ * @returns 1 on success and 0 on error
+ *
+ */
+extern int bsb_seek_to_row(BSBImage *p, int row)
+{
+    /* opened with bsb_open_header_only() and no bsb_attach_raster() yet */
+    if ( !p->raster_attached )
+        return 0;
+    if ( row < 0 || row >= p->height || !bsb_build_row_index(p) || !p->row_index[row] )
+        return 0;
+
+    /* seek to row offset */
+    if (bsb_io_seek(p, p->row_index[row], SEEK_SET) == -1)
+        return 0;
+    else
+        return 1;
+}
+
+/* Table used for computing multiplier in bsb_read_row() */
+static char mul_mask[8] = { 0, 63, 31, 15, 7, 3, 1, 0};
+
+/**
+ * Read currently seek-to row. Can continue to read more rows.
+ *
+ * @param p	pointer to a BSBImage containing file pointer at the start of a row
+ *			this occurs after bsb_open_header() or bsb_seek_to_row()
+ * @oaram buf output buffer for uncompressed pixel data
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row(BSBImage *p, uint8_t *buf)
+{
+    int     c, multiplier, row_num = 0;
+    int     pixel = 1, written = 0;
+
+    /* The row number is stored in the low 7 bits of each byte.				*/
+    /* The 8th bit indicates if row number is continued in the next byte.	*/
+    do
+    {
+        c = bsb_fgetc(p);
+        row_num = ((row_num & 0x7f) << 7) + c;
+    } while (c >= 0x80);
+
+    /* Rows are terminated by '\0'.  Note that rows can contain a '\0'	*/
+    /* as part of the run-length data, so '\0' does not delimit rows.	*/
+    /* (This occurs when multiplier is a multiple of 128 - 1)			*/
+    while ((c = bsb_fgetc(p)) != '\0')
+    {
+        if (c == EOF)
+        {
+            fprintf(stderr, "Warning: EOF reading row %d\n", row_num);
+            return 0;
+        }
+
+        pixel = (c & 0x7f) >> (7 - p->depth);
+        multiplier = c & mul_mask[(int)p->depth];
+
+        while (c >= 0x80)
+        {
+            c = bsb_fgetc(p);
+            multiplier = (multiplier << 7) + (c & 0x7f);
+        }
+        multiplier++;
+        /* limit impact of corrupt BSB data */
+        /* For the lower depths, the "grain" of the multiplyer is		*/
+        /* course, so don't write past the width of the buffer.			*/
+        if ( written + multiplier > p->width )
+        {
+            multiplier = p->width - written;
+        }
+        memset( buf+written, pixel-1, multiplier );
+        written += multiplier;
+    }
+
+    if (written < p->width)
+    {
+        int short_fall = p->width - written;
+
+        /* It seems valid BSB rows sometimes don't include pixel data for	*/
+        /* the very last pixel or two.  Perhaps the decoder is supposed		*/
+        /* to merely repeat the last pixel until the width is reached.		*/
+        /* A value of 8 was chosen as a guess since the intended behaviour	*/
+        /* of a BSB reader in this situation is not known.					*/
+        if (short_fall < 8)
+        {
+            /* Repeat the last pixel value for small short falls */
+            while (written < p->width)
+                buf[written++] = pixel - 1;
+        }
+        else
+        {
+            fprintf(stderr, "Warning: Short row for row %d written=%d width=%d\n", row_num, written, p->width);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Seeks-to and reads given row.
+ * This is performance improved version but it requires that row index is present.
+ *
+ * @param p	pointer to a BSBImage containing file pointer at the start of a row
+ *			this occurs after bsb_open_header() or bsb_seek_to_row()
+ * @param buf output buffer for uncompressed pixel data
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_at(BSBImage *p, int row, uint8_t *buf)
+{
+	return bsb_read_row_part(p, row, buf, 0, p->width);
+}
+
+/**
+ * internal function - skips the row number at the start of a compressed row
+ *
+ * @param rbuf compressed row
+ * @param size number of bytes available in rbuf
+ *
+ * @returns index of the first run-length byte or -1 on error
+ */
+static int bsb_skip_row_number(const uint8_t *rbuf, int size)
+{
+    /* The row number is stored in the low 7 bits of each byte.		*/
+    /* The 8th bit indicates if row number is continued in the next byte.	*/
+    int cidx = 0, c;
+    do
+    {
+        if ( cidx >= size )
+            return -1;
+        c = rbuf[cidx++];
+    } while (c >= 0x80);
+    return cidx;
+}
+
+/**
+ * internal function - decodes the next run of a compressed row
+ *
+ * @param rbuf compressed row
+ * @param size number of bytes available in rbuf
+ * @param cidx index of the next byte to decode, advanced past the run
+ * @param depth bit depth of the chart
+ * @param pixel output BSB pixel value (palette index + 1) of the run
+ *
+ * @returns length of the run or 0 at the end of the row
+ */
+static inline int bsb_next_run(const uint8_t *rbuf, int size, int *cidx, int depth, int *pixel)
+{
+    /* Rows are terminated by '\0'.  Note that rows can contain a '\0'	*/
+    /* as part of the run-length data, so '\0' does not delimit rows.	*/
+    /* (This occurs when multiplier is a multiple of 128 - 1)		*/
+    /* Never run past the end of the compressed data (corrupt rows).	*/
+    int i = *cidx;
+    if ( i >= size )
+        return 0;
+    int c = rbuf[i++];
+    if ( c == '\0' )
+    {
+        *cidx = i;
+        return 0;
+    }
+
+    *pixel = (c & 0x7f) >> (7 - depth);
+    int multiplier = c & mul_mask[depth];
+
+    while (c >= 0x80 && i < size)
+    {
+        c = rbuf[i++];
+        multiplier = (multiplier << 7) + (c & 0x7f);
+    }
+    *cidx = i;
+    return multiplier + 1;
+}
+
+/**
+ * internal function - finds where to start decoding a row to reach xoffset.
+ * Without x checkpoints (see bsb_build_xindex()) that is the first run of
+ * the row, otherwise the last checkpoint at or before xoffset.
+ *
+ * @param p	pointer to a BSBImage
+ * @param row row number of the compressed row
+ * @param rbuf compressed row
+ * @param size number of bytes available in rbuf
+ * @param xoffset X offset in a row the caller wants to read from
+ * @param rowx output X position of the run at the returned index
+ *
+ * @returns index of the run to start decoding at or -1 on error
+ */
+static int bsb_row_start(const BSBImage *p, int row, const uint8_t *rbuf, int size,
+                         int xoffset, int *rowx)
+{
+    *rowx = 0;
+    if ( p->xindex && xoffset >= p->xindex_step )
+    {
+        int k = xoffset / p->xindex_step;
+        if ( k >= p->xindex_cols )
+            k = p->xindex_cols - 1;
+        const uint32_t* e = p->xindex + ((size_t)row*p->xindex_cols + k)*2;
+        /* offset 0 marks a checkpoint past the end of a short row */
+        if ( e[0] && e[0] < (uint32_t)size )
+        {
+            *rowx = e[1];
+            return e[0];
+        }
+    }
+    return bsb_skip_row_number(rbuf, size);
+}
+
+/**
+ * Returns number of bytes per pixel of a pixel format.
+ *
+ * @param fmt pixel format
+ *
+ * @return bytes per pixel or 0 for unknown format
+ */
+extern int bsb_pixel_size(BSBPixelFormat fmt)
+{
+    switch ( fmt )
+    {
+    case BSB_PIXEL_INDEX:  return 1;
+    case BSB_PIXEL_RGB24:  return 3;
+    case BSB_PIXEL_RGBA32:
+    case BSB_PIXEL_BGRA32:
+    case BSB_PIXEL_ARGB32: return 4;
+    case BSB_PIXEL_RGB565: return 2;
+    }
+    return 0;
+}
+
+/*
+ * Output pixel writers used by the row decoders.  Each one fills n pixels
+ * of palette color c starting at out, so the palette is looked up once
+ * per run instead of once per pixel.  room is the number of pixels left in
+ * the output buffer from out on; pixels past n but within room may be
+ * overwritten since the following runs write them again.
+ */
+static void bsb_fill_index(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)p;
+    /* Detailed charts are mostly runs of a few pixels where calling
+       memset() costs more than the fill, so store a whole 64-bit word of
+       the color instead when the buffer has room for it. */
+    if ( n <= 8 && room >= 8 )
+    {
+        uint64_t v = 0x0101010101010101ULL * c;
+        memcpy(out, &v, 8);
+        return;
+    }
+    if ( n < 8 )
+    {
+        while ( n-- > 0 )
+            *out++ = c;
+        return;
+    }
+    memset(out, c, n);
+}
+
+static void bsb_fill_rgb24(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)room;
+    uint8_t r = p->red[c], g = p->green[c], b = p->blue[c];
+    while ( n-- > 0 )
+    {
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out += 3;
+    }
+}
+
+static void bsb_fill_32(uint8_t *out, uint32_t v, int n)
+{
+    while ( n-- > 0 )
+    {
+        memcpy(out, &v, 4);
+        out += 4;
+    }
+}
+
+static void bsb_fill_rgba32(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)room;
+    uint8_t v[4];
+    uint32_t v32;
+    v[0] = p->red[c];
+    v[1] = p->green[c];
+    v[2] = p->blue[c];
+    v[3] = 0xff;
+    memcpy(&v32, v, 4);
+    bsb_fill_32(out, v32, n);
+}
+
+static void bsb_fill_bgra32(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)room;
+    uint8_t v[4];
+    uint32_t v32;
+    v[0] = p->blue[c];
+    v[1] = p->green[c];
+    v[2] = p->red[c];
+    v[3] = 0xff;
+    memcpy(&v32, v, 4);
+    bsb_fill_32(out, v32, n);
+}
+
+static void bsb_fill_argb32(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)room;
+    bsb_fill_32(out, 0xff000000u | (uint32_t)p->red[c] << 16
+                     | (uint32_t)p->green[c] << 8 | p->blue[c], n);
+}
+
+static void bsb_fill_rgb565(uint8_t *out, const BSBImage *p, uint8_t c, int n, int room)
+{
+    (void)room;
+    uint16_t v = (uint16_t)((p->red[c] >> 3) << 11 | (p->green[c] >> 2) << 5 | p->blue[c] >> 3);
+    while ( n-- > 0 )
+    {
+        memcpy(out, &v, 2);
+        out += 2;
+    }
+}
+
+/*
+ * Defines a decoder which uncompresses one row held in memory straight
+ * into the output format of the given pixel writer (bpp bytes per pixel).
+ * Every output format gets its own copy of the loop so the writer is
+ * inlined into it.
+ *
+ * int name(const BSBImage *p, int row, const uint8_t *rbuf, int size,
+ *          uint8_t *buf, int xoffset, int buflen)
+ *
+ * p       - pointer to a BSBImage for the width, depth & palette values
+ * row     - row number of the compressed row (for the x checkpoints)
+ * rbuf    - compressed row (starting with the row number)
+ * size    - number of bytes available in rbuf
+ * buf     - output buffer for uncompressed pixel data
+ * xoffset - X offset in a row to start reading from
+ * buflen  - number of points to read (length of buf in pixels)
+ *
+ * returns 1 on success and 0 on error
+ *
+ * It seems valid BSB rows sometimes don't include pixel data for the very
+ * last pixel or two.  Perhaps the decoder is supposed to merely repeat the
+ * last pixel until the width is reached, so that is what is done here.
+ * For the lower depths, the "grain" of the multiplier is course, so don't
+ * write past the width of the buffer.
+ */
+#define BSB_DEFINE_ROW_DECODER(name, bpp, fill)                             \
+static int name(const BSBImage *p, int row, const uint8_t *rbuf, int size,  \
+                uint8_t *buf, int xoffset, int buflen)                      \
+{                                                                           \
+    int len = buflen;                                                       \
+    if ( xoffset+len > p->width )                                           \
+        len = p->width-xoffset;                                             \
+                                                                            \
+    int rowx;                                                               \
+    int cidx = bsb_row_start(p, row, rbuf, size, xoffset, &rowx);           \
+    if ( cidx < 0 )                                                         \
+        return 0;                                                           \
+                                                                            \
+    int multiplier, pixel = 1, bufidx = 0;                                  \
+    int maxWidth = xoffset + len, depth = p->depth;                         \
+                                                                            \
+    /* Skip to xoffset, writing the part of the run straddling it */        \
+    while ( rowx < xoffset &&                                               \
+            (multiplier = bsb_next_run(rbuf, size, &cidx, depth, &pixel)) ) \
+    {                                                                       \
+        if ( rowx+multiplier > xoffset )                                    \
+        {                                                                   \
+            bufidx = (rowx+multiplier > maxWidth ? maxWidth : rowx+multiplier) - xoffset; \
+            fill(buf, p, (uint8_t)(pixel-1), bufidx, buflen);               \
+        }                                                                   \
+        rowx += multiplier;                                                 \
+    }                                                                       \
+                                                                            \
+    /* From here on runs are only clipped at the end of the buffer */       \
+    if ( rowx >= xoffset )                                                  \
+    {                                                                       \
+        while ( bufidx < len &&                                             \
+                (multiplier = bsb_next_run(rbuf, size, &cidx, depth, &pixel)) ) \
+        {                                                                   \
+            if ( multiplier > len-bufidx )                                  \
+                multiplier = len-bufidx;                                    \
+            fill(buf+bufidx*(bpp), p, (uint8_t)(pixel-1), multiplier, buflen-bufidx); \
+            bufidx += multiplier;                                           \
+        }                                                                   \
+    }                                                                       \
+                                                                            \
+    /* Repeat the last pixel value for small short falls */                 \
+    if ( bufidx < buflen )                                                  \
+        fill(buf+bufidx*(bpp), p, (uint8_t)(pixel-1), buflen-bufidx, buflen-bufidx); \
+    return 1;                                                               \
+}
+
+BSB_DEFINE_ROW_DECODER(bsb_decode_row, 1, bsb_fill_index)
+BSB_DEFINE_ROW_DECODER(bsb_decode_row_rgb24, 3, bsb_fill_rgb24)
+BSB_DEFINE_ROW_DECODER(bsb_decode_row_rgba32, 4, bsb_fill_rgba32)
+BSB_DEFINE_ROW_DECODER(bsb_decode_row_bgra32, 4, bsb_fill_bgra32)
+BSB_DEFINE_ROW_DECODER(bsb_decode_row_argb32, 4, bsb_fill_argb32)
+BSB_DEFINE_ROW_DECODER(bsb_decode_row_rgb565, 2, bsb_fill_rgb565)
+
+/**
+ * internal function - uncompresses one row held in memory into the
+ * given pixel format
+ *
+ * @returns 1 on success and 0 on error
+ */
+static int bsb_decode_row_fmt(const BSBImage *p, int row, const uint8_t *rbuf, int size,
+                              uint8_t *buf, int xoffset, int buflen, BSBPixelFormat fmt)
+{
+    switch ( fmt )
+    {
+    case BSB_PIXEL_INDEX:
+        return bsb_decode_row( p, row, rbuf, size, buf, xoffset, buflen );
+    case BSB_PIXEL_RGB24:
+        return bsb_decode_row_rgb24( p, row, rbuf, size, buf, xoffset, buflen );
+    case BSB_PIXEL_RGBA32:
+        return bsb_decode_row_rgba32( p, row, rbuf, size, buf, xoffset, buflen );
+    case BSB_PIXEL_BGRA32:
+        return bsb_decode_row_bgra32( p, row, rbuf, size, buf, xoffset, buflen );
+    case BSB_PIXEL_ARGB32:
+        return bsb_decode_row_argb32( p, row, rbuf, size, buf, xoffset, buflen );
+    case BSB_PIXEL_RGB565:
+        return bsb_decode_row_rgb565( p, row, rbuf, size, buf, xoffset, buflen );
+    }
+    return 0;
+}
+
+/**
+ * internal function - appends a run to a run list, merging it with the
+ * previous run of the same color
+ *
+ * @returns 1 on success and 0 when the list is full
+ */
+static int bsb_add_run(BSBRun *runs, int maxruns, int *nruns, uint8_t color, int len)
+{
+    if ( len <= 0 )
+        return 1;
+    if ( *nruns > 0 && runs[*nruns-1].color == color )
+    {
+        runs[*nruns-1].len += len;
+        return 1;
+    }
+    if ( *nruns >= maxruns )
+        return 0;
+    runs[*nruns].color = color;
+    runs[*nruns].len = len;
+    (*nruns)++;
+    return 1;
+}
+
+/**
+ * internal function - decodes one row held in memory into a run list
+ * covering the same pixels bsb_decode_row() would write
+ *
+ * @param p	pointer to a BSBImage for the width & depth values
+ * @param row row number of the compressed row (for the x checkpoints)
+ * @param rbuf compressed row (starting with the row number)
+ * @param size number of bytes available in rbuf
+ * @param runs output run list
+ * @param maxruns size of the runs array
+ * @param xoffset X offset in a row to start reading from
+ * @param buflen number of points to cover
+ *
+ * @returns number of runs or 0 on error
+ */
+static int bsb_decode_runs(const BSBImage *p, int row, const uint8_t *rbuf, int size,
+                           BSBRun *runs, int maxruns, int xoffset, int buflen)
+{
+    int len = buflen;
+    if ( xoffset+len > p->width )
+        len = p->width-xoffset;
+
+    int rowx;
+    int cidx = bsb_row_start(p, row, rbuf, size, xoffset, &rowx);
+    if ( cidx < 0 )
+        return 0;
+
+    int multiplier, pixel = 1, covered = 0, nruns = 0;
+    int maxWidth = xoffset + len;
+
+    while ( covered < len && (multiplier = bsb_next_run(rbuf, size, &cidx, p->depth, &pixel)) )
+    {
+        if ( rowx + multiplier > maxWidth )
+            multiplier = maxWidth-rowx;
+        if ( rowx+multiplier > xoffset )
+        {
+            int step = rowx >= xoffset ? multiplier : multiplier-(xoffset-rowx);
+            if ( !bsb_add_run(runs, maxruns, &nruns, pixel-1, step) )
+                return 0;
+            covered += step;
+        }
+        rowx += multiplier;
+    }
+    /* short rows repeat the last pixel, same as bsb_decode_row() */
+    if ( !bsb_add_run(runs, maxruns, &nruns, pixel-1, buflen-covered) )
+        return 0;
+    return nruns;
+}
+
+/**
+ * internal function - decodes every step-th pixel of one row held in memory
+ *
+ * @param p	pointer to a BSBImage for the width & depth values
+ * @param row row number of the compressed row (for the x checkpoints)
+ * @param rbuf compressed row (starting with the row number)
+ * @param size number of bytes available in rbuf
+ * @param buf output buffer for len sampled pixels
+ * @param xoffset X offset of the first sample
+ * @param len number of samples
+ * @param step distance in pixels between samples
+ *
+ * @returns 1 on success and 0 on error
+ */
+static int bsb_decode_row_decimated(const BSBImage *p, int row, const uint8_t *rbuf, int size,
+                                    uint8_t *buf, int xoffset, int len, int step)
+{
+    int rowx;
+    int cidx = bsb_row_start(p, row, rbuf, size, xoffset, &rowx);
+    if ( cidx < 0 )
+        return 0;
+
+    int multiplier, pixel = 1, bufidx = 0, sx = xoffset;
+
+    /* keep decoding after the last sample inside the row, the padding
+       below needs the color of the row's last pixel */
+    while ( bufidx < len && rowx < p->width &&
+            (multiplier = bsb_next_run(rbuf, size, &cidx, p->depth, &pixel)) )
+    {
+        int end = rowx + multiplier;
+        if ( end > p->width )
+            end = p->width;
+        if ( sx < end )
+        {
+            /* all samples falling into this run get its color at once */
+            int n = (end - sx + step - 1) / step;
+            if ( bufidx+n > len ) n = len-bufidx;
+            bsb_fill_index(buf+bufidx, p, pixel-1, n, len-bufidx);
+            bufidx += n;
+            sx += n*step;
+        }
+        rowx += multiplier;
+    }
+
+    /* samples past the end of the row repeat its last pixel, same as
+       bsb_decode_row() */
+    if ( bufidx < len )
+        memset(buf+bufidx, pixel-1, len-bufidx);
+    return 1;
+}
+
+/**
+ * internal function - positional read which does not touch the file
+ * position, so it can be used by several threads on one FILE* at once
+ * (or memory buffer, user callbacks are serialised by bsb_io_lock).
+ * Reads less than size bytes only at the end of the file.
+ *
+ * @param p	pointer to a BSBImage with opened file
+ * @param buf output buffer
+ * @param size number of bytes to read
+ * @param offset file offset to read from
+ *
+ * @returns number of bytes read
+ */
+static int bsb_pread_some(const BSBImage *p, void *buf, int size, uint32_t offset)
+{
+    int got;
+
+    if ( !p->pFile )
+        got = (int)bsb_read_at( p, buf, size, offset );
+    else
+    {
+#ifdef _WIN32
+        /* ReadFile() at an offset also moves the file position, so read
+           through the second handle, or else put the position of pFile
+           back (under the lock, as other threads may read meanwhile) */
+        HANDLE h = (HANDLE)p->pread_handle;
+        LARGE_INTEGER zero, pos;
+        OVERLAPPED ov;
+        DWORD n = 0;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = offset;
+        if ( h )
+        {
+            if ( !ReadFile(h, buf, size, &n, &ov) )
+                n = 0;
+        }
+        else
+        {
+            h = (HANDLE)_get_osfhandle(_fileno(p->pFile));
+            zero.QuadPart = 0;
+            BSB_IO_LOCK();
+            if ( SetFilePointerEx(h, zero, &pos, FILE_CURRENT) )
+            {
+                if ( !ReadFile(h, buf, size, &n, &ov) )
+                    n = 0;
+                SetFilePointerEx(h, pos, NULL, FILE_BEGIN);
+            }
+            BSB_IO_UNLOCK();
+        }
+        got = (int)n;
+#else
+        ssize_t n = pread(fileno(p->pFile), buf, size, offset);
+        got = n > 0 ? (int)n : 0;
+#endif
+    }
+    if ( p->obfuscated )
+        bsb_unrotate( (uint8_t *)buf, (const uint8_t *)buf, got );
+    return got;
+}
+
+/**
+ * internal function - positional read of exactly size bytes,
+ * see bsb_pread_some()
+ *
+ * @returns 1 on success and 0 on error
+ */
+static int bsb_pread(const BSBImage *p, void *buf, int size, uint32_t offset)
+{
+    return bsb_pread_some( p, buf, size, offset ) == size;
+}
+
+/* size of the blocks the raster is scanned in by bsb_build_row_index() */
+#define BSB_SCAN_BLOCK 65536
+
+/**
+ * Builds the row index in memory with one scan over the compressed rows,
+ * for charts whose index is missing or damaged.  Afterwards such charts
+ * are read like indexed ones.  This is done automatically the first time
+ * a row is read by position, but has to be called before the reentrant
+ * functions (like bsb_read_row_part_r()) are used on such a chart.
+ * The file position used by bsb_read_row() is not changed.
+ *
+ * @param p	pointer to an opened BSBImage
+ *
+ * @returns 1 on success (or if the chart already has an index) and 0 on error
+ */
+extern int bsb_build_row_index(BSBImage *p)
+{
+    uint32_t offset = p->raster_offset, *index;
+    uint8_t *block, last = 0;
+    int row = 0, max_row_size = 0, n;
+
+    if ( p->row_index )
+        return 1;
+    if ( !p->raster_attached || p->row_index_failed || p->height <= 0 )
+        return 0;
+
+    index = (uint32_t*)calloc( p->height+1, sizeof(uint32_t) );
+    block = (uint8_t*)malloc( BSB_SCAN_BLOCK );
+    if ( !index || !block )
+    {
+        free(index);
+        free(block);
+        return 0;
+    }
+
+    /* Rows are terminated by '\0', but a '\0' can also be the last byte of
+       a run length.  Every byte with the high bit set is continued by the
+       next byte, so a '\0' ends the row exactly when the byte before it
+       does not have the high bit set.  This lets the scan jump from one
+       '\0' to the next instead of following every run. */
+    index[0] = offset;
+    while ( row < p->height && (n = bsb_pread_some( p, block, BSB_SCAN_BLOCK, offset )) > 0 )
+    {
+        const uint8_t *q = block, *end = block + n;
+        while ( (q = (const uint8_t*)memchr( q, 0, end - q )) )
+        {
+            uint8_t before = q > block ? q[-1] : last;
+            uint32_t at = offset + (q - block);
+            /* the row number takes at least one byte */
+            if ( before < 0x80 && at > index[row] )
+            {
+                if ( (int)(at + 1 - index[row]) > max_row_size )
+                    max_row_size = at + 1 - index[row];
+                index[++row] = at + 1;
+                if ( row == p->height )
+                    break;
+            }
+            q++;
+        }
+        last = block[n-1];
+        offset += n;
+    }
+    free(block);
+
+    /* rows past the end of a truncated file keep offset 0 and stay unreadable */
+    if ( row < p->height )
+        fprintf(stderr, "Warning: only %d of %d rows found rebuilding the row index\n",
+                row, p->height);
+    p->rbuf = row > 0 ? (unsigned char*)malloc( max_row_size ) : 0;
+    if ( !p->rbuf )
+    {
+        free(index);
+        p->row_index_failed = 1;
+        return 0;
+    }
+    p->row_index = index;
+    return 1;
+}
+
+/**
+ * internal function - asks the system to start reading rows first to
+ * last-1 of a file chart in the background
+ */
+static void bsb_willneed(const BSBImage *p, int first, int last)
+{
+#if !defined(_WIN32) && defined(POSIX_FADV_WILLNEED)
+    if ( first < 0 )
+        first = 0;
+    if ( last > p->height )
+        last = p->height;
+    if ( !p->pFile || !p->row_index || first >= last ||
+         !p->row_index[first] || p->row_index[last] <= p->row_index[first] )
+        return;
+    /* the page cache is shared with a mapping of the file, so this
+       prefetches for bsb_open_header_mmap() charts as well */
+    posix_fadvise( fileno(p->pFile), p->row_index[first],
+                   p->row_index[last] - p->row_index[first], POSIX_FADV_WILLNEED );
+#else
+    (void)p;
+    (void)first;
+    (void)last;
+#endif
+}
+
+/**
+ * internal function - prefetches the rows following (or around, for row
+ * bands) rows row to row+nrows-1, which are about to be read
+ */
+static void bsb_prefetch(BSBImage *p, int row, int nrows)
+{
+    int n = p->prefetch_rows, end = row + nrows;
+
+    if ( n <= 0 || !p->row_index )
+        return;
+    switch ( p->access_pattern )
+    {
+    case BSB_ACCESS_SEQUENTIAL:
+        /* restart after a jump, otherwise only hint again when less than
+           half of the prefetched rows are left, to keep the hints few */
+        if ( p->prefetch_next < end || p->prefetch_next > end + n )
+            p->prefetch_next = end;
+        if ( p->prefetch_next - end > n/2 )
+            return;
+        bsb_willneed( p, p->prefetch_next, end + n );
+        p->prefetch_next = end + n;
+        break;
+    case BSB_ACCESS_BANDS:
+        /* panning can go either way */
+        bsb_willneed( p, row - n, row );
+        bsb_willneed( p, end, end + n );
+        break;
+    }
+}
+
+/**
+ * Declares how the rows of a chart are going to be read.  The system is
+ * told so (posix_fadvise()/madvise() where available) to adjust its
+ * readahead: sequential reading reads further ahead, random reading
+ * does not read ahead at all, which saves bandwidth on network storage.
+ * With prefetch_rows > 0 the compressed bytes of the next prefetch_rows
+ * rows (for BSB_ACCESS_BANDS also of the rows above the band) are
+ * requested in the background whenever rows are read, so that reads
+ * from cold disks or NFS do not stall on every band.  Only charts opened
+ * from a file get hints, the others just ignore them.
+ *
+ * @param p pointer to an opened BSBImage
+ * @param pattern expected access pattern
+ * @param prefetch_rows number of rows to prefetch, 0 for none
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_set_access_pattern(BSBImage *p, BSBAccessPattern pattern, int prefetch_rows)
+{
+    if ( pattern < BSB_ACCESS_NORMAL || pattern > BSB_ACCESS_BANDS || prefetch_rows < 0 )
+        return 0;
+    p->access_pattern = pattern;
+    p->prefetch_rows = prefetch_rows;
+    p->prefetch_next = 0;
+
+#ifndef _WIN32
+#ifdef POSIX_FADV_NORMAL
+    if ( p->pFile )
+    {
+        int advice = pattern == BSB_ACCESS_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL :
+                     pattern == BSB_ACCESS_RANDOM ? POSIX_FADV_RANDOM : POSIX_FADV_NORMAL;
+        posix_fadvise( fileno(p->pFile), 0, 0, advice );
+    }
+#endif
+    /* a mapping is ours only when we opened the file (not bsb_open_mem) */
+    if ( p->pFile && p->map )
+    {
+        int advice = pattern == BSB_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL :
+                     pattern == BSB_ACCESS_RANDOM ? MADV_RANDOM : MADV_NORMAL;
+        madvise( (void*)p->map, p->map_size, advice );
+    }
+#endif
+    return 1;
+}
+
+/**
+ * internal function - gets the compressed bytes of an indexed row,
+ * either directly from the file mapping or by reading them into rbuf
+ *
+ * @param p	pointer to a BSBImage with row index
+ * @param rbuf scratch buffer big enough for the row (unused with mapping
+ *             unless the file is obfuscated)
+ * @param row row to fetch
+ * @param size output number of compressed bytes
+ *
+ * @returns pointer to the compressed row or 0 on error
+ */
+static const uint8_t* bsb_fetch_row(const BSBImage *p, uint8_t *rbuf, int row, int *size)
+{
+    uint32_t start = p->row_index[row], end = p->row_index[row+1];
+    if ( end <= start )
+        return 0;
+    *size = end - start;
+
+    if ( p->map )
+    {
+        if ( end > p->map_size )
+            return 0;
+        if ( !p->obfuscated )
+            return p->map + start;
+        bsb_unrotate( rbuf, p->map + start, *size );
+        return rbuf;
+    }
+
+    /* read compressed row in one step */
+    if ( !bsb_pread( p, rbuf, *size, start ) )
+        return 0;
+    return rbuf;
+}
+
+/**
+ * internal function - row size of an indexed row or 0 if unknown
+ */
+static int bsb_row_size(const BSBImage *p, int row)
+{
+    if ( !p->row_index || !p->row_index[row] || p->row_index[row+1] <= p->row_index[row] )
+        return 0;
+    return p->row_index[row+1] - p->row_index[row];
+}
+
+/**
+ * internal function - gets the compressed bytes of an indexed row using
+ * the scratch buffer of a decode context
+ *
+ * @param p	pointer to a BSBImage with row index
+ * @param ctx decode context providing the scratch buffer
+ * @param row row to fetch
+ * @param size output number of compressed bytes
+ *
+ * @returns pointer to the compressed row or 0 on error
+ */
+static const uint8_t* bsb_fetch_row_ctx(const BSBImage *p, BSBDecodeContext *ctx, int row, int *size)
+{
+    *size = bsb_row_size( p, row );
+    if ( !*size )
+        return 0;
+
+    /* grow the scratch buffer, not needed when decoding from the mapping */
+    if ( (!p->map || p->obfuscated) && ctx->rbuf_size < *size )
+    {
+        uint8_t* rbuf = (uint8_t*)realloc( ctx->rbuf, *size );
+        if ( !rbuf )
+            return 0;
+        ctx->rbuf = rbuf;
+        ctx->rbuf_size = *size;
+    }
+
+    return bsb_fetch_row( p, ctx->rbuf, row, size );
+}
+
+/**
+ * Seeks-to and reads part of a row.
+ * Charts without a usable row index get one built on the first call
+ * (see bsb_build_row_index()).
+ * If the chart was opened with bsb_open_header_mmap() the row is decoded
+ * straight from the mapped file.
+ *
+ * @param p	pointer to a BSBImage containing file pointer at the start of a row
+ *			this occurs after bsb_open_header() or bsb_seek_to_row()
+ * @param buf output buffer for uncompressed pixel data
+ *
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to read (length of buf)
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_part(BSBImage *p, int row, uint8_t *buf, int xoffset, int buflen)
+{
+	/* trying to read outside of image? */
+	if( row >= p->height )
+		return 0;
+	if( xoffset >= p->width )
+		return 0;
+
+    if ( !bsb_build_row_index( p ) || !p->rbuf || !bsb_row_size( p, row ) )
+        return 0;
+    bsb_prefetch( p, row, 1 );
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row( p, p->rbuf, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row( p, row, rbuf, size, buf, xoffset, buflen );
+}
+
+/**
+ * Prepares a caller-owned decode context for bsb_read_row_part_r().
+ * Each thread decoding rows of a shared BSBImage needs its own context.
+ *
+ * @param ctx pointer to the context to initialise
+ */
+extern void bsb_context_init(BSBDecodeContext *ctx)
+{
+    ctx->rbuf = 0;
+    ctx->rbuf_size = 0;
+    ctx->uring = 0;
+    ctx->scratch = 0;
+    ctx->scratch_size = 0;
+}
+
+static void bsb_uring_free(void *uring);
+
+/**
+ * Releases the memory held by a decode context.
+ *
+ * @param ctx pointer to the context to release
+ */
+extern void bsb_context_free(BSBDecodeContext *ctx)
+{
+    free(ctx->rbuf);
+    free(ctx->scratch);
+    bsb_uring_free(ctx->uring);
+    ctx->rbuf = 0;
+    ctx->rbuf_size = 0;
+    ctx->uring = 0;
+    ctx->scratch = 0;
+    ctx->scratch_size = 0;
+}
+
+/**
+ * Reentrant version of bsb_read_row_part().
+ * The BSBImage is only read, all scratch state lives in ctx and the file is
+ * accessed with positional reads (or through the mapping when opened with
+ * bsb_open_header_mmap()), so any number of threads can decode rows of one
+ * opened chart at the same time, each with its own context.
+ * Unlike bsb_read_row_part() this requires the row index to be present.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param ctx caller-owned decode context (see bsb_context_init())
+ * @param row row to read
+ * @param buf output buffer for uncompressed pixel data
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to read (length of buf)
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_part_r(const BSBImage *p, BSBDecodeContext *ctx, int row,
+                               uint8_t *buf, int xoffset, int len)
+{
+    /* trying to read outside of image? */
+    if ( row < 0 || row >= p->height || xoffset >= p->width )
+        return 0;
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row( p, row, rbuf, size, buf, xoffset, len );
+}
+
+/**
+ * Reads part of a row as a list of runs of equal pixels instead of
+ * expanding every pixel.  The runs cover exactly the len pixels that
+ * bsb_read_row_part() would write; adjacent runs of the same color are
+ * merged.  A list of len runs is always big enough.
+ * This requires the row index to be present.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param row row to read
+ * @param runs output run list
+ * @param maxruns size of the runs array
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to cover
+ *
+ * @returns number of runs or 0 on error (including too small runs array)
+ */
+extern int bsb_read_row_runs(BSBImage *p, int row, BSBRun *runs, int maxruns, int xoffset, int len)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 )
+        return 0;
+    if ( !bsb_build_row_index( p ) || !p->rbuf || !bsb_row_size( p, row ) )
+        return 0;
+    bsb_prefetch( p, row, 1 );
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row( p, p->rbuf, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_runs( p, row, rbuf, size, runs, maxruns, xoffset, len );
+}
+
+/**
+ * Reentrant version of bsb_read_row_runs(), see bsb_read_row_part_r().
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param ctx caller-owned decode context (see bsb_context_init())
+ * @param row row to read
+ * @param runs output run list
+ * @param maxruns size of the runs array
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to cover
+ *
+ * @returns number of runs or 0 on error (including too small runs array)
+ */
+extern int bsb_read_row_runs_r(const BSBImage *p, BSBDecodeContext *ctx, int row,
+                               BSBRun *runs, int maxruns, int xoffset, int len)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 )
+        return 0;
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_runs( p, row, rbuf, size, runs, maxruns, xoffset, len );
+}
+
+/**
+ * Reads every step-th pixel of a row, starting at xoffset, straight from
+ * the run stream.  This is what zoomed-out rendering needs: the skipped
+ * pixels are never expanded.  Samples past the end of the row repeat the
+ * last pixel, same as with bsb_read_row_part().
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param row row to read
+ * @param buf output buffer for len samples
+ * @param xoffset X offset in a row of the first sample
+ * @param len number of samples to read
+ * @param step distance in pixels between samples (1 reads every pixel)
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_decimated(BSBImage *p, int row, uint8_t *buf, int xoffset, int len, int step)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 || step <= 0 )
+        return 0;
+
+    if ( !bsb_build_row_index( p ) || !p->rbuf || !bsb_row_size( p, row ) )
+        return 0;
+    bsb_prefetch( p, row, 1 );
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row( p, p->rbuf, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row_decimated( p, row, rbuf, size, buf, xoffset, len, step );
+}
+
+/**
+ * Reentrant version of bsb_read_row_decimated(), see bsb_read_row_part_r().
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param ctx caller-owned decode context (see bsb_context_init())
+ * @param row row to read
+ * @param buf output buffer for len samples
+ * @param xoffset X offset in a row of the first sample
+ * @param len number of samples to read
+ * @param step distance in pixels between samples (1 reads every pixel)
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_decimated_r(const BSBImage *p, BSBDecodeContext *ctx, int row, uint8_t *buf,
+                                    int xoffset, int len, int step)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 || step <= 0 )
+        return 0;
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row_decimated( p, row, rbuf, size, buf, xoffset, len, step );
+}
+
+/**
+ * Reads a rectangular window of the chart.  The compressed bytes of all
+ * rows of the window are fetched with one read (rows are stored one after
+ * another in the file) and then every row is decoded from memory, instead
+ * of doing a separate seek and read for each row.  Charts opened with
+ * bsb_open_header_mmap() are decoded straight from the mapping.
+ * Window rows below the chart are zero filled; columns right of the chart
+ * repeat the last pixel of the row, as with bsb_read_row_part().
+ * Apart from building a missing row index on the first call (see
+ * bsb_build_row_index()) no state of the BSBImage is modified.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param x chart X of the top left corner of the window
+ * @param y chart Y of the top left corner of the window
+ * @param w width of the window
+ * @param h height of the window
+ * @param stride distance in bytes between rows in buf (0 means w)
+ * @param buf output buffer for h rows of w pixels
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_window(BSBImage *p, int x, int y, int w, int h, int stride, uint8_t *buf)
+{
+    int r, ok = 1;
+
+    if ( x < 0 || y < 0 || x >= p->width || y >= p->height || w <= 0 || h <= 0 )
+        return 0;
+    if ( stride <= 0 )
+        stride = w;
+
+    int rows = p->height - y < h ? p->height - y : h;
+    for ( r = rows; r < h; r++ )
+        memset( buf + (size_t)r*stride, 0, w );
+
+    /* the band has to be contiguous in the file to be read at once */
+    int contiguous = bsb_build_row_index( p );
+    for ( r = y; contiguous && r < y+rows; r++ )
+        contiguous = bsb_row_size( p, r ) != 0;
+
+    if ( !contiguous )
+    {
+        for ( r = 0; r < rows; r++ )
+            ok &= bsb_read_row_part( p, y+r, buf + (size_t)r*stride, x, w );
+        return ok;
+    }
+
+    bsb_prefetch( p, y, rows );
+    uint32_t start = p->row_index[y], end = p->row_index[y+rows];
+    const uint8_t* band;
+    uint8_t* tmp = 0;
+    if ( p->map && !p->obfuscated )
+    {
+        if ( end > p->map_size )
+            return 0;
+        band = p->map + start;
+    }
+    else
+    {
+        tmp = (uint8_t*)malloc( end - start );
+        if ( !tmp || !bsb_pread( p, tmp, end - start, start ) )
+        {
+            free(tmp);
+            return 0;
+        }
+        band = tmp;
+    }
+
+    for ( r = 0; r < rows; r++ )
+    {
+        uint32_t rs = p->row_index[y+r] - start;
+        ok &= bsb_decode_row( p, y+r, band + rs, bsb_row_size( p, y+r ),
+                              buf + (size_t)r*stride, x, w );
+    }
+    free(tmp);
+    return ok;
+}
+
+/* rows further apart in the file than this are read separately */
+#define BSB_BATCH_GAP 4096
+
+/* a coalesced read of bsb_read_rows_batch() */
+typedef struct BSBBatchRead
+{
+    const BSBImage* p;
+    uint32_t start;         /* byte range of the rows in the file */
+    uint32_t end;
+    uint8_t* data;          /* the bytes read */
+    int ok;
+} BSBBatchRead;
+
+/* marks a context whose io_uring could not be set up, pread() is used then */
+static char bsb_no_uring;
+
+#ifdef BSB_HAVE_IO_URING
+/* number of reads in flight on an io_uring */
+#define BSB_URING_ENTRIES 64
+
+typedef struct BSBURing
+{
+    int fd;
+    unsigned entries;
+    uint8_t* sq_ring;
+    uint8_t* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+} BSBURing;
+
+/**
+ * internal function - releases an io_uring
+ */
+static void bsb_uring_free(void *uring)
+{
+    BSBURing* r = (BSBURing*)uring;
+
+    if ( !r || uring == &bsb_no_uring )
+        return;
+    if ( r->sqes )
+        munmap( r->sqes, r->entries * sizeof(struct io_uring_sqe) );
+    if ( r->cq_ring && r->cq_ring != r->sq_ring )
+        munmap( r->cq_ring, r->cq_ring_size );
+    if ( r->sq_ring )
+        munmap( r->sq_ring, r->sq_ring_size );
+    if ( r->fd >= 0 )
+        close( r->fd );
+    free(r);
+}
+
+/**
+ * internal function - sets up an io_uring and maps its rings
+ *
+ * @returns the ring or 0 if the kernel does not allow io_uring
+ */
+static BSBURing* bsb_uring_new(void)
+{
+    struct io_uring_params par;
+    BSBURing* r = (BSBURing*)calloc( 1, sizeof(BSBURing) );
+
+    if ( !r )
+        return 0;
+    memset( &par, 0, sizeof(par) );
+    r->fd = (int)syscall( __NR_io_uring_setup, BSB_URING_ENTRIES, &par );
+    if ( r->fd < 0 )
+    {
+        free(r);
+        return 0;
+    }
+    r->entries = par.sq_entries;
+    r->sq_ring_size = par.sq_off.array + par.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = par.cq_off.cqes + par.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    /* both rings share one mapping */
+    if ( par.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( r->cq_ring_size > r->sq_ring_size )
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+#endif
+
+    void* m = mmap( 0, r->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING );
+    r->sq_ring = m != MAP_FAILED ? (uint8_t*)m : 0;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    if ( par.features & IORING_FEAT_SINGLE_MMAP )
+        r->cq_ring = r->sq_ring;
+    else
+#endif
+    {
+        m = mmap( 0, r->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                  r->fd, IORING_OFF_CQ_RING );
+        r->cq_ring = m != MAP_FAILED ? (uint8_t*)m : 0;
+    }
+    m = mmap( 0, par.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+              MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES );
+    r->sqes = m != MAP_FAILED ? (struct io_uring_sqe*)m : 0;
+    if ( !r->sq_ring || !r->cq_ring || !r->sqes )
+    {
+        bsb_uring_free(r);
+        return 0;
+    }
+
+    r->sq_tail = (unsigned*)(r->sq_ring + par.sq_off.tail);
+    r->sq_mask = (unsigned*)(r->sq_ring + par.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(r->sq_ring + par.sq_off.array);
+    r->cq_head = (unsigned*)(r->cq_ring + par.cq_off.head);
+    r->cq_tail = (unsigned*)(r->cq_ring + par.cq_off.tail);
+    r->cq_mask = (unsigned*)(r->cq_ring + par.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(r->cq_ring + par.cq_off.cqes);
+    return r;
+}
+
+/**
+ * internal function - does the reads of file charts with the io_uring,
+ * up to BSB_URING_ENTRIES at a time with one system call each.  Reads
+ * that fail or come back short are left for the caller to retry.
+ *
+ * @returns 0 if the ring is no longer usable
+ */
+static int bsb_uring_read(BSBURing *r, BSBBatchRead *reads, int n)
+{
+    struct iovec iov[BSB_URING_ENTRIES];
+    int i = 0;
+
+    while ( i < n )
+    {
+        unsigned tail = *r->sq_tail, k = 0, submitted = 0, done = 0;
+
+        /* queue the next reads */
+        for ( ; i < n && k < r->entries && k < BSB_URING_ENTRIES; i++ )
+        {
+            if ( !reads[i].p->pFile )
+                continue;
+            unsigned idx = (tail + k) & *r->sq_mask;
+            struct io_uring_sqe* sqe = &r->sqes[idx];
+            memset( sqe, 0, sizeof(*sqe) );
+            iov[k].iov_base = reads[i].data;
+            iov[k].iov_len = reads[i].end - reads[i].start;
+            sqe->opcode = IORING_OP_READV;
+            sqe->fd = fileno( reads[i].p->pFile );
+            sqe->addr = (uintptr_t)&iov[k];
+            sqe->len = 1;
+            sqe->off = reads[i].start;
+            sqe->user_data = i;
+            r->sq_array[idx] = idx;
+            k++;
+        }
+        if ( !k )
+            continue;
+        __atomic_store_n( r->sq_tail, tail + k, __ATOMIC_RELEASE );
+
+        /* submit them and wait for all of them in as few calls as possible */
+        while ( done < k )
+        {
+            int ret = (int)syscall( __NR_io_uring_enter, r->fd, k - submitted, k - done,
+                                    IORING_ENTER_GETEVENTS, NULL, 0 );
+            if ( ret < 0 )
+            {
+                if ( errno == EINTR )
+                    continue;
+                return 0;
+            }
+            submitted += ret;
+
+            unsigned head = *r->cq_head;
+            unsigned ctail = __atomic_load_n( r->cq_tail, __ATOMIC_ACQUIRE );
+            for ( ; head != ctail; head++, done++ )
+            {
+                struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+                BSBBatchRead* rd = &reads[cqe->user_data];
+                rd->ok = cqe->res == (int)(rd->end - rd->start);
+                if ( rd->ok && rd->p->obfuscated )
+                    bsb_unrotate( rd->data, rd->data, rd->end - rd->start );
+            }
+            __atomic_store_n( r->cq_head, head, __ATOMIC_RELEASE );
+        }
+    }
+    return 1;
+}
+#else
+static void bsb_uring_free(void *uring)
+{
+    (void)uring;
+}
+#endif
+
+/**
+ * internal function - orders row requests by chart and row
+ */
+static int bsb_cmp_requests(const void *a, const void *b)
+{
+    const BSBRowRequest* ra = *(const BSBRowRequest* const*)a;
+    const BSBRowRequest* rb = *(const BSBRowRequest* const*)b;
+
+    if ( ra->image != rb->image )
+        return (uintptr_t)ra->image < (uintptr_t)rb->image ? -1 : 1;
+    return ra->row - rb->row;
+}
+
+/**
+ * Reads many rows, possibly of many charts, with as little I/O as
+ * possible.  This suits tile servers, which need the rows of many tiles
+ * at once.  The requests are sorted by chart and row, and the rows of a
+ * chart that lie close together in the file are read with one read.
+ * On Linux these reads are submitted together through an io_uring,
+ * with one system call for up to 64 reads, so a fast disk sees a deep
+ * queue.  Without io_uring (or if the kernel does not allow it) pread()
+ * is used.  Rows of charts opened with bsb_open_header_mmap() or
+ * bsb_open_mem() are decoded straight from memory, those of charts opened
+ * with bsb_open_io() are read through their callbacks on the calling
+ * thread.  Like the other
+ * reentrant functions the charts are only read, so each thread can run
+ * its own batches with its own context.
+ *
+ * @param ctx caller-owned decode context (see bsb_context_init()), which
+ *            keeps the io_uring between calls
+ * @param reqs rows to read, ok is set for each of them
+ * @param n number of requests
+ *
+ * @returns 1 if all rows were read and 0 on error
+ */
+extern int bsb_read_rows_batch(BSBDecodeContext *ctx, BSBRowRequest *reqs, int n)
+{
+    int i, nreads = 0, nio = 0, all = 1;
+    size_t total = 0;
+
+    if ( n <= 0 )
+        return n == 0;
+    BSBRowRequest** sorted = (BSBRowRequest**)malloc( n * sizeof(BSBRowRequest*) );
+    int* which = (int*)malloc( n * sizeof(int) );
+    BSBBatchRead* reads = (BSBBatchRead*)malloc( n * sizeof(BSBBatchRead) );
+    if ( !sorted || !which || !reads )
+    {
+        free(sorted);
+        free(which);
+        free(reads);
+        return 0;
+    }
+    for ( i = 0; i < n; i++ )
+    {
+        reqs[i].ok = 0;
+        sorted[i] = &reqs[i];
+    }
+    qsort( sorted, n, sizeof(BSBRowRequest*), bsb_cmp_requests );
+
+    /* merge the byte ranges of rows close to each other */
+    for ( i = 0; i < n; i++ )
+    {
+        const BSBRowRequest* q = sorted[i];
+        const BSBImage* p = q->image;
+        which[i] = -1;
+        if ( !p || q->row < 0 || q->row >= p->height || q->xoffset < 0 ||
+             q->xoffset >= p->width || q->len <= 0 || !bsb_row_size( p, q->row ) )
+            continue;
+        uint32_t start = p->row_index[q->row], end = p->row_index[q->row+1];
+        if ( p->map && !p->obfuscated )
+        {
+            if ( end <= p->map_size )
+                which[i] = n;   /* decoded from memory */
+            continue;
+        }
+        BSBBatchRead* last = nreads ? &reads[nreads-1] : 0;
+        if ( last && last->p == p && start <= last->end + BSB_BATCH_GAP )
+        {
+            total += end > last->end ? end - last->end : 0;
+            last->end = end > last->end ? end : last->end;
+        }
+        else
+        {
+            reads[nreads].p = p;
+            reads[nreads].start = start;
+            reads[nreads].end = end;
+            reads[nreads].ok = 0;
+            total += end - start;
+            nio += p->pFile != 0;
+            nreads++;
+        }
+        which[i] = nreads-1;
+    }
+
+    /* read all ranges into one buffer */
+    uint8_t* data = (uint8_t*)malloc( total ? total : 1 );
+    if ( !data )
+        nreads = 0;
+    for ( i = 0, total = 0; i < nreads; i++ )
+    {
+        reads[i].data = data + total;
+        total += reads[i].end - reads[i].start;
+    }
+#ifdef BSB_HAVE_IO_URING
+    if ( nio > 1 && !ctx->uring )
+    {
+        ctx->uring = bsb_uring_new();
+        if ( !ctx->uring )
+            ctx->uring = &bsb_no_uring;
+    }
+    if ( nio > 1 && ctx->uring != &bsb_no_uring &&
+         !bsb_uring_read( (BSBURing*)ctx->uring, reads, nreads ) )
+    {
+        /* the ring is in an unknown state, don't use it again */
+        bsb_uring_free( ctx->uring );
+        ctx->uring = &bsb_no_uring;
+    }
+#else
+    (void)ctx;
+    (void)nio;
+#endif
+    for ( i = 0; i < nreads; i++ )
+    {
+        if ( !reads[i].ok )
+            reads[i].ok = bsb_pread( reads[i].p, reads[i].data, reads[i].end - reads[i].start,
+                                     reads[i].start );
+    }
+
+    /* decode the rows out of the ranges */
+    for ( i = 0; i < n; i++ )
+    {
+        BSBRowRequest* q = sorted[i];
+        const BSBImage* p = q->image;
+        const uint8_t* rbuf;
+        if ( which[i] == n )
+            rbuf = p->map + p->row_index[q->row];
+        else if ( which[i] >= 0 && which[i] < nreads && reads[which[i]].ok )
+            rbuf = reads[which[i]].data + (p->row_index[q->row] - reads[which[i]].start);
+        else
+        {
+            all = 0;
+            continue;
+        }
+        q->ok = bsb_decode_row( p, q->row, rbuf, bsb_row_size( p, q->row ),
+                                q->buf, q->xoffset, q->len );
+        all &= q->ok;
+    }
+
+    free(data);
+    free(reads);
+    free(which);
+    free(sorted);
+    return all;
+}
+
+/**
+ * Seeks-to and reads part of a row converted to the given pixel format.
+ * The palette colors are written directly while the runs are expanded,
+ * so no separate palette-to-RGB pass over the row is needed.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param row row to read
+ * @param buf output buffer for len pixels (see bsb_pixel_size())
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to read
+ * @param fmt output pixel format
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_rgb(BSBImage *p, int row, uint8_t *buf, int xoffset, int len,
+                            BSBPixelFormat fmt)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 )
+        return 0;
+
+    if ( fmt == BSB_PIXEL_INDEX )
+        return bsb_read_row_part( p, row, buf, xoffset, len );
+
+    if ( !bsb_build_row_index( p ) || !p->rbuf || !bsb_row_size( p, row ) )
+        return 0;
+    bsb_prefetch( p, row, 1 );
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row( p, p->rbuf, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row_fmt( p, row, rbuf, size, buf, xoffset, len, fmt );
+}
+
+/**
+ * Reentrant version of bsb_read_row_rgb(), see bsb_read_row_part_r().
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param ctx caller-owned decode context (see bsb_context_init())
+ * @param row row to read
+ * @param buf output buffer for len pixels (see bsb_pixel_size())
+ * @param xoffset X offset in a row to start reading from
+ * @param len number of points to read
+ * @param fmt output pixel format
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_read_row_rgb_r(const BSBImage *p, BSBDecodeContext *ctx, int row, uint8_t *buf,
+                              int xoffset, int len, BSBPixelFormat fmt)
+{
+    if ( row < 0 || row >= p->height || xoffset < 0 || xoffset >= p->width || len <= 0 )
+        return 0;
+
+    int size;
+    const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, row, &size );
+    if ( !rbuf )
+        return 0;
+
+    return bsb_decode_row_fmt( p, row, rbuf, size, buf, xoffset, len, fmt );
+}
+
+/* per row worker run by bsb_run_rows() */
+typedef int (*bsb_row_func)(const BSBImage *p, BSBDecodeContext *ctx, int row, void *arg);
+
+/* rows are handed out to the threads in blocks of this many rows */
+#define BSB_ROW_BLOCK 16
+
+typedef struct BSBRowJob
+{
+    const BSBImage* p;
+    bsb_row_func fn;
+    void* arg;
+    int row;        /* first row of the whole range */
+    int nrows;      /* number of rows of the whole range */
+    int first;      /* first block of this job */
+    int step;       /* number of jobs (distance between blocks of a job) */
+    int ok;
+} BSBRowJob;
+
+/**
+ * internal function - processes every step-th block of rows of a job
+ * with its own decode context
+ */
+static void* bsb_row_worker(void *arg)
+{
+    BSBRowJob* job = (BSBRowJob*)arg;
+    BSBDecodeContext ctx;
+    int b, r;
+
+    bsb_context_init(&ctx);
+    for ( b = job->first*BSB_ROW_BLOCK; b < job->nrows; b += job->step*BSB_ROW_BLOCK )
+    {
+        for ( r = b; r < b+BSB_ROW_BLOCK && r < job->nrows; r++ )
+        {
+            if ( !job->fn( job->p, &ctx, job->row+r, job->arg ) )
+                job->ok = 0;
+        }
+    }
+    bsb_context_free(&ctx);
+    return 0;
+}
+
+/**
+ * internal function - calls fn for every row of the range using up to
+ * nthreads threads (the calling thread included)
+ *
+ * @param p	pointer to an opened BSBImage with row index
+ * @param row first row to process
+ * @param nrows number of rows to process
+ * @param nthreads number of threads, 0 or less means number of CPUs
+ * @param fn function to call for each row
+ * @param arg argument passed to fn
+ *
+ * @returns 1 when fn succeeded for all rows and 0 otherwise
+ */
+static int bsb_run_rows(const BSBImage *p, int row, int nrows, int nthreads,
+                        bsb_row_func fn, void *arg)
+{
+    int i, ok = 1;
+    int nblocks = (nrows + BSB_ROW_BLOCK - 1) / BSB_ROW_BLOCK;
+
+#ifdef _WIN32
+    nthreads = 1;
+#else
+    if ( nthreads <= 0 )
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    /* user I/O callbacks have a single position, so no threads for them */
+    if ( p->io )
+        nthreads = 1;
+    if ( nthreads > nblocks )
+        nthreads = nblocks;
+    if ( nthreads < 1 )
+        nthreads = 1;
+
+    BSBRowJob* jobs = (BSBRowJob*)malloc( nthreads*sizeof(BSBRowJob) );
+    if ( !jobs )
+        return 0;
+    for ( i = 0; i < nthreads; i++ )
+    {
+        jobs[i].p = p;
+        jobs[i].fn = fn;
+        jobs[i].arg = arg;
+        jobs[i].row = row;
+        jobs[i].nrows = nrows;
+        jobs[i].first = i;
+        jobs[i].step = nthreads;
+        jobs[i].ok = 1;
+    }
+
+#ifndef _WIN32
+    pthread_t* threads = (pthread_t*)malloc( nthreads*sizeof(pthread_t) );
+    int* started = (int*)calloc( nthreads, sizeof(int) );
+    if ( threads && started )
+    {
+        for ( i = 1; i < nthreads; i++ )
+            started[i] = pthread_create( &threads[i], NULL, bsb_row_worker, &jobs[i] ) == 0;
+    }
+#endif
+
+    /* the calling thread does the first job itself */
+    bsb_row_worker( &jobs[0] );
+
+    for ( i = 1; i < nthreads; i++ )
+    {
+#ifndef _WIN32
+        if ( threads && started && started[i] )
+            pthread_join( threads[i], NULL );
+        else
+#endif
+            bsb_row_worker( &jobs[i] );
+    }
+#ifndef _WIN32
+    free(threads);
+    free(started);
+#endif
+
+    for ( i = 0; i < nthreads; i++ )
+        ok &= jobs[i].ok;
+    free(jobs);
+    return ok;
+}
+
+/* destination of bsb_read_image_rgb() rows */
+typedef struct BSBImageDest
+{
+    uint8_t* buf;
+    int stride;
+    int row;
+    BSBPixelFormat fmt;
+} BSBImageDest;
+
+static int bsb_read_image_row(const BSBImage *p, BSBDecodeContext *ctx, int row, void *arg)
+{
+    BSBImageDest* dest = (BSBImageDest*)arg;
+    return bsb_read_row_rgb_r( p, ctx, row, dest->buf + (size_t)(row - dest->row)*dest->stride,
+                               0, p->width, dest->fmt );
+}
 
 /**
- * generic polynomial to convert georeferenced lat/lon to char's x/y
+ * Reads a range of whole rows into a caller buffer using several threads.
+ * Rows are independent once the row index is loaded, so the range is
+ * split between threads, each decoding with its own context.
+ * A missing or damaged row index is first rebuilt from the rows (see
+ * bsb_build_row_index()), and charts opened with bsb_open_io() are read
+ * by the calling thread only.
  *
- * @param coeff list of polynomial coefficients
- * @param lon longitute or x
- * @param lat latitude or y
+ * @param p	pointer to an opened BSBImage
+ * @param buf output buffer for nrows rows of uncompressed pixel data
+ * @param stride distance in bytes between rows in buf (0 means p->width)
+ * @param row first row to read
+ * @param nrows number of rows to read
+ * @param nthreads number of threads to use, 0 or less means number of CPUs
  *
- * @return coordinate corresponding to the coeff list
+ * @returns 1 on success and 0 on error
  */
-static double polytrans( double* coeff, double lon, double lat )
+extern int bsb_read_image(BSBImage *p, uint8_t *buf, int stride, int row, int nrows, int nthreads)
 {
-    double ret = coeff[0] + coeff[1]*lon + coeff[2]*lat;
-    ret += coeff[3]*lon*lon;
-    ret += coeff[4]*lon*lat;
-    ret += coeff[5]*lat*lat;
-    ret += coeff[6]*lon*lon*lon;
-    ret += coeff[7]*lon*lon*lat;
-    ret += coeff[8]*lon*lat*lat;
-    ret += coeff[9]*lat*lat*lat;
-    ret += coeff[10]*lat*lat*lat*lat;
-    ret += coeff[11]*lat*lat*lat*lat*lat;
-    return ret;
+    return bsb_read_image_rgb( p, buf, stride, row, nrows, nthreads, BSB_PIXEL_INDEX );
 }
 
 /**
- * converts Lon/Lat to chart's X/Y
+ * Same as bsb_read_image() but converts the pixels to the given format
+ * while decoding (see bsb_read_row_rgb()).
  *
- * @param p	pointer to a BSBImage structure
- * @param lon longitude (-180.0 to 180.0)
- * @param lat latitude (-180.0 to 180.0)
- * @param x  output chart X coordinate
- * @param y  output chart Y coordinate
+ * @param p	pointer to an opened BSBImage
+ * @param buf output buffer for nrows rows of pixels
+ * @param stride distance in bytes between rows in buf
+ *               (0 means p->width times bsb_pixel_size(fmt))
+ * @param row first row to read
+ * @param nrows number of rows to read
+ * @param nthreads number of threads to use, 0 or less means number of CPUs
+ * @param fmt output pixel format
  *
- * @return 1 on success and 0 on error
+ * @returns 1 on success and 0 on error
  */
-extern int bsb_LLtoXY(BSBImage *p, double lon, double  lat, int* x, int* y)
+extern int bsb_read_image_rgb(BSBImage *p, uint8_t *buf, int stride, int row, int nrows,
+                              int nthreads, BSBPixelFormat fmt)
 {
-    /* change longitude phase (CPH) */
-    lon = (lon < 0) ? lon + p->cph : lon - p->cph;
-    double xd = polytrans( p->wpx, lon, lat );
-    double yd = polytrans( p->wpy, lon, lat );
-    *x = (int)(xd + 0.5);
-    *y = (int)(yd + 0.5);
-    return 1;
+    if ( row < 0 || nrows <= 0 || row + nrows > p->height || !bsb_pixel_size(fmt) )
+        return 0;
+    if ( stride <= 0 )
+        stride = p->width * bsb_pixel_size(fmt);
+
+    if ( !bsb_build_row_index( p ) )
+        return 0;
+    bsb_prefetch( p, row, nrows );
+
+    BSBImageDest dest;
+    dest.buf = buf;
+    dest.stride = stride;
+    dest.row = row;
+    dest.fmt = fmt;
+    return bsb_run_rows( p, row, nrows, nthreads, bsb_read_image_row, &dest );
 }
 
 /**
- * converts chart's X/Y to Lon/Lat
- *
- * @param p	pointer to a BSBImage structure
- * @param x chart X coordinate
- * @param y chart Y coordinate
- * @param lon output longitude (-180.0 to 180.0)
- * @param lat output latitude (-180.0 to 180.0)
- *
- * @return 1 on success and 0 on error
+ * internal function - stores one RGB color in the given pixel format
  */
-extern int bsb_XYtoLL(BSBImage *p, int x, int y, double* lonout, double*  latout)
+static void bsb_store_rgb(uint8_t *out, BSBPixelFormat fmt, uint8_t r, uint8_t g, uint8_t b)
 {
-    double lon = polytrans( p->pwx, x, y );
-    lon = (lon < 0) ? lon + p->cph : lon - p->cph;
-    *lonout = lon;
-    *latout = polytrans( p->pwy, x, y );
-    return 1;
+    uint32_t v32;
+    uint16_t v16;
+    switch ( fmt )
+    {
+    case BSB_PIXEL_INDEX:
+        break;
+    case BSB_PIXEL_RGB24:
+        out[0] = r; out[1] = g; out[2] = b;
+        break;
+    case BSB_PIXEL_RGBA32:
+        out[0] = r; out[1] = g; out[2] = b; out[3] = 0xff;
+        break;
+    case BSB_PIXEL_BGRA32:
+        out[0] = b; out[1] = g; out[2] = r; out[3] = 0xff;
+        break;
+    case BSB_PIXEL_ARGB32:
+        v32 = 0xff000000u | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+        memcpy(out, &v32, 4);
+        break;
+    case BSB_PIXEL_RGB565:
+        v16 = (uint16_t)((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+        memcpy(out, &v16, 2);
+        break;
+    }
 }
 
+/* parameters of bsb_read_overview() shared by the band workers */
+typedef struct BSBOverviewDest
+{
+    uint8_t* buf;
+    int stride;
+    int x, y, w, k;
+    BSBPixelFormat fmt;
+} BSBOverviewDest;
 
 /**
- * Seeks the file to the given row so read_row can start reading.
- * Uses the index table at the end of the BSB file to quickly jump to a row.
- *
- * @param p	pointer to a BSBImage
- * @param row row to seek to starting from row 0 (BSB row 1)
- *
- * @returns 1 on success and 0 on error
- *
+ * internal function - computes one output row of bsb_read_overview() from
+ * the run lists of its band of k chart rows
  */
-extern int bsb_seek_to_row(BSBImage *p, int row)
+static int bsb_overview_row(const BSBImage *p, BSBDecodeContext *ctx, int orow, void *arg)
 {
-    int st, start_of_index, start_of_rows;
+    BSBOverviewDest* d = (BSBOverviewDest*)arg;
+    int bpp = bsb_pixel_size(d->fmt), majority = d->fmt == BSB_PIXEL_INDEX;
+    uint8_t* out = d->buf + (size_t)orow*d->stride;
+    int i, n, r, y0 = d->y + orow*d->k, ok = 1;
 
-    /* in case we did not cahced the index, read it here */
-    if ( !p->row_index )
+    /* chart pixels covered by the whole output row */
+    int len = d->w*d->k;
+    if ( d->x + len > p->width )
+        len = p->width - d->x;
+    int cells = (len + d->k - 1) / d->k;
+
+    memset(out, 0, (size_t)d->w*bpp);
+    if ( y0 >= p->height || cells <= 0 )
+        return 1;
+
+    /* Per output pixel color histograms, or sums of r,g,b and pixel count
+       (64 bit, k*k*255 soon exceeds 32 bits), with the run list after
+       them.  The scratch memory lives in the thread's context for all
+       its rows; histograms are left cleared after each row, only the
+       bins listed in touched having to be reset. */
+    size_t accsize = majority ? (size_t)cells*256*sizeof(uint32_t) : (size_t)cells*4*sizeof(uint64_t);
+    size_t touchedsize = majority ? (size_t)cells*256*sizeof(uint32_t) : 0;
+    size_t scratch = accsize + touchedsize + (size_t)len*sizeof(BSBRun);
+    if ( ctx->scratch_size != scratch )
     {
-        /* Read start-of-index offset */
-        if (fseek(p->pFile, -4, SEEK_END) == -1)
-            return 0;
-        if (fread(&st, 4, 1, p->pFile) != 1)
+        free(ctx->scratch);
+        ctx->scratch_size = 0;
+        if ( !(ctx->scratch = calloc(1, scratch)) )
             return 0;
-        start_of_index = bsb_ntohl(st);
-        /* Read start-of-rows offset */
-        if (fseek(p->pFile, row*4 + start_of_index, SEEK_SET) == -1)
-            return 0;
-        if (fread(&st, 4, 1, p->pFile) != 1)
-            return 0;
-        start_of_rows = bsb_ntohl(st);
+        ctx->scratch_size = scratch;
     }
-    else
+    uint32_t* hist = (uint32_t*)ctx->scratch;
+    uint64_t* sums = (uint64_t*)ctx->scratch;
+    uint32_t* touched = (uint32_t*)((uint8_t*)ctx->scratch + accsize);
+    BSBRun* runs = (BSBRun*)((uint8_t*)ctx->scratch + accsize + touchedsize);
+    int ntouched = 0;
+    if ( !majority )
+        memset(sums, 0, accsize);
+
+    for ( r = y0; r < y0 + d->k && r < p->height; r++ )
     {
-        start_of_rows = p->row_index[row];
+        int size;
+        const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, r, &size );
+        if ( !rbuf || !(n = bsb_decode_runs( p, r, rbuf, size, runs, len, d->x, len )) )
+        {
+            ok = 0;
+            continue;
+        }
+        /* spread every run over the output pixels it overlaps */
+        int rx = 0;
+        for ( i = 0; i < n; i++ )
+        {
+            int c = runs[i].color, end = rx + runs[i].len;
+            while ( rx < end )
+            {
+                int cell = rx / d->k;
+                int cend = (cell+1)*d->k;
+                int cnt = (end < cend ? end : cend) - rx;
+                if ( majority )
+                {
+                    uint32_t bin = (uint32_t)cell*256 + c;
+                    if ( !hist[bin] )
+                        touched[ntouched++] = bin;
+                    hist[bin] += cnt;
+                }
+                else
+                {
+                    uint64_t* a = sums + cell*4;
+                    a[0] += (uint64_t)p->red[c]*cnt;
+                    a[1] += (uint64_t)p->green[c]*cnt;
+                    a[2] += (uint64_t)p->blue[c]*cnt;
+                    a[3] += cnt;
+                }
+                rx += cnt;
+            }
+        }
     }
 
-    /* seek to row offset */
-    if (fseek(p->pFile, start_of_rows, SEEK_SET) == -1)
-        return 0;
+    if ( majority )
+    {
+        /* most frequent color of each cell, the lowest index on a tie */
+        for ( i = 0; i < ntouched; i++ )
+        {
+            uint32_t bin = touched[i], cell = bin / 256, c = bin % 256;
+            uint32_t best = hist[cell*256 + out[cell]];
+            if ( hist[bin] > best || (hist[bin] == best && c < out[cell]) )
+                out[cell] = c;
+        }
+        for ( i = 0; i < ntouched; i++ )
+            hist[touched[i]] = 0;
+    }
     else
-        return 1;
+    {
+        for ( i = 0; i < cells; i++ )
+        {
+            const uint64_t* a = sums + i*4;
+            if ( a[3] )
+                bsb_store_rgb( out + i*bpp, d->fmt, (a[0] + a[3]/2) / a[3],
+                               (a[1] + a[3]/2) / a[3], (a[2] + a[3]/2) / a[3] );
+        }
+    }
+    return ok;
 }
 
-/* Table used for computing multiplier in bsb_read_row() */
-static char mul_mask[8] = { 0, 63, 31, 15, 7, 3, 1, 0};
-
 /**
- * Read currently seek-to row. Can continue to read more rows.
+ * Reads a downsampled overview of a chart area.  Every output pixel is the
+ * box average of k x k chart pixels, computed from the run lists of the
+ * rows so the full resolution pixels are never expanded.  For
+ * BSB_PIXEL_INDEX output the most frequent palette index of the box is
+ * used instead of the average.  Output pixels completely outside the chart
+ * are set to 0, boxes cut by the chart border average the part inside.
+ * Output rows are computed in parallel.
+ * This requires the row index to be present.
  *
- * @param p	pointer to a BSBImage containing file pointer at the start of a row
- *			this occurs after bsb_open_header() or bsb_seek_to_row()
- * @oaram buf output buffer for uncompressed pixel data
+ * @param p	pointer to an opened BSBImage
+ * @param x chart X of the top left corner of the area
+ * @param y chart Y of the top left corner of the area
+ * @param w width of the output in pixels (covers w*k chart pixels)
+ * @param h height of the output in pixels (covers h*k chart rows)
+ * @param k downsampling factor
+ * @param buf output buffer for h rows of w pixels
+ * @param stride distance in bytes between rows in buf
+ *               (0 means w times bsb_pixel_size(fmt))
+ * @param nthreads number of threads to use, 0 or less means number of CPUs
+ * @param fmt output pixel format
  *
  * @returns 1 on success and 0 on error
  */
-extern int bsb_read_row(BSBImage *p, uint8_t *buf)
+extern int bsb_read_overview(BSBImage *p, int x, int y, int w, int h, int k,
+                             uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt)
 {
-    int     c, multiplier, row_num = 0;
-    int     pixel = 1, written = 0;
+    if ( x < 0 || y < 0 || x >= p->width || y >= p->height || w <= 0 || h <= 0 || k <= 0 )
+        return 0;
+    if ( !bsb_pixel_size(fmt) || !bsb_build_row_index( p ) )
+        return 0;
+    if ( stride <= 0 )
+        stride = w * bsb_pixel_size(fmt);
+    bsb_prefetch( p, y, h*k );
 
-    /* The row number is stored in the low 7 bits of each byte.				*/
-    /* The 8th bit indicates if row number is continued in the next byte.	*/
-    do
-    {
-        c = fgetc(p->pFile);
-        row_num = ((row_num & 0x7f) << 7) + c;
-    } while (c >= 0x80);
+    BSBOverviewDest dest;
+    dest.buf = buf;
+    dest.stride = stride;
+    dest.x = x;
+    dest.y = y;
+    dest.w = w;
+    dest.k = k;
+    dest.fmt = fmt;
+    return bsb_run_rows( p, 0, h, nthreads, bsb_overview_row, &dest );
+}
 
-    /* Rows are terminated by '\0'.  Note that rows can contain a '\0'	*/
-    /* as part of the run-length data, so '\0' does not delimit rows.	*/
-    /* (This occurs when multiplier is a multiple of 128 - 1)			*/
-    while ((c = fgetc(p->pFile)) != '\0')
+/* radius of the sphere of Web Mercator (EPSG:3857) in meters */
+#define BSB_MERCATOR_RADIUS 6378137.0
+#define BSB_DEGREES (180.0 / 3.14159265358979323846)
+
+/* output rows of bsb_read_mercator() sampled from one set of decoded chart
+   rows, small enough that a 256 pixel tile still splits between threads */
+#define BSB_WARP_BAND 4
+
+/* parameters of bsb_read_mercator() shared by the band workers */
+typedef struct BSBWarpDest
+{
+    uint8_t* buf;
+    int stride;
+    double mx, my, res;
+    int w, h;
+    BSBPixelFormat fmt;
+    int bilinear;
+} BSBWarpDest;
+
+/**
+ * internal function - whether chart coordinates cx,cy are on the chart,
+ * i.e. within half a pixel of a pixel centre (written so NaN is not)
+ */
+static inline int bsb_warp_inside(const BSBImage *p, double cx, double cy)
+{
+    return cx >= -0.5 && cx < p->width - 0.5 && cy >= -0.5 && cy < p->height - 0.5;
+}
+
+/**
+ * internal function - computes one band of output rows of
+ * bsb_read_mercator().  The output pixel centres are mapped to chart
+ * coordinates first, then only the chart rows they fall on are decoded,
+ * across the columns they span, and sampled.
+ */
+static int bsb_warp_band(const BSBImage *p, BSBDecodeContext *ctx, int band, void *arg)
+{
+    BSBWarpDest* d = (BSBWarpDest*)arg;
+    int bpp = bsb_pixel_size(d->fmt), r, i, ok = 1;
+    int y0 = band*BSB_WARP_BAND;
+    int rows = d->h - y0 < BSB_WARP_BAND ? d->h - y0 : BSB_WARP_BAND;
+    int n = rows*d->w;
+
+    for ( r = 0; r < rows; r++ )
+        memset( d->buf + (size_t)(y0+r)*d->stride, 0, (size_t)d->w*bpp );
+
+    /* chart coordinates of the output pixel centres */
+    double* cx = (double*)malloc( 2*n*sizeof(double) );
+    if ( !cx )
+        return 0;
+    double* cy = cx + n;
+    double lon = (d->mx + 0.5*d->res) / BSB_MERCATOR_RADIUS * BSB_DEGREES;
+    double dlon = d->res / BSB_MERCATOR_RADIUS * BSB_DEGREES;
+    for ( r = 0; r < rows; r++ )
     {
-        if (c == EOF)
-        {
-            fprintf(stderr, "Warning: EOF reading row %d\n", row_num);
-            return 0;
-        }
+        double my = d->my - (y0 + r + 0.5)*d->res;
+        double lat = atan( sinh( my / BSB_MERCATOR_RADIUS ) ) * BSB_DEGREES;
+        bsb_LLtoXY_row( p, lat, lon, dlon, d->w, cx + r*d->w, cy + r*d->w );
+    }
 
-        pixel = (c & 0x7f) >> (7 - p->depth);
-        multiplier = c & mul_mask[(int)p->depth];
+    /* chart rows and columns sampled, bilinear also needs the next ones */
+    int xmin = p->width, xmax = -1, ymin = p->height, ymax = -1;
+    for ( i = 0; i < n; i++ )
+    {
+        if ( !bsb_warp_inside( p, cx[i], cy[i] ) )
+            continue;
+        int ix = d->bilinear ? (cx[i] > 0 ? (int)cx[i] : 0) : (int)(cx[i] + 0.5);
+        int iy = d->bilinear ? (cy[i] > 0 ? (int)cy[i] : 0) : (int)(cy[i] + 0.5);
+        xmin = ix < xmin ? ix : xmin;
+        xmax = ix + d->bilinear > xmax ? ix + d->bilinear : xmax;
+        ymin = iy < ymin ? iy : ymin;
+        ymax = iy + d->bilinear > ymax ? iy + d->bilinear : ymax;
+    }
+    xmax = xmax < p->width ? xmax : p->width-1;
+    ymax = ymax < p->height ? ymax : p->height-1;
+    if ( xmax < xmin )
+    {
+        free(cx);
+        return 1;
+    }
 
-        while (c >= 0x80)
+    /* decode the chart rows actually used, which is all of them unless the
+       output is smaller than the chart */
+    int xspan = xmax - xmin + 1, yspan = ymax - ymin + 1, used = 0;
+    const uint8_t** line = (const uint8_t**)calloc( yspan, sizeof(*line) );
+    uint8_t* pixels = 0;
+    if ( line )
+    {
+        for ( i = 0; i < n; i++ )
         {
-            c = fgetc(p->pFile);
-            multiplier = (multiplier << 7) + (c & 0x7f);
+            if ( !bsb_warp_inside( p, cx[i], cy[i] ) )
+                continue;
+            int iy = d->bilinear ? (cy[i] > 0 ? (int)cy[i] : 0) : (int)(cy[i] + 0.5);
+            for ( r = iy; r <= iy + d->bilinear && r <= ymax; r++ )
+            {
+                if ( !line[r - ymin] )
+                {
+                    /* any non-null pointer marks the row until it is decoded */
+                    line[r - ymin] = (const uint8_t*)line;
+                    used++;
+                }
+            }
         }
-        multiplier++;
-        /* limit impact of corrupt BSB data */
-        /* For the lower depths, the "grain" of the multiplyer is		*/
-        /* course, so don't write past the width of the buffer.			*/
-        if ( written + multiplier > p->width )
+        pixels = (uint8_t*)malloc( (size_t)used*xspan );
+    }
+    if ( !pixels )
+    {
+        free(line);
+        free(cx);
+        return 0;
+    }
+    for ( r = 0, used = 0; r < yspan; r++ )
+    {
+        if ( !line[r] )
+            continue;
+        uint8_t* row = pixels + (size_t)used++*xspan;
+        if ( !bsb_read_row_part_r( p, ctx, ymin + r, row, xmin, xspan ) )
         {
-            multiplier = p->width - written;
+            memset( row, 0, xspan );
+            ok = 0;
         }
-        memset( buf+written, pixel-1, multiplier );
-        written += multiplier;
+        line[r] = row;
     }
 
-    if (written < p->width)
+    /* sample */
+    for ( i = 0; i < n; i++ )
     {
-        int short_fall = p->width - written;
-
-        /* It seems valid BSB rows sometimes don't include pixel data for	*/
-        /* the very last pixel or two.  Perhaps the decoder is supposed		*/
-        /* to merely repeat the last pixel until the width is reached.		*/
-        /* A value of 8 was chosen as a guess since the intended behaviour	*/
-        /* of a BSB reader in this situation is not known.					*/
-        if (short_fall < 8)
-        {
-            /* Repeat the last pixel value for small short falls */
-            while (written < p->width)
-                buf[written++] = pixel - 1;
-        }
-        else
+        uint8_t* out = d->buf + (size_t)(y0 + i/d->w)*d->stride + (size_t)(i%d->w)*bpp;
+        if ( !bsb_warp_inside( p, cx[i], cy[i] ) )
+            continue;
+        if ( !d->bilinear )
         {
-            fprintf(stderr, "Warning: Short row for row %d written=%d width=%d\n", row_num, written, p->width);
-            return 0;
+            uint8_t c = line[(int)(cy[i] + 0.5) - ymin][(int)(cx[i] + 0.5) - xmin];
+            if ( d->fmt == BSB_PIXEL_INDEX )
+                *out = c;
+            else
+                bsb_store_rgb( out, d->fmt, p->red[c], p->green[c], p->blue[c] );
+            continue;
         }
+        /* past the outer pixel centres the edge pixels are repeated */
+        double fx = cx[i] > 0 ? cx[i] : 0, fy = cy[i] > 0 ? cy[i] : 0;
+        int ix = (int)fx, iy = (int)fy;
+        int ix1 = ix+1 < p->width ? ix+1 : ix, iy1 = iy+1 < p->height ? iy+1 : iy;
+        int tx = (int)((fx - ix)*256 + 0.5), ty = (int)((fy - iy)*256 + 0.5);
+        const uint8_t *l0 = line[iy - ymin], *l1 = line[iy1 - ymin];
+        uint8_t c00 = l0[ix - xmin], c10 = l0[ix1 - xmin], c01 = l1[ix - xmin], c11 = l1[ix1 - xmin];
+        uint32_t w00 = (256-tx)*(256-ty), w10 = tx*(256-ty), w01 = (256-tx)*ty, w11 = tx*ty;
+        bsb_store_rgb( out, d->fmt,
+            (p->red[c00]*w00 + p->red[c10]*w10 + p->red[c01]*w01 + p->red[c11]*w11 + 32768) >> 16,
+            (p->green[c00]*w00 + p->green[c10]*w10 + p->green[c01]*w01 + p->green[c11]*w11 + 32768) >> 16,
+            (p->blue[c00]*w00 + p->blue[c10]*w10 + p->blue[c01]*w01 + p->blue[c11]*w11 + 32768) >> 16 );
     }
-    return 1;
+    free(pixels);
+    free(line);
+    free(cx);
+    return ok;
 }
 
 /**
- * Seeks-to and reads given row.
- * This is performance improved version but it requires that row index is present.
+ * Reprojects a chart area to Web Mercator (EPSG:3857).  Every output pixel
+ * centre is mapped to the chart through the WPX/WPY polynomials (and CPH)
+ * and sampled, so the output can go straight into a tile of a web map.
+ * Bands of output rows are computed in parallel, each decoding only the
+ * part of the chart rows it samples, so the chart is never decoded as a
+ * whole.  Output pixels off the chart are set to 0 (transparent for the
+ * formats with alpha).  Call bsb_build_transform_lattice() first to
+ * interpolate the transform instead of evaluating it for every pixel.
+ * This requires the row index to be present, and fails for charts without
+ * WPX/WPY polynomials.
  *
- * @param p	pointer to a BSBImage containing file pointer at the start of a row
- *			this occurs after bsb_open_header() or bsb_seek_to_row()
- * @param buf output buffer for uncompressed pixel data
+ * @param p	pointer to an opened BSBImage
+ * @param mx Web Mercator X in meters of the left edge of the output
+ * @param my Web Mercator Y in meters of the top edge of the output
+ * @param res size of an output pixel in meters
+ * @param w width of the output in pixels
+ * @param h height of the output in pixels
+ * @param buf output buffer for h rows of w pixels
+ * @param stride distance in bytes between rows in buf
+ *               (0 means w times bsb_pixel_size(fmt))
+ * @param nthreads number of threads to use, 0 or less means number of CPUs
+ * @param fmt output pixel format
+ * @param sampling BSB_SAMPLE_NEAREST or BSB_SAMPLE_BILINEAR (which blends
+ *                 colors so is nearest for BSB_PIXEL_INDEX)
  *
  * @returns 1 on success and 0 on error
  */
-extern int bsb_read_row_at(BSBImage *p, int row, uint8_t *buf)
+extern int bsb_read_mercator(BSBImage *p, double mx, double my, double res, int w, int h,
+                             uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt,
+                             BSBSampling sampling)
 {
-	return bsb_read_row_part(p, row, buf, 0, p->width);
+    if ( w <= 0 || h <= 0 || !(res > 0) || !p->wpx || (p->wpx[1] == 0 && p->wpx[2] == 0) )
+        return 0;
+    if ( !bsb_pixel_size(fmt) || !bsb_build_row_index( p ) )
+        return 0;
+    if ( stride <= 0 )
+        stride = w * bsb_pixel_size(fmt);
+
+    BSBWarpDest dest;
+    dest.buf = buf;
+    dest.stride = stride;
+    dest.mx = mx;
+    dest.my = my;
+    dest.res = res;
+    dest.w = w;
+    dest.h = h;
+    dest.fmt = fmt;
+    dest.bilinear = sampling == BSB_SAMPLE_BILINEAR && fmt != BSB_PIXEL_INDEX;
+    return bsb_run_rows( p, 0, (h + BSB_WARP_BAND - 1) / BSB_WARP_BAND, nthreads, bsb_warp_band, &dest );
 }
 
 /**
- * Seeks-to and reads part of a row.
- * This is performance improved version but it requires that row index is present.
- *
- * @param p	pointer to a BSBImage containing file pointer at the start of a row
- *			this occurs after bsb_open_header() or bsb_seek_to_row()
- * @param buf output buffer for uncompressed pixel data
+ * Reads a tile of the usual XYZ web map tiling (zoom level z has 2^z x 2^z
+ * tiles, numbered from the top left) with bsb_read_mercator().
  *
- * @param xoffset X offset in a row to start reading from
- * @param len number of points to read (length of buf)
+ * @param p	pointer to an opened BSBImage
+ * @param z zoom level
+ * @param tx column of the tile
+ * @param ty row of the tile
+ * @param size width and height of the tile in pixels, usually 256
+ * @param buf output buffer for size rows of size pixels
+ * @param stride distance in bytes between rows in buf
+ *               (0 means size times bsb_pixel_size(fmt))
+ * @param nthreads number of threads to use, 0 or less means number of CPUs
+ * @param fmt output pixel format
+ * @param sampling BSB_SAMPLE_NEAREST or BSB_SAMPLE_BILINEAR
  *
  * @returns 1 on success and 0 on error
  */
-extern int bsb_read_row_part(BSBImage *p, int row, uint8_t *buf, int xoffset, int buflen)
+extern int bsb_read_mercator_tile(BSBImage *p, int z, int tx, int ty, int size,
+                                  uint8_t *buf, int stride, int nthreads, BSBPixelFormat fmt,
+                                  BSBSampling sampling)
 {
-	/* trying to read outside of image? */
-	if( row >= p->height )
-		return 0;
-	if( xoffset >= p->width )
-		return 0;
-	int len = buflen;
-	if( xoffset+len > p->width )
-	{
-		len = p->width-xoffset;
-	}
-		
-    /* if we failed to read row index use old routine */
-    if ( !p->rbuf || !p->row_index || !p->row_index[row] )
-    {
-        bsb_seek_to_row( p, row );
-        return bsb_read_row( p, buf );
-    }
+    double half = BSB_MERCATOR_RADIUS * 3.14159265358979323846, span;
 
-    if ( fseek( p->pFile, p->row_index[row], SEEK_SET ) == -1 )
+    if ( z < 0 || z > 30 || tx < 0 || ty < 0 || tx >= 1 << z || ty >= 1 << z || size <= 0 )
         return 0;
+    span = 2*half / (1 << z);
+    return bsb_read_mercator( p, -half + tx*span, half - ty*span, span / size, size, size,
+                              buf, stride, nthreads, fmt, sampling );
+}
 
-    int size = p->row_index[row+1]-p->row_index[row];
-    unsigned char* rbuf = p->rbuf;
-    /* read compressed row in one step */
-    if ( fread( rbuf, size, 1, p->pFile ) != 1 )
-    {
-        return 0;
-    }
-	
-    /* uncompress the row */
-	
-    /* The row number is stored in the low 7 bits of each byte.		*/
-    /* The 8th bit indicates if row number is continued in the next byte.	*/
-	
-    int cidx = 0;
-    int c, row_num = 0;	
-	do
-    {
-        c = rbuf[cidx++];
-        row_num = ((row_num & 0x7f) << 7) + c;
-    } while (c >= 0x80);
+/* default distance in pixels between x checkpoints */
+#define BSB_XINDEX_STEP 256
 
-    int multiplier, pixel = 1, rowx = 0, bufidx = 0;
- 	int maxWidth = xoffset + len;
-	
-    /* Rows are terminated by '\0'.  Note that rows can contain a '\0'	*/
-    /* as part of the run-length data, so '\0' does not delimit rows.	*/
-    /* (This occurs when multiplier is a multiple of 128 - 1)		*/
-    while ((c = rbuf[cidx++]) != '\0' && bufidx < len)
-    {
-        pixel = (c & 0x7f) >> (7 - p->depth);
-        multiplier = c & mul_mask[(int)p->depth];
+/* table filled by bsb_xindex_row() */
+typedef struct BSBXIndexDest
+{
+    uint32_t* xindex;
+    int step;
+    int cols;
+} BSBXIndexDest;
 
-        while (c >= 0x80)
-        {
-            c = rbuf[cidx++];
-            multiplier = (multiplier << 7) + (c & 0x7f);
-        }
-        multiplier++;
+static int bsb_xindex_row(const BSBImage *p, BSBDecodeContext *ctx, int row, void *arg)
+{
+    BSBXIndexDest* dest = (BSBXIndexDest*)arg;
+    uint32_t* e = dest->xindex + (size_t)row*dest->cols*2;
+    int size, pixel, multiplier, rowx = 0, k = 0;
 
-		/* limit impact of corrupt BSB data */
-        if (multiplier > maxWidth)
-            multiplier = maxWidth-rowx;
+    /* rows which can't be read keep no checkpoints (decoded from start) */
+    const uint8_t* rbuf = bsb_fetch_row_ctx( p, ctx, row, &size );
+    if ( !rbuf )
+        return 1;
+    int cidx = bsb_skip_row_number( rbuf, size );
+    if ( cidx < 0 )
+        return 1;
 
-        /* For the lower depths, the "grain" of the multiplyer is		*/
-        /* course, so don't write past the width of the buffer.			*/
-        if (rowx + multiplier > maxWidth)
+    int start = cidx;
+    while ( k < dest->cols && (multiplier = bsb_next_run( rbuf, size, &cidx, p->depth, &pixel )) )
+    {
+        /* remember the run covering each checkpoint position */
+        while ( k < dest->cols && k*dest->step < rowx+multiplier )
         {
-            multiplier = maxWidth-rowx;
+            e[2*k] = start;
+            e[2*k+1] = rowx;
+            k++;
         }
-		if( rowx+multiplier > xoffset )
-		{
-			int step = rowx >= xoffset ? multiplier : multiplier-(xoffset-rowx);
-			if( bufidx+step > len ) step = len-bufidx;
-			memset(buf+bufidx, pixel-1, step);
-			bufidx += step;
-		}
         rowx += multiplier;
+        start = cidx;
     }
+    return 1;
+}
+
+/**
+ * Builds the intra-row x checkpoint table.  For every row it remembers
+ * where in the compressed row the run covering every step-th pixel starts,
+ * so partial row reads can start decoding close to their xoffset instead
+ * of at the start of the row.  It costs one decode pass over the chart
+ * (done with all CPUs) and 8 bytes per checkpoint.
+ * Must be called before the BSBImage is shared between threads.
+ * This requires the row index to be present.
+ *
+ * @param p	pointer to an opened BSBImage
+ * @param step distance in pixels between checkpoints, 0 or less for default
+ *
+ * @returns 1 on success and 0 on error
+ */
+extern int bsb_build_xindex(BSBImage *p, int step)
+{
+    if ( p->height <= 0 || !bsb_build_row_index( p ) )
+        return 0;
+    if ( step <= 0 )
+        step = BSB_XINDEX_STEP;
+
+    if ( !bsb_in_cache(p, p->xindex) )
+        free(p->xindex);
+    p->xindex = 0;
+
+    BSBXIndexDest dest;
+    dest.step = step;
+    dest.cols = (p->width + step - 1) / step;
+    dest.xindex = (uint32_t*)calloc( (size_t)p->height*dest.cols*2, sizeof(uint32_t) );
+    if ( !dest.xindex )
+        return 0;
+
+    bsb_run_rows( p, 0, p->height, 0, bsb_xindex_row, &dest );
 
-	/* It seems valid BSB rows sometimes don't include pixel data for	*/
-	/* the very last pixel or two.  Perhaps the decoder is supposed		*/
-	/* to merely repeat the last pixel until the width is reached.		*/
-	/* A value of 8 was chosen as a guess since the intended behaviour	*/
-	/* of a BSB reader in this situation is not known.					*/
-	/* Repeat the last pixel value for small short falls */
-	if(bufidx < buflen)
-		memset(buf+bufidx, pixel - 1, buflen-bufidx);
+    p->xindex = dest.xindex;
+    p->xindex_step = dest.step;
+    p->xindex_cols = dest.cols;
     return 1;
 }
 
@@ -937,19 +4900,51 @@ extern int bsb_compress_row(BSBImage *p, int row, const uint8_t *aPixel, uint8_t
  */
 extern int bsb_close(BSBImage *p)
 {
-    if (p->pFile)
-    {
-        fclose(p->pFile);
-        free(p->row_index);
-        free(p->rbuf);
-        p->pFile = 0;
+    bsb_free_header(p);
+
+    /* row index and x checkpoints loaded from an index cache */
+    if ( bsb_in_cache(p, p->row_index) )
         p->row_index = 0;
-        p->rbuf = 0;
-        return 1;
-    }
+    if ( bsb_in_cache(p, p->xindex) )
+        p->xindex = 0;
+#ifndef _WIN32
+    if ( p->cache_map && p->cache_size >= BSB_CACHE_MMAP_MIN )
+        munmap((void*)p->cache_map, p->cache_size);
     else
-    {
+#endif
+    free((void*)p->cache_map);
+    p->cache_map = 0;
+    p->cache_size = 0;
+
+    if ( !p->pFile && !p->map && !p->io )
         return 0;
+
+    if (p->pFile)
+    {
+#ifndef _WIN32
+        /* a mapping is ours only when we opened the file (not bsb_open_mem) */
+        if (p->map)
+            munmap((void*)p->map, p->map_size);
+#else
+        if (p->pread_handle)
+            CloseHandle((HANDLE)p->pread_handle);
+#endif
+        fclose(p->pFile);
     }
+    if (p->io && p->io->close)
+        p->io->close(p->io_handle);
+    free(p->row_index);
+    free(p->rbuf);
+    free(p->xindex);
+    p->pFile = 0;
+    p->map = 0;
+    p->map_size = 0;
+    p->io = 0;
+    p->io_handle = 0;
+    p->pread_handle = 0;
+    p->row_index = 0;
+    p->rbuf = 0;
+    p->xindex = 0;
+    return 1;
 }
 
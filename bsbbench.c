@@ -0,0 +1,375 @@
+/*
+ *  bsbbench.c - Micro benchmarks for the libbsb row decoder, header parser and chart open.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <bsb.h>
+
+/* synthetic chart: depth 7 with runs of 1 to 3 pixels like detailed harbour charts */
+#define SYNTH_WIDTH		8000
+#define SYNTH_HEIGHT	1000
+#define SYNTH_DEPTH		7
+
+#define BENCH_PIXELS	2e8
+
+/* synthetic header: REF/PLY points of a large harbour chart */
+#define SYNTH_REFS		400
+#define SYNTH_PLYS		400
+#define BENCH_SECONDS	0.5
+
+static const int mul_mask[8] = { 0, 63, 31, 15, 7, 3, 1, 0 };
+
+static double now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The row decoder as it was before the short run fast path (one memset per run) */
+static void reference_decode_row(const BSBImage *p, const uint8_t *rbuf, uint8_t *buf)
+{
+	int		cidx = 0, c, multiplier, pixel = 1, bufidx = 0, len = p->width;
+
+	do
+		c = rbuf[cidx++];
+	while (c >= 0x80);
+
+	while ((c = rbuf[cidx++]) != '\0' && bufidx < len)
+	{
+		pixel = (c & 0x7f) >> (7 - p->depth);
+		multiplier = c & mul_mask[(int)p->depth];
+		while (c >= 0x80)
+		{
+			c = rbuf[cidx++];
+			multiplier = (multiplier << 7) + (c & 0x7f);
+		}
+		multiplier++;
+		if (bufidx + multiplier > len)
+			multiplier = len - bufidx;
+		memset(buf + bufidx, pixel - 1, multiplier);
+		bufidx += multiplier;
+	}
+	if (bufidx < len)
+		memset(buf + bufidx, pixel - 1, len - bufidx);
+}
+
+static int write_synthetic(const char *filename)
+{
+	BSBImage	image;
+	FILE		*out;
+	uint8_t		*row, *scratch;
+	int			*index, x, y, i, run;
+	unsigned	seed = 1;
+
+	out = fopen(filename, "wb");
+	if (! out)
+	{
+		perror(filename);
+		return 0;
+	}
+	memset(&image, 0, sizeof(image));
+	image.width = SYNTH_WIDTH;
+	image.height = SYNTH_HEIGHT;
+	image.depth = SYNTH_DEPTH;
+
+	fprintf(out, "BSB/NA=SYNTHETIC,NU=0,RA=%d,%d,DU=254\r\n", image.width, image.height);
+	fprintf(out, "IFM/%d\r\n", image.depth);
+	for (i = 1; i < 128; i++)
+		fprintf(out, "RGB/%d,%d,%d,%d\r\n", i, i * 2, 255 - i * 2, i);
+	fputc(0x1a, out);
+	fputc('\0', out);
+	fputc(image.depth, out);
+
+	row = (uint8_t *)malloc(image.width);
+	scratch = (uint8_t *)malloc(image.width * 2 + 8);
+	index = (int *)malloc((image.height + 1) * sizeof(int));
+	for (y = 0; y < image.height; y++)
+	{
+		for (x = 0; x < image.width; x += run)
+		{
+			seed = seed * 1103515245 + 12345;
+			run = 1 + (seed >> 16) % 3;
+			if (x + run > image.width)
+				run = image.width - x;
+			memset(row + x, 1 + (seed >> 8) % 126, run);
+		}
+		index[y] = ftell(out);
+		fwrite(scratch, bsb_compress_row(&image, y, row, scratch), 1, out);
+	}
+	index[image.height] = ftell(out);
+	bsb_write_index(out, image.height, index);
+
+	free(index);
+	free(scratch);
+	free(row);
+	fclose(out);
+	return 1;
+}
+
+static int bench_rows(char *filename)
+{
+	BSBImage	image;
+	BSBDecodeContext ctx;
+	FILE		*fp;
+	uint8_t		*raster, *ref, *buf;
+	int			y, r, size, repeat;
+	double		t, t_ref, t_lib;
+
+	if (! bsb_open_header_mmap(filename, &image))
+		return 0;
+	if (! image.row_index)
+	{
+		fprintf(stderr, "%s: no row index\n", filename);
+		bsb_close(&image);
+		return 0;
+	}
+
+	/* Keep the compressed rows in memory so only decoding is measured */
+	size = image.row_index[image.height] - image.row_index[0];
+	raster = (uint8_t *)malloc(size + 1);
+	fp = fopen(filename, "rb");
+	if (! raster || ! fp || fseek(fp, image.row_index[0], SEEK_SET) != 0 ||
+		fread(raster, size, 1, fp) != 1)
+	{
+		fprintf(stderr, "%s: cannot read raster\n", filename);
+		exit(1);
+	}
+	raster[size] = 0;
+	fclose(fp);
+
+	/* Decode about BENCH_PIXELS pixels whatever the chart size */
+	repeat = BENCH_PIXELS / ((double)image.width * image.height) + 1;
+
+	ref = (uint8_t *)malloc(image.width * image.height);
+	buf = (uint8_t *)malloc(image.width * image.height);
+
+	t = now();
+	for (r = 0; r < repeat; r++)
+		for (y = 0; y < image.height; y++)
+			reference_decode_row(&image, raster + image.row_index[y] - image.row_index[0],
+								 ref + y * image.width);
+	t_ref = now() - t;
+
+	bsb_context_init(&ctx);
+	t = now();
+	for (r = 0; r < repeat; r++)
+		for (y = 0; y < image.height; y++)
+			bsb_read_row_part_r(&image, &ctx, y, buf + y * image.width, 0, image.width);
+	t_lib = now() - t;
+	bsb_context_free(&ctx);
+
+	printf("%s: %dx%d depth %d, %d bytes compressed\n", filename, image.width, image.height,
+		   image.depth, size);
+	printf("  memset per run  %8.3f ms/image\n", t_ref * 1000 / repeat);
+	printf("  libbsb          %8.3f ms/image  (%.2fx)%s\n", t_lib * 1000 / repeat, t_ref / t_lib,
+		   memcmp(ref, buf, image.width * image.height) ? "  OUTPUT DIFFERS" : "");
+
+	free(buf);
+	free(ref);
+	free(raster);
+	bsb_close(&image);
+	return 1;
+}
+
+static int write_synthetic_header(const char *filename)
+{
+	FILE		*out;
+	int			i;
+	unsigned	seed = 1;
+
+	out = fopen(filename, "wb");
+	if (! out)
+	{
+		perror(filename);
+		return 0;
+	}
+	fprintf(out, "VER/3.0\r\nCED/SE=70,RE=01,ED=09/30/1999\r\n");
+	fprintf(out, "BSB/NA=SYNTHETIC HEADER,NU=1,RA=12000,9000,DU=254\r\n");
+	fprintf(out, "KNP/SC=20000,GD=NAD83,PR=MERCATOR,PP=37.5,PI=UNKNOWN,SP=UNKNOWN,SK=0.0\r\n");
+	fprintf(out, "    TA=90.0,UN=METERS,SD=MLLW,DX=5.08,DY=5.08\r\n");
+	fprintf(out, "IFM/7\r\n");
+	for (i = 1; i < 128; i++)
+		fprintf(out, "RGB/%d,%d,%d,%d\r\n", i, i * 2, 255 - i * 2, i);
+	for (i = 1; i <= SYNTH_REFS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		fprintf(out, "REF/%d,%u,%u,%.10f,%.10f\r\n", i, seed % 12000, (seed >> 8) % 9000,
+				37.0 + (seed % 100000) * 1e-6, -122.0 - (seed >> 12) % 100000 * 1e-6);
+	}
+	for (i = 1; i <= SYNTH_PLYS; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		fprintf(out, "PLY/%d,%.10f,%.10f\r\n", i,
+				37.0 + (seed % 100000) * 1e-6, -122.0 - (seed >> 12) % 100000 * 1e-6);
+	}
+	fprintf(out, "WPX/2,863264.4957,11420.23919,-96.44623341,-0.02696969,0.1242506,0.00000001\r\n");
+	fprintf(out, "WPY/2,-1506.59127,101.4101401,11436.0,-0.0001,0.11,0.2\r\n");
+	fputc(0x1a, out);
+	fputc('\0', out);
+	fputc(7, out);
+	fclose(out);
+	return 1;
+}
+
+static int bench_header(char *filename)
+{
+	BSBImage	image;
+	int			n = 0, refs, plys, colors;
+	double		t, elapsed;
+
+	if (! bsb_open_header_only(filename, &image))
+		return 0;
+	refs = image.num_refs;
+	plys = image.num_plys;
+	colors = image.num_colors;
+	bsb_close(&image);
+
+	t = now();
+	do
+	{
+		bsb_open_header_only(filename, &image);
+		bsb_close(&image);
+		n++;
+	} while ((elapsed = now() - t) < BENCH_SECONDS);
+
+	printf("%s: %d REF, %d PLY, %d colors\n", filename, refs, plys, colors);
+	printf("  header only open %8.2f us\n", elapsed * 1e6 / n);
+	return 1;
+}
+
+/* Drops a file from the page cache, so that it is read from disk again */
+static void drop_cached(const char *filename)
+{
+	int		fd = open(filename, O_RDONLY);
+
+	if (fd != -1)
+	{
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+/* Average time of bsb_open_header(), cold: with the chart and its cache dropped from the page cache */
+static double time_open(char *filename, const char *cache, int cold)
+{
+	BSBImage	image;
+	int			n = 0;
+	double		t, start = now(), total = 0;
+
+	do
+	{
+		if (cold)
+		{
+			drop_cached(filename);
+			drop_cached(cache);
+		}
+		t = now();
+		bsb_open_header(filename, &image);
+		total += now() - t;
+		bsb_close(&image);
+		n++;
+	} while (now() - start < BENCH_SECONDS);
+	return total / n;
+}
+
+static int bench_open(char *filename)
+{
+	BSBImage	image;
+	char		cache[1024];
+	double		t_plain, t_cached, t_plain_cold, t_cached_cold;
+
+	snprintf(cache, sizeof(cache), "%s.bsbidx", filename);
+	remove(cache);
+	t_plain = time_open(filename, cache, 0);
+	t_plain_cold = time_open(filename, cache, 1);
+
+	if (! bsb_open_header(filename, &image))
+		return 0;
+	if (! bsb_write_index_cache(&image, filename))
+	{
+		fprintf(stderr, "%s: cannot write index cache\n", filename);
+		bsb_close(&image);
+		return 0;
+	}
+	bsb_close(&image);
+	t_cached = time_open(filename, cache, 0);
+	t_cached_cold = time_open(filename, cache, 1);
+	remove(cache);
+
+	printf("%s: %d rows\n", filename, image.height);
+	printf("  open            %8.2f us  cold %8.2f us\n", t_plain * 1e6, t_plain_cold * 1e6);
+	printf("  open with cache %8.2f us  cold %8.2f us  (%.1fx, cold %.1fx)\n",
+		t_cached * 1e6, t_cached_cold * 1e6, t_plain / t_cached, t_plain_cold / t_cached_cold);
+	return 1;
+}
+
+extern int main (int argc, char *argv[])
+{
+	char	synth[] = "bsbbench_synth.kap";
+	int		i;
+
+	if (argc < 2 || (strcmp(argv[1], "rows") != 0 && strcmp(argv[1], "header") != 0 &&
+					 strcmp(argv[1], "open") != 0))
+	{
+		fprintf(stderr, "Usage:\n\tbsbbench rows|header|open [input.kap ...]\n");
+		exit(1);
+	}
+
+	if (strcmp(argv[1], "header") == 0)
+	{
+		for (i = 2; i < argc; i++)
+			bench_header(argv[i]);
+
+		if (! write_synthetic_header(synth))
+			exit(1);
+		bench_header(synth);
+		remove(synth);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "open") == 0)
+	{
+		for (i = 2; i < argc; i++)
+			bench_open(argv[i]);
+
+		if (! write_synthetic(synth))
+			exit(1);
+		bench_open(synth);
+		remove(synth);
+		return 0;
+	}
+
+	for (i = 2; i < argc; i++)
+		bench_rows(argv[i]);
+
+	if (! write_synthetic(synth))
+		exit(1);
+	bench_rows(synth);
+	remove(synth);
+
+	return 0;
+}
@@ -88,6 +88,8 @@ extern int main (int argc, char *argv[])
         fprintf(stderr, "Failed to open %s\n", argv[arg_idx] );
 		exit(1);
     }
+	/* all rows are read once in order */
+	bsb_set_access_pattern(&image, BSB_ACCESS_SEQUENTIAL, 0);
 
 	buf = (uint8_t *)malloc(image.width);
 	if (! buf)
@@ -0,0 +1,1813 @@
+/*
+ *  bsbtest.c - Checks of the libbsb reading API for the test suite.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+
+/*
+ * Every check compares one way of reading a chart with the plain
+ * bsb_read_row_part() of the whole rows (or with a brute force version of
+ * the computation), prints what differs and exits with 1 on a mismatch,
+ * 77 (skipped) when the check does not apply on this platform.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <math.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#include <bsb.h>
+
+/* threads decoding one chart at the same time */
+#define THREADS			4
+/* size of the synthetic charts */
+#define SYNTH_WIDTH		700
+#define SYNTH_HEIGHT	500
+/* Web Mercator (EPSG:3857) */
+#define MERCATOR_RADIUS	6378137.0
+#define DEGREES			(180.0 / 3.14159265358979323846)
+
+static int failures = 0;
+
+static void fail(const char *what, int row, int x)
+{
+	if (failures++ < 10)
+		fprintf(stderr, "%s differs at row %d, x %d\n", what, row, x);
+}
+
+/* Reads a whole file into memory */
+static uint8_t *load_file(const char *filename, size_t *size)
+{
+	FILE	*fp = fopen(filename, "rb");
+	uint8_t	*data = 0;
+	long	n;
+
+	if (! fp)
+	{
+		perror(filename);
+		return 0;
+	}
+	if (fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) > 0 &&
+		fseek(fp, 0, SEEK_SET) == 0 && (data = (uint8_t *)malloc(n)) != 0 &&
+		fread(data, n, 1, fp) != 1)
+	{
+		free(data);
+		data = 0;
+	}
+	fclose(fp);
+	*size = data ? (size_t)n : 0;
+	return data;
+}
+
+static int save_file(const char *filename, const uint8_t *data, size_t size)
+{
+	FILE	*fp = fopen(filename, "wb");
+	int		ok;
+
+	if (! fp)
+	{
+		perror(filename);
+		return 0;
+	}
+	ok = fwrite(data, size, 1, fp) == 1;
+	return fclose(fp) == 0 && ok;
+}
+
+/* Decodes the whole chart row by row with bsb_read_row_part() */
+static uint8_t *read_reference(BSBImage *image)
+{
+	uint8_t	*pixels = (uint8_t *)malloc((size_t)image->width * image->height);
+	int		y;
+
+	if (! pixels)
+		return 0;
+	for (y = 0; y < image->height; y++)
+	{
+		if (! bsb_read_row_part(image, y, pixels + (size_t)y * image->width, 0, image->width))
+		{
+			fprintf(stderr, "cannot read row %d\n", y);
+			free(pixels);
+			return 0;
+		}
+	}
+	return pixels;
+}
+
+/* Pixel x of a reference row, repeating the last pixel past the width */
+static uint8_t ref_pixel(const BSBImage *image, const uint8_t *ref, int y, int x)
+{
+	return ref[(size_t)y * image->width + (x < image->width ? x : image->width - 1)];
+}
+
+/* Compares every row of a chart with the reference pixels */
+static void compare_rows(const char *what, BSBImage *image, const uint8_t *ref)
+{
+	uint8_t	*row = (uint8_t *)malloc(image->width);
+	int		x, y;
+
+	for (y = 0; row && y < image->height; y++)
+	{
+		if (! bsb_read_row_part(image, y, row, 0, image->width))
+		{
+			fail(what, y, -1);
+			continue;
+		}
+		for (x = 0; x < image->width; x++)
+			if (row[x] != ref_pixel(image, ref, y, x))
+			{
+				fail(what, y, x);
+				break;
+			}
+	}
+	free(row);
+}
+
+/* The chart opened with a mapping, read by position and sequentially */
+static void check_mmap(const char *filename, const uint8_t *ref)
+{
+	BSBImage	image;
+	uint8_t		*row;
+	int			x, y;
+
+	if (! bsb_open_header_mmap((char *)filename, &image))
+	{
+		fail("bsb_open_header_mmap", -1, -1);
+		return;
+	}
+	compare_rows("bsb_open_header_mmap", &image, ref);
+
+	row = (uint8_t *)malloc(image.width);
+	if (! row || ! bsb_seek_to_row(&image, 0))
+		fail("bsb_seek_to_row", 0, -1);
+	for (y = 0; row && y < image.height; y++)
+	{
+		if (! bsb_read_row(&image, row))
+		{
+			fail("bsb_read_row", y, -1);
+			break;
+		}
+		for (x = 0; x < image.width; x++)
+			if (row[x] != ref_pixel(&image, ref, y, x))
+			{
+				fail("bsb_read_row", y, x);
+				break;
+			}
+	}
+	free(row);
+	bsb_close(&image);
+}
+
+#ifndef _WIN32
+typedef struct
+{
+	const BSBImage	*image;
+	const uint8_t	*ref;
+	int				first;
+	int				bad;
+} ThreadJob;
+
+/* Reads all rows of the chart, starting at a different row in every thread */
+static void *thread_rows(void *arg)
+{
+	ThreadJob			*job = (ThreadJob *)arg;
+	const BSBImage		*image = job->image;
+	BSBDecodeContext	ctx;
+	uint8_t				*row = (uint8_t *)malloc(image->width);
+	int					i, x, y, xoffset, len;
+
+	bsb_context_init(&ctx);
+	for (i = 0; row && i < image->height; i++)
+	{
+		/* whole rows and parts of rows */
+		y = (job->first + i) % image->height;
+		xoffset = (i % 3) * (y % 97);
+		len = image->width - xoffset;
+		if (! bsb_read_row_part_r(image, &ctx, y, row, xoffset, len))
+		{
+			job->bad++;
+			continue;
+		}
+		for (x = 0; x < len; x++)
+			if (row[x] != job->ref[(size_t)y * image->width + xoffset + x])
+			{
+				job->bad++;
+				break;
+			}
+	}
+	bsb_context_free(&ctx);
+	free(row);
+	job->bad += ! row;
+	return 0;
+}
+
+static void threads_on(const char *what, const BSBImage *image, const uint8_t *ref)
+{
+	pthread_t	threads[THREADS];
+	ThreadJob	jobs[THREADS];
+	int			i, started[THREADS];
+
+	for (i = 0; i < THREADS; i++)
+	{
+		jobs[i].image = image;
+		jobs[i].ref = ref;
+		jobs[i].first = i * image->height / THREADS;
+		jobs[i].bad = 0;
+		started[i] = pthread_create(&threads[i], NULL, thread_rows, &jobs[i]) == 0;
+		if (! started[i])
+			thread_rows(&jobs[i]);
+	}
+	for (i = 0; i < THREADS; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		if (jobs[i].bad)
+			fail(what, -1, i);
+	}
+}
+#endif
+
+/*
+ * Several threads decoding the same chart (opened with a FILE* and
+ * mapped), each with its own decode context.
+ */
+static int check_threads(const char *filename, const BSBImage *image, const uint8_t *ref)
+{
+#ifdef _WIN32
+	(void)filename;
+	(void)image;
+	(void)ref;
+	return 77;
+#else
+	BSBImage	mapped;
+
+	threads_on("bsb_read_row_part_r", image, ref);
+	if (! bsb_open_header_mmap((char *)filename, &mapped))
+		fail("bsb_open_header_mmap", -1, -1);
+	else
+	{
+		threads_on("bsb_read_row_part_r of a mapped chart", &mapped, ref);
+		bsb_close(&mapped);
+	}
+	return failures != 0;
+#endif
+}
+
+/* Whole chart and row ranges read with several threads */
+static void check_image(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, H = image->height, stride = W + 13;
+	int		nthreads, first, nrows, y;
+	uint8_t	*buf = (uint8_t *)malloc((size_t)stride * H);
+
+	for (nthreads = 0; buf && nthreads <= 3; nthreads++)
+	{
+		/* all rows, then a range in the middle */
+		for (first = 0; first < H; first += H / 3 + 1)
+		{
+			nrows = first ? H / 3 : H;
+			if (first + nrows > H)
+				nrows = H - first;
+			memset(buf, 0xee, (size_t)stride * H);
+			if (! bsb_read_image(image, buf, stride, first, nrows, nthreads))
+			{
+				fail("bsb_read_image", first, -1);
+				continue;
+			}
+			for (y = 0; y < nrows; y++)
+				if (memcmp(buf + (size_t)y * stride, ref + (size_t)(first + y) * W, W) != 0 ||
+					buf[(size_t)y * stride + W] != 0xee)
+				{
+					fail("bsb_read_image", first + y, nthreads);
+					break;
+				}
+		}
+	}
+	/* rows past the end of the chart */
+	if (buf && bsb_read_image(image, buf, stride, H - 1, 2, 2))
+		fail("bsb_read_image past the end", H, -1);
+	free(buf);
+}
+
+/* Run lists of rows and parts of rows, expanded again */
+static void check_runs(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, x, y, i, k, n, len;
+	BSBRun	*runs = (BSBRun *)malloc((W + 64) * sizeof(BSBRun));
+
+	for (y = 0; runs && y < image->height; y++)
+	{
+		/* from an offset to past the end of the row */
+		x = (y * 7) % W;
+		len = W - x + 5;
+		n = bsb_read_row_runs(image, y, runs, W + 64, x, len);
+		for (i = 0, k = x; i < n; i++)
+		{
+			int	end = k + runs[i].len;
+			for (; k < end; k++)
+				if (runs[i].color != ref_pixel(image, ref, y, k))
+					break;
+			if (k < end)
+				break;
+			/* adjacent runs are merged */
+			if (i > 0 && runs[i].color == runs[i - 1].color)
+				break;
+		}
+		if (! n || i < n || k != x + len)
+			fail("bsb_read_row_runs", y, k);
+		/* too small a run list */
+		if (n > 1 && bsb_read_row_runs(image, y, runs, n - 1, x, len))
+			fail("bsb_read_row_runs with too few runs", y, x);
+	}
+	free(runs);
+}
+
+/* A palette index converted to an output format by hand */
+static int format_pixel(const BSBImage *image, int c, BSBPixelFormat fmt, uint8_t *out)
+{
+	uint8_t		r = image->red[c], g = image->green[c], b = image->blue[c];
+	uint32_t	argb = 0xff000000u | (uint32_t)r << 16 | (uint32_t)g << 8 | b;
+	uint16_t	rgb565 = (uint16_t)((r >> 3) << 11 | (g >> 2) << 5 | b >> 3);
+
+	switch (fmt)
+	{
+	case BSB_PIXEL_INDEX:
+		out[0] = (uint8_t)c;
+		return 1;
+	case BSB_PIXEL_RGB24:
+		out[0] = r;
+		out[1] = g;
+		out[2] = b;
+		return 3;
+	case BSB_PIXEL_RGBA32:
+		out[0] = r;
+		out[1] = g;
+		out[2] = b;
+		out[3] = 0xff;
+		return 4;
+	case BSB_PIXEL_BGRA32:
+		out[0] = b;
+		out[1] = g;
+		out[2] = r;
+		out[3] = 0xff;
+		return 4;
+	case BSB_PIXEL_ARGB32:
+		memcpy(out, &argb, 4);
+		return 4;
+	case BSB_PIXEL_RGB565:
+		memcpy(out, &rgb565, 2);
+		return 2;
+	}
+	return 0;
+}
+
+/*
+ * Rows, parts of rows and the whole chart read in every output format
+ * compared with a palette lookup of the indices.
+ */
+static void check_rgb(BSBImage *image, const uint8_t *ref)
+{
+	static const BSBPixelFormat	formats[] = { BSB_PIXEL_INDEX, BSB_PIXEL_RGB24, BSB_PIXEL_RGBA32,
+											  BSB_PIXEL_BGRA32, BSB_PIXEL_ARGB32, BSB_PIXEL_RGB565 };
+	int			W = image->width, H = image->height, f, bpp, x, y, i, len;
+	uint8_t		expect[4], *buf = (uint8_t *)malloc((size_t)W * H * 4 + 16);
+
+	for (f = 0; buf && f < (int)(sizeof(formats) / sizeof(formats[0])); f++)
+	{
+		bpp = bsb_pixel_size(formats[f]);
+		if (bpp != format_pixel(image, 0, formats[f], expect))
+			fail("bsb_pixel_size", -1, f);
+
+		/* parts of rows from different offsets, to the end or half way */
+		for (y = 0; y < H; y++)
+		{
+			x = (y * 13) % W;
+			len = y % 2 ? W - x : (W - x) / 2 + 1;
+			memset(buf, 0xee, (size_t)(len + 4) * bpp);
+			if (! bsb_read_row_rgb(image, y, buf, x, len, formats[f]))
+			{
+				fail("bsb_read_row_rgb", y, f);
+				continue;
+			}
+			for (i = 0; i < len; i++)
+			{
+				format_pixel(image, ref_pixel(image, ref, y, x + i), formats[f], expect);
+				if (memcmp(buf + i * bpp, expect, bpp) != 0)
+				{
+					fail("bsb_read_row_rgb", y, x + i);
+					break;
+				}
+			}
+			/* nothing written after the row */
+			for (i = len * bpp; i < (len + 4) * bpp; i++)
+				if (buf[i] != 0xee)
+				{
+					fail("bsb_read_row_rgb after the row", y, f);
+					break;
+				}
+		}
+
+		if (! bsb_read_image_rgb(image, buf, 0, 0, H, 2, formats[f]))
+		{
+			fail("bsb_read_image_rgb", -1, f);
+			continue;
+		}
+		for (i = 0; i < W * H; i++)
+		{
+			format_pixel(image, ref[i], formats[f], expect);
+			if (memcmp(buf + (size_t)i * bpp, expect, bpp) != 0)
+			{
+				fail("bsb_read_image_rgb", i / W, i % W);
+				break;
+			}
+		}
+	}
+	free(buf);
+}
+
+/* Parts of rows from many offsets, some reaching past the end */
+static void check_part(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, x, y, i, len;
+	uint8_t	*buf = (uint8_t *)malloc(W + 64);
+
+	for (y = 0; buf && y < image->height; y++)
+		for (x = y % 17; x < W; x += W / 7 + y % 5)
+		{
+			len = 1 + (x * 31 + y) % (W - x + 40);
+			if (! bsb_read_row_part(image, y, buf, x, len))
+			{
+				fail("bsb_read_row_part", y, x);
+				continue;
+			}
+			for (i = 0; i < len; i++)
+				if (buf[i] != ref_pixel(image, ref, y, x + i))
+				{
+					fail("bsb_read_row_part", y, x + i);
+					break;
+				}
+		}
+	free(buf);
+}
+
+/* Every step-th pixel of rows, also past the end of the row */
+static void check_decimated(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, x, y, i, step, len;
+	uint8_t	*buf = (uint8_t *)malloc(W + 64);
+
+	for (y = 0; buf && y < image->height; y++)
+	{
+		x = (y * 7) % W;
+		for (step = 1; step <= 9; step += 4)
+		{
+			len = (W - x) / step + 3;
+			if (! bsb_read_row_decimated(image, y, buf, x, len, step))
+			{
+				fail("bsb_read_row_decimated", y, x);
+				continue;
+			}
+			for (i = 0; i < len; i++)
+				if (buf[i] != ref_pixel(image, ref, y, x + i * step))
+				{
+					fail("bsb_read_row_decimated", y, x + i * step);
+					break;
+				}
+		}
+	}
+	free(buf);
+}
+
+/*
+ * Overviews inside the chart and across its lower right corner: box
+ * averages and most frequent colors (lowest index on a tie) of k x k
+ * pixels, 0 for boxes off the chart.
+ */
+static void check_overview(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, H = image->height, w = 40, h = 30;
+	int		area, ox, oy, k, i, c, xx, yy;
+	uint8_t	*rgb = (uint8_t *)malloc(w * h * 3), *idx = (uint8_t *)malloc(w * h);
+
+	for (area = 0; rgb && idx && area < 2; area++)
+		for (k = 1; k <= 7; k += 3)
+		{
+			ox = area ? W - w * k / 2 : W / 3;
+			oy = area ? H - h * k / 2 : H / 4;
+			if (! bsb_read_overview(image, ox, oy, w, h, k, rgb, 0, 2, BSB_PIXEL_RGB24) ||
+				! bsb_read_overview(image, ox, oy, w, h, k, idx, 0, area, BSB_PIXEL_INDEX))
+			{
+				fail("bsb_read_overview", oy, ox);
+				continue;
+			}
+			for (i = 0; i < w * h; i++)
+			{
+				unsigned	count[256], sum[3] = { 0, 0, 0 }, total = 0;
+				int			best = 0;
+				uint8_t		expect[3] = { 0, 0, 0 };
+
+				memset(count, 0, sizeof(count));
+				for (yy = oy + i / w * k; yy < oy + i / w * k + k && yy < H; yy++)
+					for (xx = ox + i % w * k; xx < ox + i % w * k + k && xx < W; xx++)
+					{
+						c = ref[(size_t)yy * W + xx];
+						count[c]++;
+						sum[0] += image->red[c];
+						sum[1] += image->green[c];
+						sum[2] += image->blue[c];
+						total++;
+					}
+				for (c = 1; c < 256; c++)
+					if (count[c] > count[best])
+						best = c;
+				for (c = 0; total && c < 3; c++)
+					expect[c] = (sum[c] + total / 2) / total;
+				if (memcmp(rgb + i * 3, expect, 3) != 0 || idx[i] != (total ? best : 0))
+				{
+					fail("bsb_read_overview", oy + i / w * k, ox + i % w * k);
+					break;
+				}
+			}
+		}
+	free(idx);
+	free(rgb);
+}
+
+/* Windows all over the chart, also sticking out to the right and below */
+static void check_window(BSBImage *image, const uint8_t *ref)
+{
+	int		W = image->width, H = image->height, x, y, w, h, i, yy, xx, row, col;
+	uint8_t	*buf = (uint8_t *)malloc((size_t)(W + 64) * 48);
+
+	for (row = 0; buf && row < 6; row++)
+		for (col = 0; col < 6; col++)
+		{
+			/* the last row and column of them run off the chart */
+			y = row < 5 ? row * (H / 5 + 1) : H - 10;
+			x = col < 5 ? col * (W / 5 + 1) : W - 20;
+			w = 33 + x % 29;
+			h = 17 + y % 13;
+			if (! bsb_read_window(image, x, y, w, h, w + 3, buf))
+			{
+				fail("bsb_read_window", y, x);
+				continue;
+			}
+			for (i = 0; i < w * h; i++)
+			{
+				yy = y + i / w;
+				xx = x + i % w;
+				if (buf[(i / w) * (w + 3) + i % w] != (yy < H ? ref_pixel(image, ref, yy, xx) : 0))
+				{
+					fail("bsb_read_window", yy, xx);
+					break;
+				}
+			}
+		}
+	free(buf);
+}
+
+/* Whether the header fields of two opened charts are the same */
+static int same_header(const BSBImage *a, const BSBImage *b)
+{
+	int	i;
+
+	for (i = 0; i < a->num_refs && i < b->num_refs; i++)
+		if (a->ref[i].id != b->ref[i].id || a->ref[i].x != b->ref[i].x || a->ref[i].y != b->ref[i].y ||
+			a->ref[i].lat != b->ref[i].lat || a->ref[i].lon != b->ref[i].lon)
+			return 0;
+	for (i = 0; i < a->num_plys && i < b->num_plys; i++)
+		if (a->ply[i].id != b->ply[i].id || a->ply[i].lat != b->ply[i].lat ||
+			a->ply[i].lon != b->ply[i].lon)
+			return 0;
+	return a->width == b->width && a->height == b->height && a->depth == b->depth &&
+		   a->num_colors == b->num_colors && memcmp(a->red, b->red, sizeof(a->red)) == 0 &&
+		   memcmp(a->green, b->green, sizeof(a->green)) == 0 &&
+		   memcmp(a->blue, b->blue, sizeof(a->blue)) == 0 &&
+		   strcmp(a->name, b->name) == 0 && strcmp(a->projection, b->projection) == 0 &&
+		   strcmp(a->datum, b->datum) == 0 && a->version == b->version &&
+		   a->xresolution == b->xresolution && a->yresolution == b->yresolution &&
+		   a->scale == b->scale && a->projectionparam == b->projectionparam &&
+		   a->cph == b->cph && a->num_refs == b->num_refs && a->num_plys == b->num_plys &&
+		   a->num_wpxs == b->num_wpxs && a->num_wpys == b->num_wpys &&
+		   a->num_pwxs == b->num_pwxs && a->num_pwys == b->num_pwys &&
+		   memcmp(a->wpx, b->wpx, BSB_MAX_AFTS * sizeof(double)) == 0 &&
+		   memcmp(a->wpy, b->wpy, BSB_MAX_AFTS * sizeof(double)) == 0 &&
+		   memcmp(a->pwx, b->pwx, BSB_MAX_AFTS * sizeof(double)) == 0 &&
+		   memcmp(a->pwy, b->pwy, BSB_MAX_AFTS * sizeof(double)) == 0;
+}
+
+/* Metadata of a header-only open, then the rows once the raster is attached */
+static void check_header_only(const char *filename, const BSBImage *image, const uint8_t *ref)
+{
+	BSBImage	other;
+
+	if (! bsb_open_header_only((char *)filename, &other))
+	{
+		fail("bsb_open_header_only", -1, -1);
+		return;
+	}
+	if (! same_header(&other, image))
+		fail("header of bsb_open_header_only", -1, -1);
+	/* attaching twice does nothing the second time */
+	if (! bsb_attach_raster(&other) || ! bsb_attach_raster(&other))
+		fail("bsb_attach_raster", -1, -1);
+	else
+		compare_rows("bsb_attach_raster", &other, ref);
+	bsb_close(&other);
+}
+
+/*
+ * Writes a 700x500 chart with a 127 color palette, WPX/WPY and PWX/PWY
+ * polynomials, REF and PLY points, a continued KNP/ line and a few
+ * numbers with exponents or too many digits for an exact conversion.
+ * With cph the chart crosses the 180 meridian (CPH/180).  The polynomials
+ * have 6 and 12 terms, 10 and 3 with cph, one of each evaluator.
+ */
+static int write_synthetic(const char *filename, int cph)
+{
+	BSBImage	image;
+	FILE		*out;
+	uint8_t		*row, *scratch;
+	int			*index, x, y, i;
+	unsigned	seed = 1;
+
+	out = fopen(filename, "wb");
+	if (! out)
+	{
+		perror(filename);
+		return 0;
+	}
+	memset(&image, 0, sizeof(image));
+	image.width = SYNTH_WIDTH;
+	image.height = SYNTH_HEIGHT;
+	image.depth = 7;
+
+	fprintf(out, "VER/3.0\r\n");
+	fprintf(out, "BSB/NA=SYNTHETIC,NU=0,RA=%d,%d,DU=254\r\n", image.width, image.height);
+	fprintf(out, "KNP/SC=25000,GD=WGS84,PR=MERCATOR,PP=%s,PI=UNKNOWN,SP=UNKNOWN,SK=0.0\r\n",
+		cph ? "0.0" : "37.015");
+	fprintf(out, "    TA=90.0,UN=METRES,SD=MLLW,DX=2.54,DY=2.54e0\r\n");
+	fprintf(out, "IFM/%d\r\n", image.depth);
+	if (cph)
+	{
+		/* lon 179.95 to -179.95, lat 0.03 to -0.03 */
+		fprintf(out, "CPH/180\r\n");
+		fprintf(out, "REF/1,0,0,0.03,179.95\r\nREF/2,699,499,-0.0298800000000000000001,-179.9501428571\r\n");
+		fprintf(out, "WPX/2,350,7000,0\r\nWPY/3,250,0,-8333.3333,0,0,15,0,0,0,2\r\n");
+		fprintf(out, "PWX/2,-0.05,1.4285714285714285E-4,0,\r\n  0,0,0\r\n");
+		fprintf(out, "PWY/2,0.03,0,-1.2e-4,0,0,0\r\n");
+		fprintf(out, "PLY/1,-0.03,179.95\r\nPLY/2,0.03,179.95\r\nPLY/3,0.031,-179.97\r\n");
+		fprintf(out, "PLY/4,0.0,-179.95\r\nPLY/5,-0.03,-179.95\r\n");
+		fprintf(out, "DTM/0.0,0.0\r\n");
+	}
+	else
+	{
+		/* lon -122.5 to -122.45, lat 37.03 to 37.0 */
+		fprintf(out, "REF/1,0,0,37.03,-122.5\r\nREF/2,699,499,37.00006,-122.45007142857142857142857\r\n");
+		fprintf(out, "WPX/2,1715000,14000,0\r\nWPY/2,616666.667,0,-16666.6667,0,0,3\r\n");
+		fprintf(out, "PWX/2,-122.5,7.142857142857143e-05,0,\r\n  2e-9,0,0\r\n");
+		fprintf(out, "PWY/3,37.03,0,-6E-05,0,0,1.5e-12,0,0,0,0,0,1e-30\r\n");
+		fprintf(out, "PLY/1,37.0,-122.5\r\nPLY/2,37.03,-122.5\r\nPLY/3,37.02,-122.47\r\n");
+		fprintf(out, "PLY/4,37.03,-122.45\r\nPLY/5,37.0,-122.45\r\n");
+		fprintf(out, "DTM/-0.01,.005\r\n");
+	}
+	for (i = 1; i < 128; i++)
+		fprintf(out, "RGB/%d,%d,%d,%d\r\n", i, i * 2, 255 - i * 2, (i * 37) & 255);
+	fputc(0x1a, out);
+	fputc('\0', out);
+	fputc(image.depth, out);
+
+	row = (uint8_t *)malloc(image.width);
+	scratch = (uint8_t *)malloc(image.width * 2 + 8);
+	index = (int *)malloc((image.height + 1) * sizeof(int));
+	for (y = 0; y < image.height; y++)
+	{
+		for (x = 0; x < image.width; x++)
+		{
+			seed = seed * 1103515245 + 12345;
+			row[x] = (x / 5 + y / 3 + ((seed >> 16) % 3 == 0)) % 126 + 1;
+		}
+		index[y] = ftell(out);
+		fwrite(scratch, bsb_compress_row(&image, y, row, scratch), 1, out);
+	}
+	index[image.height] = ftell(out);
+	bsb_write_index(out, image.height, index);
+
+	free(index);
+	free(scratch);
+	free(row);
+	return fclose(out) == 0;
+}
+
+/* Header values as the sscanf() parser of libbsb up to 0.0.7 read them */
+typedef struct
+{
+	int		width, height, depth, num_colors;
+	uint8_t	red[256], green[256], blue[256];
+	char	name[200], projection[50], datum[50];
+	float	version;
+	double	xresolution, yresolution, scale, projectionparam, cph;
+	struct REF	ref[BSB_MAX_REFS];
+	int		num_refs;
+	struct PLY	ply[BSB_MAX_PLYS];
+	int		num_plys;
+	/* wpx, wpy, pwx, pwy */
+	double	poly[4][BSB_MAX_AFTS];
+	int		num_poly[4], level[4];
+} OldHeader;
+
+/* next_line() of the old parser: drops \r, glues continuation lines with ',' */
+static int old_next_line(const char **pp, char *line, int len)
+{
+	const char	*p = *pp;
+	char		*q = line;
+
+	while (*p)
+	{
+		if (q - line >= len - 2)
+			return 0;
+		if (*p == '\r')
+		{
+			p++;
+			continue;
+		}
+		if (*p == '\n')
+		{
+			p++;
+			if (*p != ' ')
+			{
+				*q = '\0';
+				*pp = p;
+				return 1;
+			}
+			while (*p == ' ')
+				p++;
+			if (q > line && q[-1] != ',')
+				*q++ = ',';
+		}
+		*q++ = *p++;
+	}
+	return 0;
+}
+
+static void old_string(const char *from, char *to, unsigned max)
+{
+	unsigned	i;
+
+	for (i = 0; from[i] && from[i] != ',' && i < max - 1; i++)
+		to[i] = from[i];
+	to[i] = '\0';
+}
+
+static int old_numbers(const char *pc, double list[], int count)
+{
+	int		i = 0;
+
+	while (*pc && i < count)
+	{
+		while (*pc && *pc != ',')
+			pc++;
+		if (*pc && *++pc)
+			sscanf(pc, "%lf", &list[i++]);
+	}
+	return i;
+}
+
+/* Parses the text header of filename like the old parser, in the "C" locale */
+static int old_parse(const char *filename, OldHeader *h)
+{
+	static const char	*poly_tags[4] = { "WPX/%d,", "WPY/%d,", "PWX/%d,", "PWY/%d," };
+	char		*text, line[1024], *s;
+	const char	*pt;
+	FILE		*in;
+	long		n = 0;
+	int			c, i, idx, r, g, b;
+
+	memset(h, 0, sizeof(*h));
+	if (! (in = fopen(filename, "rb")) || ! (text = (char *)malloc(1 << 16)))
+		return 0;
+	while ((c = fgetc(in)) != EOF && c != 0x1a && n < (1 << 16) - 1)
+		text[n++] = c;
+	text[n] = '\0';
+	fclose(in);
+
+	h->version = -1;
+	for (pt = text; old_next_line(&pt, line, sizeof(line)); )
+	{
+		if (sscanf(line, "RGB/%d,%d,%d,%d", &idx, &r, &g, &b) == 4 && idx > 0 && idx < 256)
+		{
+			h->red[idx - 1] = r;
+			h->green[idx - 1] = g;
+			h->blue[idx - 1] = b;
+			h->num_colors++;
+		}
+		if (h->num_refs < BSB_MAX_REFS && sscanf(line, "REF/%d,%d,%d,%lf,%lf",
+				&h->ref[h->num_refs].id, &h->ref[h->num_refs].x, &h->ref[h->num_refs].y,
+				&h->ref[h->num_refs].lat, &h->ref[h->num_refs].lon) == 5)
+			h->num_refs++;
+		if (h->num_plys < BSB_MAX_PLYS && sscanf(line, "PLY/%d,%lf,%lf",
+				&h->ply[h->num_plys].id, &h->ply[h->num_plys].lat, &h->ply[h->num_plys].lon) == 3)
+			h->num_plys++;
+		for (i = 0; i < 4; i++)
+			if (sscanf(line, poly_tags[i], &h->level[i]) == 1)
+				h->num_poly[i] = old_numbers(line, h->poly[i], BSB_MAX_AFTS);
+		if ((s = strstr(line, "NA=")))
+			old_string(s + 3, h->name, sizeof(h->name));
+		if (strncmp(line, "KNP/", 4) == 0)
+		{
+			if ((s = strstr(line, "PR=")))
+				old_string(s + 3, h->projection, sizeof(h->projection));
+			if ((s = strstr(line, "GD=")))
+				old_string(s + 3, h->datum, sizeof(h->datum));
+			if ((s = strstr(line, "SC=")))
+				sscanf(s + 3, "%lf", &h->scale);
+			if ((s = strstr(line, "PP=")))
+				sscanf(s + 3, "%lf", &h->projectionparam);
+		}
+		if ((s = strstr(line, "RA=")) &&
+			sscanf(s, "RA=%d,%d,%d,%d", &idx, &idx, &h->width, &h->height) != 4)
+			sscanf(s, "RA=%d,%d", &h->width, &h->height);
+		if ((s = strstr(line, "DX=")))
+			sscanf(s, "DX=%lf", &h->xresolution);
+		if ((s = strstr(line, "DY=")))
+			sscanf(s, "DY=%lf", &h->yresolution);
+		if (sscanf(line, "IFM/%d", &idx) == 1)
+			h->depth = idx;
+		sscanf(line, "VER/%f", &h->version);
+		sscanf(line, "CPH/%lf", &h->cph);
+	}
+	free(text);
+	return 1;
+}
+
+static void same_poly(const char *what, const double *a, int na, int la,
+	const double *b, int nb, int lb)
+{
+	int		i;
+
+	if (na != nb || la != lb)
+		fail(what, -1, -1);
+	for (i = 0; i < na && i < nb; i++)
+		if (a[i] != b[i])
+			fail(what, -1, i);
+}
+
+/* Every header value read by bsb_open_header() equals the old one exactly */
+static void same_as_old(const char *locale, const char *filename, const OldHeader *h)
+{
+	BSBImage	image;
+	int			i;
+
+	if (! bsb_open_header((char *)filename, &image))
+	{
+		fail(locale, -1, -1);
+		return;
+	}
+	if (image.width != h->width || image.height != h->height || image.depth != h->depth ||
+		image.num_colors != (char)h->num_colors ||
+		memcmp(image.red, h->red, sizeof(h->red)) != 0 ||
+		memcmp(image.green, h->green, sizeof(h->green)) != 0 ||
+		memcmp(image.blue, h->blue, sizeof(h->blue)) != 0)
+		fail("size or palette", -1, -1);
+	if (strcmp(image.name, h->name) != 0 || strcmp(image.projection, h->projection) != 0 ||
+		strcmp(image.datum, h->datum) != 0)
+		fail("NA=, PR= or GD=", -1, -1);
+	if (image.version != h->version || image.xresolution != h->xresolution ||
+		image.yresolution != h->yresolution || image.scale != h->scale ||
+		image.projectionparam != h->projectionparam)
+		fail("VER/, DX=, DY=, SC= or PP=", -1, -1);
+	if (image.cph != h->cph)
+		fail("CPH/", -1, -1);
+	if (image.num_refs != h->num_refs)
+		fail("number of REF/", -1, -1);
+	for (i = 0; i < image.num_refs && i < h->num_refs; i++)
+		if (image.ref[i].id != h->ref[i].id || image.ref[i].x != h->ref[i].x ||
+			image.ref[i].y != h->ref[i].y || image.ref[i].lat != h->ref[i].lat ||
+			image.ref[i].lon != h->ref[i].lon)
+			fail("REF/", i, -1);
+	if (image.num_plys != h->num_plys)
+		fail("number of PLY/", -1, -1);
+	for (i = 0; i < image.num_plys && i < h->num_plys; i++)
+		if (image.ply[i].id != h->ply[i].id || image.ply[i].lat != h->ply[i].lat ||
+			image.ply[i].lon != h->ply[i].lon)
+			fail("PLY/", i, -1);
+	same_poly("WPX/", image.wpx, image.num_wpxs, image.wpx_level,
+		h->poly[0], h->num_poly[0], h->level[0]);
+	same_poly("WPY/", image.wpy, image.num_wpys, image.wpy_level,
+		h->poly[1], h->num_poly[1], h->level[1]);
+	same_poly("PWX/", image.pwx, image.num_pwxs, image.pwx_level,
+		h->poly[2], h->num_poly[2], h->level[2]);
+	same_poly("PWY/", image.pwy, image.num_pwys, image.pwy_level,
+		h->poly[3], h->num_poly[3], h->level[3]);
+	if (failures)
+		fprintf(stderr, "header of %s differs in locale %s\n", filename, locale);
+	bsb_close(&image);
+}
+
+/*
+ * The header parser compared with the sscanf() one it replaced, in the
+ * "C" locale and in the first locale with a decimal comma that is
+ * installed (if any).  DTM/ is read by neither and must not disturb
+ * the other lines.
+ */
+static void check_parser(const char *filename)
+{
+	static const char	*comma_locales[] = {
+		"de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR.utf8", "fr_FR",
+		"German_Germany.1252", 0
+	};
+	OldHeader	*h;
+	int			i;
+
+	h = (OldHeader *)malloc(sizeof(*h));
+	if (! h || ! old_parse(filename, h))
+	{
+		perror(filename);
+		exit(1);
+	}
+	same_as_old("C", filename, h);
+	for (i = 0; comma_locales[i]; i++)
+	{
+		if (setlocale(LC_NUMERIC, comma_locales[i]) &&
+			strcmp(localeconv()->decimal_point, ",") == 0)
+		{
+			same_as_old(comma_locales[i], filename, h);
+			break;
+		}
+	}
+	setlocale(LC_NUMERIC, "C");
+	free(h);
+}
+
+/* BSBIO callbacks on a FILE* */
+static size_t io_read(void *handle, void *buf, size_t size)
+{
+	return fread(buf, 1, size, (FILE *)handle);
+}
+
+static int io_seek(void *handle, long offset, int whence)
+{
+	return fseek((FILE *)handle, offset, whence);
+}
+
+static long io_size(void *handle)
+{
+	long	pos = ftell((FILE *)handle), size;
+
+	fseek((FILE *)handle, 0, SEEK_END);
+	size = ftell((FILE *)handle);
+	fseek((FILE *)handle, pos, SEEK_SET);
+	return size;
+}
+
+static void io_close(void *handle)
+{
+	fclose((FILE *)handle);
+}
+
+/* The chart opened from memory and through user I/O callbacks */
+static void check_open(const char *filename, BSBImage *image, const uint8_t *ref)
+{
+	static const BSBIO	io = { io_read, io_seek, io_size, io_close };
+	BSBImage			other;
+	uint8_t				*data, *pixels;
+	size_t				size;
+	FILE				*fp;
+
+	data = load_file(filename, &size);
+	if (! data || ! bsb_open_mem(data, size, &other))
+		fail("bsb_open_mem", -1, -1);
+	else
+	{
+		compare_rows("bsb_open_mem", &other, ref);
+		bsb_close(&other);
+	}
+	free(data);
+
+	fp = fopen(filename, "rb");
+	if (! fp || ! bsb_open_io(&io, fp, &other))
+	{
+		fail("bsb_open_io", -1, -1);
+		if (fp)
+			fclose(fp);
+		return;
+	}
+	compare_rows("bsb_open_io", &other, ref);
+	/* the bulk reads must not use threads for such charts */
+	pixels = (uint8_t *)malloc((size_t)image->width * image->height);
+	if (! pixels || ! bsb_read_image(&other, pixels, 0, 0, other.height, 4) ||
+		memcmp(pixels, ref, (size_t)image->width * image->height) != 0)
+		fail("bsb_read_image of bsb_open_io", -1, -1);
+	free(pixels);
+	bsb_close(&other);
+}
+
+/* An obfuscated .NO1 copy of the chart (ROT-9 of every byte) */
+static void check_no1(const char *filename, const char *no1, const uint8_t *ref)
+{
+	BSBImage	other;
+	uint8_t		*data;
+	size_t		size, i;
+
+	data = load_file(filename, &size);
+	for (i = 0; data && i < size; i++)
+		data[i] = (uint8_t)(data[i] + 9);
+	if (! data || ! save_file(no1, data, size) || ! bsb_open_header((char *)no1, &other))
+	{
+		fail(".NO1 open", -1, -1);
+		free(data);
+		return;
+	}
+	free(data);
+	compare_rows(".NO1", &other, ref);
+	bsb_close(&other);
+}
+
+/* Offset of the row index table at the end of a chart file */
+static uint32_t index_start(const uint8_t *data, size_t size)
+{
+	return (uint32_t)data[size - 4] << 24 | data[size - 3] << 16 | data[size - 2] << 8 | data[size - 1];
+}
+
+/* Charts with their row index missing or damaged, opened from memory */
+static void check_index(const char *filename, BSBImage *image, const uint8_t *ref)
+{
+	BSBImage	other;
+	uint8_t		*data, *copy;
+	size_t		size;
+	uint32_t	start;
+	int			variant;
+
+	data = load_file(filename, &size);
+	copy = data ? (uint8_t *)malloc(size) : 0;
+	if (! copy)
+	{
+		fail("load", -1, -1);
+		free(data);
+		return;
+	}
+	start = index_start(data, size);
+	for (variant = 0; variant < 3; variant++)
+	{
+		const char	*what;
+		size_t		n = size;
+
+		memcpy(copy, data, size);
+		switch (variant)
+		{
+		case 0:
+			what = "chart without index";
+			n = start;
+			break;
+		case 1:
+			what = "chart with a row offset past the end";
+			memset(copy + start + 4 * (image->height / 2), 0x7f, 4);
+			break;
+		default:
+			what = "chart with a bad index start";
+			memset(copy + size - 4, 0x01, 4);
+			break;
+		}
+		if (! bsb_open_mem(copy, n, &other))
+		{
+			fail(what, -1, -1);
+			continue;
+		}
+		/* the index is only rebuilt when the first row is read */
+		if (other.row_index)
+			fail(what, -1, -1);
+		compare_rows(what, &other, ref);
+		bsb_close(&other);
+	}
+	free(copy);
+	free(data);
+}
+
+#ifndef _WIN32
+/* Whether bsb_open_header() takes the chart from its index cache */
+static int opens_cached(const char *filename, const uint8_t *ref)
+{
+	BSBImage	image;
+	int			cached;
+
+	if (! bsb_open_header((char *)filename, &image))
+	{
+		fail("bsb_open_header", -1, -1);
+		return 0;
+	}
+	cached = image.cache_map != 0;
+	if (ref)
+		compare_rows(cached ? "chart from cache" : "chart without cache", &image, ref);
+	bsb_close(&image);
+	return cached;
+}
+
+/* Offset of a section of an index cache, as stored in its header */
+static uint32_t cache_section(const uint8_t *cache, size_t size, size_t field)
+{
+	uint32_t	offset = 0;
+
+	if (field + 4 <= size)
+		memcpy(&offset, cache + field, 4);
+	return offset < size ? offset : 0;
+}
+#endif
+
+/*
+ * Index cache written and read back, rejected when damaged and ignored
+ * once the chart is rewritten or replaced, even with the same size and
+ * mtime, or only touched.
+ */
+static int check_cache(const char *filename, const char *copy_name)
+{
+#ifdef _WIN32
+	(void)filename;
+	(void)copy_name;
+	return 77;
+#else
+	BSBImage		image;
+	uint8_t			*data, *cache, *ref;
+	uint32_t		row_index, xindex, v;
+	char			cache_name[1024], tmp_name[1024];
+	size_t			size, cache_size;
+	int				height;
+	struct stat		st;
+	struct timespec	times[2];
+
+	snprintf(cache_name, sizeof(cache_name), "%s.bsbidx", copy_name);
+	data = load_file(filename, &size);
+	if (! data || ! save_file(copy_name, data, size))
+		return 1;
+	remove(cache_name);
+	if (! bsb_open_header((char *)copy_name, &image))
+		return 1;
+	ref = read_reference(&image);
+	height = image.height;
+	if (! ref)
+		return 1;
+	if (! bsb_build_xindex(&image, 16) || ! bsb_write_index_cache(&image, copy_name))
+		fail("bsb_write_index_cache", -1, -1);
+	bsb_close(&image);
+
+	/* round trip */
+	if (! opens_cached(copy_name, ref))
+		fail("cache not used", -1, -1);
+
+	/* a damaged row offset */
+	cache = load_file(cache_name, &cache_size);
+	row_index = cache ? cache_section(cache, cache_size, 88) : 0;
+	xindex = cache ? cache_section(cache, cache_size, 92) : 0;
+	if (! row_index || ! xindex || height < 2)
+		return 1;
+	memcpy(&v, cache + row_index + 4, 4);
+	v += 4000;
+	memcpy(cache + row_index + 4, &v, 4);
+	save_file(cache_name, cache, cache_size);
+	if (opens_cached(copy_name, ref))
+		fail("damaged row index used", -1, -1);
+	v -= 4000;
+	memcpy(cache + row_index + 4, &v, 4);
+
+	/* a damaged x checkpoint: the x of the second one of row 0 */
+	memcpy(&v, cache + xindex + 12, 4);
+	v += 100000;
+	memcpy(cache + xindex + 12, &v, 4);
+	save_file(cache_name, cache, cache_size);
+	if (opens_cached(copy_name, ref))
+		fail("damaged x checkpoint used", -1, -1);
+	v -= 100000;
+	memcpy(cache + xindex + 12, &v, 4);
+	save_file(cache_name, cache, cache_size);
+	if (! opens_cached(copy_name, ref))
+		fail("repaired cache not used", -1, -1);
+
+	/* the chart rewritten in place with another row index, same size
+	   and mtime: only its ctime tells */
+	stat(copy_name, &st);
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	data[size - 5] ^= 1;
+	save_file(copy_name, data, size);
+	utimensat(AT_FDCWD, copy_name, times, 0);
+	if (opens_cached(copy_name, 0))
+		fail("stale cache used", -1, -1);
+
+	/* the chart replaced by another file of the same size and mtime */
+	data[size - 5] ^= 1;
+	if (! bsb_open_header((char *)copy_name, &image) || ! bsb_write_index_cache(&image, copy_name))
+		fail("bsb_write_index_cache", -1, -1);
+	bsb_close(&image);
+	stat(copy_name, &st);
+	times[1] = st.st_mtim;
+	snprintf(tmp_name, sizeof(tmp_name), "%s.new", copy_name);
+	save_file(tmp_name, data, size);
+	utimensat(AT_FDCWD, tmp_name, times, 0);
+	rename(tmp_name, copy_name);
+	if (opens_cached(copy_name, ref))
+		fail("cache of a replaced chart used", -1, -1);
+
+	/* only the nanoseconds of the mtime differ */
+	if (! bsb_open_header((char *)copy_name, &image) || ! bsb_write_index_cache(&image, copy_name))
+		fail("bsb_write_index_cache", -1, -1);
+	bsb_close(&image);
+	if (! opens_cached(copy_name, ref))
+		fail("rewritten cache not used", -1, -1);
+	stat(copy_name, &st);
+	times[1] = st.st_mtim;
+	times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+	utimensat(AT_FDCWD, copy_name, times, 0);
+	if (opens_cached(copy_name, ref))
+		fail("cache of another mtime used", -1, -1);
+
+	free(cache);
+	free(ref);
+	free(data);
+	remove(cache_name);
+	return failures != 0;
+#endif
+}
+
+/* requests of a batch and charts (handles) they go to */
+#define BATCH_ROWS		300
+#define BATCH_CHARTS	4
+
+/*
+ * Rows of several charts read in one bsb_read_rows_batch(): the chart
+ * opened with a FILE*, mapped and through user I/O callbacks, and a second
+ * chart.  Every request must give what bsb_read_row_part_r() gives for
+ * the same handle, row and range.
+ */
+static void check_batch(const char *filename, BSBImage *image, const char *second)
+{
+	static const BSBIO	io = { io_read, io_seek, io_size, io_close };
+	BSBImage			charts[BATCH_CHARTS];
+	BSBRowRequest		*reqs;
+	BSBDecodeContext	ctx;
+	uint8_t				*pixels, *want;
+	FILE				*fp;
+	int					i, c, w, max_width = 0, opened = 0;
+
+	if (bsb_open_header_mmap((char *)filename, &charts[0]))
+		opened++;
+	if (opened == 1 && (fp = fopen(filename, "rb")) != 0)
+	{
+		if (bsb_open_io(&io, fp, &charts[1]))
+			opened++;
+		else
+			fclose(fp);
+	}
+	if (opened == 2 && bsb_open_header((char *)second, &charts[2]))
+		opened++;
+	if (opened != 3)
+	{
+		fail("open for batch", -1, -1);
+		for (c = 0; c < opened; c++)
+			bsb_close(&charts[c]);
+		return;
+	}
+	charts[3] = *image;
+	for (c = 0; c < BATCH_CHARTS; c++)
+		if (charts[c].width > max_width)
+			max_width = charts[c].width;
+
+	reqs = (BSBRowRequest *)malloc(BATCH_ROWS * sizeof(BSBRowRequest));
+	pixels = (uint8_t *)malloc((size_t)BATCH_ROWS * max_width);
+	want = (uint8_t *)malloc(max_width);
+	if (! reqs || ! pixels || ! want)
+		exit(1);
+	/* rows out of order, some twice, whole and partial */
+	for (i = 0; i < BATCH_ROWS; i++)
+	{
+		const BSBImage	*chart = &charts[(i * 7) % BATCH_CHARTS];
+
+		w = chart->width;
+		reqs[i].image = chart;
+		reqs[i].row = (i * 37 + i / 50) % chart->height;
+		reqs[i].xoffset = i % 3 == 0 ? 0 : (i * 53) % (w / 2);
+		reqs[i].len = i % 3 == 0 ? w : 1 + (i * 29) % (w - reqs[i].xoffset);
+		reqs[i].buf = pixels + (size_t)i * max_width;
+		reqs[i].ok = 0;
+	}
+
+	bsb_context_init(&ctx);
+	if (! bsb_read_rows_batch(&ctx, reqs, BATCH_ROWS))
+		fail("bsb_read_rows_batch", -1, -1);
+	for (i = 0; i < BATCH_ROWS; i++)
+	{
+		if (! reqs[i].ok ||
+			! bsb_read_row_part_r(reqs[i].image, &ctx, reqs[i].row, want, reqs[i].xoffset, reqs[i].len) ||
+			memcmp(reqs[i].buf, want, reqs[i].len) != 0)
+			fail("bsb_read_rows_batch", reqs[i].row, reqs[i].xoffset);
+	}
+
+	/* a row past the end fails alone */
+	reqs[1].row = reqs[1].image->height;
+	if (bsb_read_rows_batch(&ctx, reqs, 3) || ! reqs[0].ok || reqs[1].ok || ! reqs[2].ok)
+		fail("bsb_read_rows_batch with a bad row", -1, -1);
+	bsb_context_free(&ctx);
+
+	free(want);
+	free(pixels);
+	free(reqs);
+	for (c = 0; c < BATCH_CHARTS - 1; c++)
+		bsb_close(&charts[c]);
+}
+
+/* Whether rounding v like bsb_LLtoXY() could go either way */
+static int near_half(double v)
+{
+	double	d = v + 0.5;
+
+	return fabs(d - floor(d + 0.5)) < 1e-6;
+}
+
+/*
+ * The array transforms compared with bsb_LLtoXY() and bsb_XYtoLL() at the
+ * points of a grid reaching a little beyond the chart.  Only floating
+ * point rounding may differ.
+ */
+static void check_transform(BSBImage *image)
+{
+	double	*px, *py, *lon, *lat, *alon, *alat, *ax, *ay;
+	int		*ix, *iy, n = 0, max, i, x, y, sx, sy;
+
+	max = ((image->width + 20) / 7 + 1) * ((image->height + 20) / 9 + 1);
+	px = (double *)malloc(8 * max * sizeof(double));
+	ix = (int *)malloc(2 * max * sizeof(int));
+	if (! px || ! ix)
+		exit(1);
+	py = px + max;
+	lon = py + max;
+	lat = lon + max;
+	alon = lat + max;
+	alat = alon + max;
+	ax = alat + max;
+	ay = ax + max;
+	iy = ix + max;
+	for (y = -10; y <= image->height + 10; y += 9)
+	{
+		for (x = -10; x <= image->width + 10; x += 7)
+		{
+			px[n] = x;
+			py[n] = y;
+			bsb_XYtoLL(image, x, y, &lon[n], &lat[n]);
+			n++;
+		}
+	}
+
+	if (! bsb_XYtoLL_array(image, n, px, py, alon, alat))
+		fail("bsb_XYtoLL_array", -1, -1);
+	for (i = 0; i < n; i++)
+		if (fabs(alon[i] - lon[i]) > 1e-9 || fabs(alat[i] - lat[i]) > 1e-9)
+			fail("bsb_XYtoLL_array", (int)py[i], (int)px[i]);
+
+	/* an odd number of points, so the tails after the pairs run too */
+	n -= ~n & 1;
+	if (! bsb_LLtoXY_array(image, n, lon, lat, ax, ay) ||
+		! bsb_LLtoXY_array_int(image, n, lon, lat, ix, iy))
+		fail("bsb_LLtoXY_array", -1, -1);
+	for (i = 0; i < n; i++)
+	{
+		bsb_LLtoXY(image, lon[i], lat[i], &sx, &sy);
+		if (((int)(ax[i] + 0.5) != sx && ! near_half(ax[i])) ||
+			((int)(ay[i] + 0.5) != sy && ! near_half(ay[i])))
+			fail("bsb_LLtoXY_array", (int)py[i], (int)px[i]);
+		if ((ix[i] != sx && ! near_half(ax[i])) || (iy[i] != sy && ! near_half(ay[i])))
+			fail("bsb_LLtoXY_array_int", (int)py[i], (int)px[i]);
+	}
+
+	free(ix);
+	free(px);
+}
+
+/* The 12 term polynomial as the library evaluated it before the evaluators per order */
+static double full_poly(const double *c, double lon, double lat)
+{
+	return c[0] + c[1] * lon + c[2] * lat + c[3] * lon * lon + c[4] * lon * lat +
+		c[5] * lat * lat + c[6] * lon * lon * lon + c[7] * lon * lon * lat +
+		c[8] * lon * lat * lat + c[9] * lat * lat * lat + c[10] * lat * lat * lat * lat +
+		c[11] * lat * lat * lat * lat * lat;
+}
+
+/* Number of terms of the evaluator for the pair of polynomials a, b */
+static int poly_terms(const double *a, const double *b)
+{
+	int		n = 12;
+
+	while (n > 3 && a[n - 1] == 0 && b[n - 1] == 0)
+		n--;
+	return n <= 3 ? 3 : n <= 6 ? 6 : n <= 10 ? 10 : 12;
+}
+
+static int same_value(double a, double b)
+{
+	return fabs(a - b) <= 1e-9 * (fabs(b) + 1);
+}
+
+/*
+ * The evaluators picked for the order of the chart's polynomials, scalar
+ * and for arrays, compared with the full 12 term polynomials at the
+ * points of a grid reaching a little beyond the chart.
+ */
+static void check_kernels(BSBImage *image)
+{
+	double	lon, lat, rlon, rlat, rx, ry, ax, ay, alon, alat, u, v;
+	int		x, y, sx, sy;
+
+	if (image->wp_terms != poly_terms(image->wpx, image->wpy) ||
+		image->pw_terms != poly_terms(image->pwx, image->pwy))
+		fail("number of polynomial terms", -1, -1);
+	for (y = -10; y <= image->height + 10; y += 9)
+	{
+		for (x = -10; x <= image->width + 10; x += 7)
+		{
+			u = x;
+			v = y;
+			rlon = full_poly(image->pwx, x, y);
+			rlon = rlon < 0 ? rlon + image->cph : rlon - image->cph;
+			rlat = full_poly(image->pwy, x, y);
+			bsb_XYtoLL(image, x, y, &lon, &lat);
+			bsb_XYtoLL_array(image, 1, &u, &v, &alon, &alat);
+			if (! same_value(lon, rlon) || ! same_value(lat, rlat) ||
+				! same_value(alon, rlon) || ! same_value(alat, rlat))
+				fail("pixel to world evaluator", y, x);
+
+			u = lon < 0 ? lon + image->cph : lon - image->cph;
+			rx = full_poly(image->wpx, u, lat);
+			ry = full_poly(image->wpy, u, lat);
+			bsb_LLtoXY(image, lon, lat, &sx, &sy);
+			bsb_LLtoXY_array(image, 1, &lon, &lat, &ax, &ay);
+			if (! same_value(ax, rx) || ! same_value(ay, ry) ||
+				((int)(rx + 0.5) != sx && ! near_half(rx)) ||
+				((int)(ry + 0.5) != sy && ! near_half(ry)))
+				fail("world to pixel evaluator", y, x);
+		}
+	}
+}
+
+/*
+ * bsb_XYtoLL_row() and bsb_LLtoXY_row() interpolated from lattices of a
+ * few node distances and error bounds, compared with the polynomials
+ * (bsb_XYtoLL_array(), bsb_LLtoXY_array()) on rows across the chart and
+ * the border and a little beyond them
+ */
+static void check_lattice(BSBImage *image)
+{
+	static const int	steps[3] = { 0, 16, 100 };
+	static const double	errors[3] = { 0, 0.01, 0.2 };
+	double	*u, *v, *a, *b, *ra, *rb, bound_lon, bound_lat, error;
+	double	lon0 = 1e9, lon1 = -1e9, lat0 = 1e9, lat1 = -1e9, lon, dlon, dlat;
+	int		n = image->width + 40, t, k, i, y, row;
+
+	u = (double *)malloc(6 * n * sizeof(double));
+	if (! u)
+		exit(1);
+	v = u + n;
+	a = v + n;
+	b = a + n;
+	ra = b + n;
+	rb = ra + n;
+
+	/* longitudes in the phase of the chart, like bsb_LLtoXY() */
+	for (i = 0; i < image->num_plys; i++)
+	{
+		lon = image->ply[i].lon < 0 ? image->ply[i].lon + image->cph : image->ply[i].lon - image->cph;
+		lon0 = lon < lon0 ? lon : lon0;
+		lon1 = lon > lon1 ? lon : lon1;
+		lat0 = image->ply[i].lat < lat0 ? image->ply[i].lat : lat0;
+		lat1 = image->ply[i].lat > lat1 ? image->ply[i].lat : lat1;
+	}
+	dlon = (lon1 - lon0) / (n - 40);
+	dlat = (lat1 - lat0) / 100;
+
+	for (t = 0; t < 3; t++)
+	{
+		if (! bsb_build_transform_lattice(image, steps[t], errors[t]))
+		{
+			fail("bsb_build_transform_lattice", -1, -1);
+			continue;
+		}
+		/* the bounds as documented: for XYtoLL in degrees from the span of the corners */
+		error = errors[t] > 0 ? errors[t] : 0.05;
+		bound_lon = error * fabs(full_poly(image->pwx, image->width, 0) - full_poly(image->pwx, 0, 0)) / image->width;
+		bound_lat = error * fabs(full_poly(image->pwy, 0, image->height) - full_poly(image->pwy, 0, 0)) / image->height;
+
+		for (y = -5; y <= image->height + 5; y += 3)
+		{
+			for (k = 0; k < n; k++)
+			{
+				u[k] = -20 + k * 1.0;
+				v[k] = y;
+			}
+			if (! bsb_XYtoLL_row(image, y, -20, 1.0, n, a, b) ||
+				! bsb_XYtoLL_array(image, n, u, v, ra, rb))
+				fail("bsb_XYtoLL_row", y, -1);
+			for (k = 0; k < n; k++)
+				if (fabs(a[k] - ra[k]) > bound_lon * (1 + 1e-9) ||
+					fabs(b[k] - rb[k]) > bound_lat * (1 + 1e-9))
+					fail("bsb_XYtoLL_row", y, (int)u[k]);
+		}
+
+		/* from a little west of the border eastwards, past 180 with cph */
+		for (row = -10; row <= 110; row++)
+		{
+			double	lat = lat0 + row * dlat, west = lon0 - 20 * dlon + image->cph;
+
+			for (k = 0; k < n; k++)
+			{
+				u[k] = west + k * dlon;
+				v[k] = lat;
+			}
+			if (! bsb_LLtoXY_row(image, lat, west, dlon, n, a, b) ||
+				! bsb_LLtoXY_array(image, n, u, v, ra, rb))
+				fail("bsb_LLtoXY_row", row, -1);
+			for (k = 0; k < n; k++)
+				if (fabs(a[k] - ra[k]) > error * (1 + 1e-9) || fabs(b[k] - rb[k]) > error * (1 + 1e-9))
+					fail("bsb_LLtoXY_row", row, k);
+		}
+	}
+	free(u);
+}
+
+/*
+ * Chart pixel bsb_read_mercator() should sample for a position, 0 off the
+ * chart.  Returns 0 where bsb_LLtoXY() cannot tell: its truncation toward
+ * zero makes -0.8 pixel 0 like 0.4, so the outer pixels are not checked.
+ */
+static int mercator_ref(BSBImage *image, const uint8_t *ref, double lon, double lat, int *color)
+{
+	int	x, y;
+
+	bsb_LLtoXY(image, lon, lat, &x, &y);
+	if (x == 0 || y == 0 || x == image->width - 1 || y == image->height - 1)
+		return 0;
+	*color = x > 0 && y > 0 && x < image->width && y < image->height ?
+			 ref[(size_t)y * image->width + x] : 0;
+	return 1;
+}
+
+/* Whether a color is what the chart has within tolerance pixels of a position */
+static int mercator_near(const BSBImage *image, const uint8_t *ref, double lon, double lat,
+						 double tolerance, int color)
+{
+	double	xd, yd, dx, dy;
+	int		x, y;
+
+	bsb_LLtoXY_array(image, 1, &lon, &lat, &xd, &yd);
+	for (dx = -tolerance; dx <= tolerance; dx += tolerance)
+		for (dy = -tolerance; dy <= tolerance; dy += tolerance)
+		{
+			x = (int)floor(xd + dx + 0.5);
+			y = (int)floor(yd + dy + 0.5);
+			if (color == (x >= 0 && y >= 0 && x < image->width && y < image->height ?
+						  ref[(size_t)y * image->width + x] : 0))
+				return 1;
+		}
+	return 0;
+}
+
+/*
+ * Web Mercator output around the chart compared with bsb_LLtoXY() of every
+ * pixel centre, first evaluating the polynomials, then interpolating them
+ * (where the sampled pixel may be off by the lattice error).  The output
+ * must not depend on the number of threads, and charts without WPX/WPY
+ * polynomials cannot be reprojected.
+ */
+static void check_mercator(BSBImage *image, const uint8_t *ref)
+{
+	double	south = 1e9, west = 1e9, north = -1e9, east = -1e9, mx, my, res, lon, lat;
+	int		w = 300, h = 240, pass, x, y, i, color, c, tested = 0;
+	uint8_t	*out = (uint8_t *)malloc(2 * w * h), *other = out + w * h;
+
+	if (! out)
+		exit(1);
+	if (! image->num_wpxs)
+	{
+		if (bsb_read_mercator(image, 0, 0, 1, w, h, out, 0, 1, BSB_PIXEL_INDEX, BSB_SAMPLE_NEAREST) ||
+			bsb_read_mercator_tile(image, 0, 0, 0, 16, out, 0, 1, BSB_PIXEL_INDEX, BSB_SAMPLE_NEAREST))
+			fail("bsb_read_mercator without WPX", -1, -1);
+		free(out);
+		return;
+	}
+
+	/* the PLY bounding box with a margin, continuous across 180 with cph */
+	for (i = 0; i < image->num_plys; i++)
+	{
+		lon = image->ply[i].lon < 0 ? image->ply[i].lon + image->cph : image->ply[i].lon - image->cph;
+		west = lon < west ? lon : west;
+		east = lon > east ? lon : east;
+		south = image->ply[i].lat < south ? image->ply[i].lat : south;
+		north = image->ply[i].lat > north ? image->ply[i].lat : north;
+	}
+	west += image->cph;
+	east += image->cph;
+	mx = (west - (east - west) * 0.1) / DEGREES * MERCATOR_RADIUS;
+	res = (east - west) * 1.2 / DEGREES * MERCATOR_RADIUS / w;
+	my = log(tan((90 + north + (north - south) * 0.1) / 2 / DEGREES)) * MERCATOR_RADIUS;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		if (pass == 1 && ! bsb_build_transform_lattice(image, 0, 0))
+			fail("bsb_build_transform_lattice", -1, -1);
+		if (! bsb_read_mercator(image, mx, my, res, w, h, out, 0, 0, BSB_PIXEL_INDEX, BSB_SAMPLE_NEAREST))
+		{
+			fail("bsb_read_mercator", -1, -1);
+			continue;
+		}
+		for (i = 1; i <= 3; i += 2)
+			if (! bsb_read_mercator(image, mx, my, res, w, h, other, 0, i, BSB_PIXEL_INDEX, BSB_SAMPLE_NEAREST) ||
+				memcmp(out, other, w * h) != 0)
+				fail("bsb_read_mercator with threads", i, -1);
+		for (y = 0; y < h; y++)
+		{
+			lat = atan(sinh((my - (y + 0.5) * res) / MERCATOR_RADIUS)) * DEGREES;
+			for (x = 0; x < w; x++)
+			{
+				lon = (mx + (x + 0.5) * res) / MERCATOR_RADIUS * DEGREES;
+				lon = lon > 180 ? lon - 360 : lon;
+				if (! mercator_ref(image, ref, lon, lat, &color))
+					continue;
+				c = out[y * w + x];
+				if (c == color)
+					tested++;
+				else if (! mercator_near(image, ref, lon, lat, pass ? 0.05 : 1e-6, c))
+					fail("bsb_read_mercator", y, x);
+			}
+		}
+	}
+	if (tested < w * h)
+		fail("bsb_read_mercator pixels tested", tested, 0);
+	free(out);
+}
+
+/* Longitude in the phase of the chart, as bsb_LLtoXY() uses it */
+static double phase_lon(const BSBImage *image, double lon)
+{
+	return lon < 0 ? lon + image->cph : lon - image->cph;
+}
+
+/* bsb_contains() compared with an even-odd test of every PLY edge */
+static void check_contains(BSBImage *image)
+{
+	double	south, west, north, east, lat, lon, plon, near, lo[2], hi[2];
+	int		i, j, n = image->num_plys, inside, tested = 0;
+
+	if (n < 3 || ! bsb_bbox(image, &south, &west, &north, &east))
+	{
+		fail("bsb_bbox", -1, -1);
+		return;
+	}
+	/* the box of the PLY points, longitudes taken back out of the chart's phase */
+	lo[0] = lo[1] = 1e9;
+	hi[0] = hi[1] = -1e9;
+	for (j = 0; j < n; j++)
+	{
+		plon = phase_lon(image, image->ply[j].lon);
+		lo[0] = image->ply[j].lat < lo[0] ? image->ply[j].lat : lo[0];
+		hi[0] = image->ply[j].lat > hi[0] ? image->ply[j].lat : hi[0];
+		lo[1] = plon < lo[1] ? plon : lo[1];
+		hi[1] = plon > hi[1] ? plon : hi[1];
+	}
+	if (south != lo[0] || north != hi[0] ||
+		fabs(west - phase_lon(image, lo[1])) > 1e-9 || fabs(east - phase_lon(image, hi[1])) > 1e-9)
+		fail("bsb_bbox", -1, -1);
+	if (east < west)
+		east += 360;
+	for (i = 0; i < 40000; i++)
+	{
+		/* grid over the bounding box and around it, off the vertices */
+		lat = south + (north - south) * ((i / 200) / 166.1 - 0.1003);
+		lon = west + (east - west) * ((i % 200) / 166.3 - 0.1007);
+		lon = lon > 180 ? lon - 360 : lon;
+
+		plon = phase_lon(image, lon);
+		near = 1;
+		inside = 0;
+		for (j = 0; j < n; j++)
+		{
+			const struct PLY	*a = &image->ply[j], *b = &image->ply[(j + 1) % n];
+			double				alon = phase_lon(image, a->lon), blon = phase_lon(image, b->lon);
+
+			if ((a->lat > lat) != (b->lat > lat))
+			{
+				double	cross = alon + (lat - a->lat) * (blon - alon) / (b->lat - a->lat);
+				if (plon < cross)
+					inside = ! inside;
+				near = fabs(plon - cross) < near ? fabs(plon - cross) : near;
+			}
+		}
+		/* points right on an edge may go either way */
+		if (near < 1e-9)
+			continue;
+		tested++;
+		if (bsb_contains(image, lat, lon) != inside)
+			fail("bsb_contains", (int)(lat * 1000), (int)(lon * 1000));
+	}
+	if (tested < 30000)
+		fail("bsb_contains points tested", tested, 0);
+}
+
+extern int main (int argc, char *argv[])
+{
+	BSBImage	image;
+	uint8_t		*ref;
+	const char	*what;
+	int			status = 0, xindex = 0;
+
+	/* -x: read with x checkpoints */
+	if (argc > 1 && strcmp(argv[1], "-x") == 0)
+	{
+		xindex = 1;
+		argc--;
+		argv++;
+	}
+	if (argc < 3)
+	{
+		fprintf(stderr, "Usage:\n\tbsbtest [-x] check input.kap [output]\n");
+		exit(1);
+	}
+	what = argv[1];
+	if (strncmp(what, "synth", 5) == 0)
+		return ! write_synthetic(argv[2], strcmp(what, "synth-cph") == 0);
+	if (strcmp(what, "cache") == 0 && argc > 3)
+		return check_cache(argv[2], argv[3]);
+	if (strcmp(what, "parser") == 0)
+	{
+		check_parser(argv[2]);
+		return failures != 0;
+	}
+
+	if (! bsb_open_header(argv[2], &image))
+		exit(1);
+	ref = read_reference(&image);
+	if (! ref)
+		exit(1);
+	if (xindex && ! bsb_build_xindex(&image, 16))
+		fail("bsb_build_xindex", -1, -1);
+
+	if (strcmp(what, "mmap") == 0)
+		check_mmap(argv[2], ref);
+	else if (strcmp(what, "image") == 0)
+		check_image(&image, ref);
+	else if (strcmp(what, "part") == 0)
+		check_part(&image, ref);
+	else if (strcmp(what, "runs") == 0)
+		check_runs(&image, ref);
+	else if (strcmp(what, "rgb") == 0)
+		check_rgb(&image, ref);
+	else if (strcmp(what, "decimated") == 0)
+		check_decimated(&image, ref);
+	else if (strcmp(what, "overview") == 0)
+		check_overview(&image, ref);
+	else if (strcmp(what, "window") == 0)
+		check_window(&image, ref);
+	else if (strcmp(what, "header-only") == 0)
+		check_header_only(argv[2], &image, ref);
+	else if (strcmp(what, "open") == 0)
+		check_open(argv[2], &image, ref);
+	else if (strcmp(what, "no1") == 0 && argc > 3)
+		check_no1(argv[2], argv[3], ref);
+	else if (strcmp(what, "index") == 0)
+		check_index(argv[2], &image, ref);
+	else if (strcmp(what, "batch") == 0 && argc > 3)
+		check_batch(argv[2], &image, argv[3]);
+	else if (strcmp(what, "transform") == 0)
+		check_transform(&image);
+	else if (strcmp(what, "kernels") == 0)
+		check_kernels(&image);
+	else if (strcmp(what, "lattice") == 0)
+		check_lattice(&image);
+	else if (strcmp(what, "mercator") == 0)
+		check_mercator(&image, ref);
+	else if (strcmp(what, "contains") == 0)
+		check_contains(&image);
+	else if (strcmp(what, "threads") == 0)
+		status = check_threads(argv[2], &image, ref);
+	else
+	{
+		fprintf(stderr, "unknown check %s\n", what);
+		exit(1);
+	}
+
+	free(ref);
+	bsb_close(&image);
+	return status == 77 ? 77 : failures != 0;
+}
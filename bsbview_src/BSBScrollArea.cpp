@@ -82,8 +82,10 @@ bool BSBScrollArea::setChartFile(const char* filename)
 {
     bool success = true;
     BSBImage* b = new BSBImage();
-    if ( bsb_open_header((char*)filename, b) )
+    if ( bsb_open_header_mmap((char*)filename, b) )
     {
+        // tiles are read in bands while panning, prefetch a tile's rows around them
+        bsb_set_access_pattern(b, BSB_ACCESS_BANDS, BSBWidget::TILESIZE);
         delete bsb;
         bsb = b;
         printf("Opened: %s\n",filename);
@@ -185,7 +185,7 @@ void BSBWidget::screenToLLStr(int x, int y, char* s)
 
 /**
  * Creates a single tile (part of image) of given coordinates and zoom.
- * Uses smooth (and slow) algorithm for scaling.
+ * Uses smooth (area averaging) algorithm for scaling.
  *
  * @param xc chart offset that tile should include
  * @param yc chart offset that tile should include
@@ -195,36 +195,20 @@ void BSBWidget::screenToLLStr(int x, int y, char* s)
  QImage* BSBWidget::makeTileSmooth(int xc, int yc, int zoom, const int TILESIZEX, const int TILESIZEY)
 {
     //printf("mts %d %d %d %08x\n", xc, yc, zoom, tileID(xc,yc,zoom) );	
-    QImage img( TILESIZEX*zoom, TILESIZEY*zoom, QImage::Format_Indexed8 );
+    QImage img( TILESIZEX, TILESIZEY, QImage::Format_RGB32 );
     if( img.isNull() )
     {
         printf("QImage isNull: (x,y,w,h,z)=%d,%d,%d,%d,%d\n", xc, yc, TILESIZEX, TILESIZEY, zoom);
         return 0;
     }
-	img.setNumColors( m_bsb->num_colors );
-	for ( int col = 0; col < m_bsb->num_colors; col++ )
-	{
-		img.setColor( col, qRgb( m_bsb->red[col], m_bsb->green[col], m_bsb->blue[col] ) );
-	}
-	//img.fill(0);
+	img.fill(0);
 	int xo = xc/*(xc/TILESIZEX)*TILESIZEY*/;
 	int yo = yc/*(yc/TILESIZEY)*TILESIZEY*/;
 	if( xo >= m_bsb->width ) printf("xo=%d width=%d\n", xo, m_bsb->width );	
-	for ( int y = 0; y < img.height(); y++ )
-	{
-		uchar* ppix = img.scanLine(y);		
-		if( yo+y < m_bsb->height )
-		{		
-			// tile goes over the chart on the right
-			bsb_read_row_part( m_bsb, yo+y, ppix, xo, TILESIZEX*zoom );
-		}
-		else // tile goes over the chart on the bottom
-		    memcpy(ppix, img.scanLine(y-1), img.width());
-			//memset( ppix, 0, img.width() );
-	}
-    return new QImage(img.scaled(TILESIZEX,TILESIZEY,
-                                 Qt::IgnoreAspectRatio, 
-                                 Qt::SmoothTransformation));
+	// each tile pixel averages zoom x zoom chart pixels, computed from runs
+	bsb_read_overview( m_bsb, xo, yo, TILESIZEX, TILESIZEY, zoom,
+	                   img.bits(), img.bytesPerLine(), 0, BSB_PIXEL_ARGB32 );
+    return new QImage(img);
 }
 
 
@@ -262,25 +246,15 @@ QImage* BSBWidget::makeTileQuick(int xo, int yo, int zoom, const int TILESIZEX,
         {
             img.setColor( col, qRgb( m_bsb->red[col], m_bsb->green[col], m_bsb->blue[col] ) );
         }
-        int xs = TILESIZEX*zoom;
-        uint8_t* row = new uint8_t[xs];
-        memset( row, 0, xs );
-        for ( int y = 0; y < TILESIZEY; y++ )
+        // number of subsamples falling into the chart, the rest stays 0
+        int xs = xc < m_bsb->width ? (m_bsb->width-xc+zoom-1)/zoom : 0;
+        if( xs > TILESIZEX ) xs = TILESIZEX;
+        for ( int y = 0; y < TILESIZEY && xs > 0; y++ )
         {
             int yy = yc+y*zoom;
             if( yy < m_bsb->height )
-                bsb_read_row_part( m_bsb, yy, row, xc, xs );
-            else
-                memset( row, 0, xs );
-            uchar* ppix = img.scanLine(y);
-            for ( int x = 0; x < TILESIZEX; x++ )
-            {
-                int xx = x*zoom;
-                int col = row && xx >=0 && xx < m_bsb->width ? row[xx] : 0;
-                *ppix++ = col;
-            }
+                bsb_read_row_decimated( m_bsb, yy, img.scanLine(y), xc, xs, zoom );
         }
-        delete[] row;
         return new QImage(img);
     }
     else // enlarge
@@ -305,15 +279,10 @@ QImage* BSBWidget::makeTileQuick(int xo, int yo, int zoom, const int TILESIZEX,
         {
             img.setColor( col, qRgb( m_bsb->red[col], m_bsb->green[col], m_bsb->blue[col] ) );
         }
-        for ( int y = 0; y < TILESIZEY/zoom; y++ )
-        {
-            uchar* ppix = img.scanLine(y);
-            int yy = yc+y;
-            if( yy < m_bsb->height )
-                bsb_read_row_part( m_bsb, yy, ppix, xc, img.width() );
-            else
-                memset(ppix,0, img.width());
-        }
+        // all rows of the tile are fetched with one read
+        if( xc < m_bsb->width && yc < m_bsb->height )
+            bsb_read_window( m_bsb, xc, yc, img.width(), img.height(),
+                             img.bytesPerLine(), img.bits() );
         // scale it up
         return new QImage(img.scaled(TILESIZEX,TILESIZEY,
                                      Qt::IgnoreAspectRatio, 
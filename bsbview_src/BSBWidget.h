@@ -57,7 +57,8 @@ class BSBWidget : public QWidget
     enum
     {
         MAXZOOM =  10,
-        MINZOOM = -10
+        MINZOOM = -10,
+        TILESIZE = 200      // default width and height of a tile
     };
 
 protected:
@@ -68,8 +69,8 @@ protected:
 
     virtual void paintEvent( QPaintEvent * );
 
-    QImage* makeTileQuick(int xc, int yc, int zoom, const int TILESIZEX = 200,const int TILESIZEY = 200);
-    QImage* makeTileSmooth(int xc, int yc, int zoom, const int TILESIZEX = 200,const int TILESIZEY = 200);
+    QImage* makeTileQuick(int xc, int yc, int zoom, const int TILESIZEX = TILESIZE,const int TILESIZEY = TILESIZE);
+    QImage* makeTileSmooth(int xc, int yc, int zoom, const int TILESIZEX = TILESIZE,const int TILESIZEY = TILESIZE);
 
 private:
     BSBImage*  m_bsb;
@@ -9,4 +9,4 @@ INCLUDEPATH += c:/msys/1.0/local/include
 # Input
 HEADERS += BSBWidget.h BSBMainWindow.h BSBScrollArea.h
 SOURCES += BSBWidget.cpp BSBMainWindow.cpp BSBScrollArea.cpp main.cpp 
-LIBS += -lbsb -L.. -L/local/lib 
+LIBS += -lbsb -lm -lpthread -L.. -L/local/lib 